@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "HttpHls.hh"
+#include "HttpSubscribe.hh"
+
+constexpr char http_not_found[] = "HTTP/1.1 404 Not Found\r\n"
+                                  "Connection: close\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "\r\n";
+
+constexpr char http_bad_request[] = "HTTP/1.1 400 Bad Request\r\n"
+                                    "Connection: close\r\n"
+                                    "Content-Length: 0\r\n"
+                                    "\r\n";
+
+behavior HttpHls(HttpHlsBroker* self,
+                 connection_handle hdl,
+                 const std::string& file,
+                 const std::string& query) {
+  self->state.handle = hdl;
+  self->state.quiting = false;
+
+  // LL-HLS blocking playlist reload
+  int64_t msn = -1, part = -1;
+  auto params = http::parseQuery(query);
+  if (params.count("_HLS_msn")) {
+    msn = strtoll(params["_HLS_msn"].c_str(), nullptr, 10);
+  }
+  // without _HLS_msn too, for the publisher to answer 400
+  if (params.count("_HLS_part")) {
+    part = strtoll(params["_HLS_part"].c_str(), nullptr, 10);
+  }
+
+  self->set_down_handler([=](const down_msg& msg) {
+    printf("down_msg(%p)\n", self);
+    if (self->state.answered) {
+      // the response is out already, data_transferred_msg closes
+      return;
+    }
+    if (!self->state.quiting) {
+      self->write(hdl, strlen(http_error), http_error);
+      self->flush(hdl);
+    }
+    self->close(hdl);
+    self->quit();
+  });
+
+  return {
+    [=](const new_data_msg& msg) {
+    },
+
+    [=](sub_init_atom, const actor& publisher) {
+      self->state.publisher = publisher;
+      if (self->state.quiting) {
+        self->quit();
+        return;
+      }
+      self->monitor(publisher);
+      self->send(publisher,
+                 hls_get_atom::value,
+                 file,
+                 msn,
+                 part,
+                 self->address());
+    },
+
+    [=](hls_resp_atom, int64_t some, int status) {
+      FlvPacketList* chunks = (FlvPacketList*)some;
+      if (!self->state.quiting) {
+        if (status == 200) {
+          size_t length = 0;
+          for (const auto& chunk : *chunks) {
+            length += chunk.payload->size();
+          }
+          bool m3u8 = file == "index.m3u8";
+          std::stringstream ss;
+          ss << "HTTP/1.1 200 OK\r\n"
+             << "Connection: close\r\n"
+             << "Access-Control-Allow-Origin: *\r\n"
+             << "Cache-Control: "
+             << (m3u8 ? "no-cache" : "max-age=60") << "\r\n"
+             << "Content-Type: "
+             << (m3u8 ? "application/vnd.apple.mpegurl" : "video/mp2t")
+             << "\r\n"
+             << "Content-Length: " << length << "\r\n"
+             << "\r\n";
+          auto hdr = ss.str();
+          self->write(hdl, hdr.size(), hdr.data());
+          for (const auto& chunk : *chunks) {
+            self->write(hdl, chunk.payload->size(),
+                        chunk.payload->constBytes());
+          }
+        } else if (status == 400) {
+          self->write(hdl, strlen(http_bad_request), http_bad_request);
+        } else {
+          self->write(hdl, strlen(http_not_found), http_not_found);
+        }
+        self->ack_writes(hdl, true);
+        self->flush(hdl);
+      }
+      self->send(self->state.publisher, reclaim_atom::value, some);
+      self->state.answered = true;
+      if (self->state.quiting) {
+        self->quit();
+      }
+    },
+
+    [=](const data_transferred_msg& msg) {
+      if (msg.remaining == 0) {
+        self->close(hdl);
+        self->quit();
+      }
+    },
+
+    [=](const connection_closed_msg& msg) {
+      printf("connection_closed_msg(%p)\n", self);
+      self->state.quiting = true;
+      if (self->state.answered) {
+        self->quit();
+      }
+    }
+  };
+}
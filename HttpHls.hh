@@ -0,0 +1,116 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include "hls.hh"
+#include "config.hh"
+#include "HttpPublish.hh"
+
+struct HttpHlsState {
+  actor publisher;
+  connection_handle handle;
+  bool answered {false};
+  bool quiting {false};
+};
+
+using hls_get_atom = atom_constant<atom("hls_get")>;
+using hls_resp_atom = atom_constant<atom("hls_resp")>;
+using hls_check_atom = atom_constant<atom("hls_check")>;
+
+using HttpHlsBroker = caf::stateful_actor<HttpHlsState, broker>;
+behavior HttpHls(HttpHlsBroker* self,
+                 connection_handle hdl,
+                 const std::string& file,
+                 const std::string& query);
+
+// Publisher side, shared by HttpPublish and HttpRevPublish. Both keep an
+// HlsContext named `hls` next to their `cache`.
+
+template <class Broker>
+void hlsWake(Broker* self, bool force) {
+  auto& hls = self->state.hls;
+  if (hls.pending.empty() ||
+      (!force && hls.version == hls.segmenter->version())) {
+    return;
+  }
+  hls.version = hls.segmenter->version();
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto it = hls.pending.begin(); it != hls.pending.end();) {
+    bool expired = now >= it->deadline;
+    FlvPacketList* chunks = new FlvPacketList;
+    int status = 200;
+    if (it->file == "index.m3u8") {
+      if (!hls.segmenter->ready(it->msn, it->part) && !expired) {
+        delete chunks;
+        ++it;
+        continue;
+      }
+      std::string m3u8 = hls.segmenter->playlist();
+      FlvPacket pkt;
+      pkt.payload = byte_t::create((uint8_t*)&m3u8[0], m3u8.size());
+      chunks->push_back(pkt);
+    } else {
+      auto err = hls.segmenter->get(it->file, *chunks);
+      if (err == FlvPacketCache::AGAIN && !expired) {
+        delete chunks;
+        ++it;
+        continue;
+      } else if (err != FlvPacketCache::OK) {
+        status = 404;
+      }
+    }
+    self->send(actor_cast<actor>(it->requester),
+               hls_resp_atom::value,
+               (int64_t)chunks,
+               status);
+    it = hls.pending.erase(it);
+  }
+}
+
+template <class Broker>
+void hlsGet(Broker* self,
+            const std::string& file,
+            int64_t msn,
+            int64_t part,
+            const actor_addr& requester) {
+  auto& hls = self->state.hls;
+  auto& cfg = getConfig(self->system());
+  if (!hls.segmenter) {
+    hls.segmenter.reset(new HlsSegmenter(cfg.hls_segment_ms,
+                                         cfg.hls_part_ms,
+                                         cfg.hls_segments));
+    // start from what is already cached, then follow the stream
+    auto& cache = self->state.cache;
+    FlvPacketList pkts(cache.getDCR());
+    cache.getAll(-1, pkts);
+    for (auto& pkt : pkts) {
+      hls.segmenter->onPacket(pkt);
+      pkt.payload->release();
+    }
+    cache.addSink(hls.segmenter.get());
+  }
+
+  if (file == "index.m3u8" && !hls.segmenter->valid(msn, part)) {
+    self->send(actor_cast<actor>(requester),
+               hls_resp_atom::value,
+               (int64_t)new FlvPacketList,
+               400);
+    return;
+  }
+
+  // blocking requests give up after three target durations
+  auto timeout = std::chrono::milliseconds(3 * cfg.hls_segment_ms);
+  hls.pending.push_back(HlsPending {
+    requester, file, msn, part,
+    std::chrono::steady_clock::now() + timeout
+  });
+  hlsWake(self, true);
+  if (!hls.pending.empty()) {
+    self->delayed_send(self, timeout, hls_check_atom::value);
+  }
+}
@@ -6,31 +6,215 @@
 #include "HttpMaster.hh"
 #include "HttpSubscribe.hh"
 #include "HttpRevPublish.hh"
+#include "HttpHls.hh"
+#include "HttpVod.hh"
+#include "relay.hh"
+#include "tls.hh"
+#include <unistd.h>
+#include <sys/stat.h>
+
+// "/live/foo/index.m3u8" -> ("/live/foo", "index.m3u8"), same for the
+// "<seq>.ts" and "<seq>.<part>.ts" files next to it.
+static bool splitHlsPath(const std::string& path,
+                         std::string& stream,
+                         std::string& file) {
+  auto slash = path.rfind('/');
+  if (slash == std::string::npos || slash == 0) {
+    return false;
+  }
+  file = path.substr(slash + 1);
+  stream = path.substr(0, slash);
+  return file == "index.m3u8" ||
+         (file.size() > 3 && file.compare(file.size() - 3, 3, ".ts") == 0);
+}
+
+// "/live/foo.mp4" -> "/live/foo", played as fragmented mp4.
+static bool stripMp4Suffix(std::string& path) {
+  if (path.size() <= 4 || path.compare(path.size() - 4, 4, ".mp4") != 0) {
+    return false;
+  }
+  path.erase(path.size() - 4);
+  return true;
+}
+
+// The file under the [vod] directory a GET path names, if any.
+static bool vodPath(HttpMasterBroker* self,
+                    const std::string& path,
+                    std::string& file) {
+  auto& dir = getConfig(self->system()).vod_dir;
+  struct stat st;
+  if (dir.empty() || path.find("..") != std::string::npos) {
+    return false;
+  }
+  file = dir + path;
+  return stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// Streams are ranked by how often they were requested, smoothed over
+// the last few rankings.
+static const auto RANK_INTERVAL = std::chrono::seconds(10);
+static const double RANK_ALPHA = 0.5;
+
+// What of a viewer's query goes to the origin with the pull: not what
+// only shapes that viewer's own stream (tracks, pacing, DVR offset,
+// resuming, format), the pull is shared by all the viewers to come.
+// The rest, such as auth tokens, is passed on as it came.
+static std::string originQuery(const std::string& query) {
+  static const char* const local[] = {
+    "only", "delay_ms", "offset", "resume_from", "ts_base", "epoch", "format"
+  };
+  std::string res;
+  size_t pos = 0;
+  while (pos < query.size()) {
+    size_t end = query.find('&', pos);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    auto param = query.substr(pos, end - pos);
+    auto name = param.substr(0, param.find('='));
+    pos = end + 1;
+    if (name.empty() ||
+        std::any_of(std::begin(local), std::end(local),
+                    [&](const char* l) { return name == l; })) {
+      continue;
+    }
+    res += (res.empty() ? "" : "&") + param;
+  }
+  return res;
+}
+
+// Starts pulling `path` (as `res_path`, with the query) from the best
+// origin that takes the connection: a peer that has the stream pushed
+// to it first, then the upstreams. An invalid actor if none did.
+static actor spawnPull(HttpMasterBroker* self,
+                       const std::string& path,
+                       const std::string& res_path) {
+  auto& state = self->state;
+  auto origins = state.upstreams.route(path);
+  Upstream peer;
+  auto loc = state.located.find(path);
+  if (loc != std::end(state.located) &&
+      Upstream::fromUrl(loc->second, peer)) {
+    origins.insert(origins.begin(), peer);
+  }
+
+  actor client;
+  for (size_t i = 0; i < origins.size() && !client; i++) {
+    auto start = std::chrono::steady_clock::now();
+    auto res =
+      self->parent().spawn_client(HttpRevPublish,
+                                  origins[i].host,
+                                  origins[i].port,
+                                  origins,
+                                  i,
+                                  res_path,
+                                  self->address());
+    if (!res) {
+      state.upstreams.report(origins[i].name(), false, -1, -1);
+      continue;
+    }
+    client = *res;
+    state.pulled[client] = origins[i].name();
+    state.upstreams.acquire(origins[i].name());
+    state.upstreams.report(
+      origins[i].name(), true,
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count(),
+      -1);
+  }
+  if (client) {
+    self->monitor(client);
+    self->link_to(client);
+    state.publishers.insert(
+      HttpMasterState::PublisherMap::value_type(path, client));
+  }
+  return client;
+}
+
+// [publish] fanout: a plain FLV viewer's socket goes to `publisher`.
+// The scribe is dropped, which only shuts down its read side (a
+// scribe's id is its fd with the default multiplexer); the dup stays
+// writable, and a viewer has nothing more to say. A request, so that
+// a publisher gone before it got the socket bounces it back here to be
+// answered and closed.
+static void handOver(HttpMasterBroker* self,
+                     const connection_handle& hdl,
+                     const actor& publisher) {
+  int fd = dup(hdl.id());
+  self->close(hdl);
+  if (fd < 0) {
+    perror("dup");
+    return;
+  }
+  self->request(publisher, infinite, fanout_add_atom::value, fd).then(
+    [=]() {
+    },
+    [=](error&) {
+      if (write(fd, http_error, strlen(http_error)) < 0) {
+        perror("fanout hand over");
+      }
+      close(fd);
+    }
+  );
+}
+
+static void acceptConnection(HttpMasterBroker* self,
+                             const connection_handle& hdl) {
+  self->configure_read(hdl, receive_policy::at_most(1024));
+
+  auto it = self->state.procs.find(hdl);
+  if (it == std::end(self->state.procs)) {
+    cout << "create new http context" << endl;
+    std::shared_ptr<HttpReqContext> ctx(new HttpReqContext);
+    ctx->status = HttpReqContext::HEADER;
+    self->state.procs[hdl] = ctx;
+  }
+}
 
 behavior HttpMaster(HttpMasterBroker* self,
                     const std::string& up_stream_url) {
-  self->state.upstream = up_stream_url;
+  if (!self->state.upstreams.parse(up_stream_url)) {
+    cout << "Pulling from upstreams disabled" << endl;
+  } else if (!self->state.upstreams.empty()) {
+    auto& cfg = getConfig(self->system());
+    self->state.upstreams.setHashing(cfg.upstream_routing == "hash",
+                                     cfg.upstream_load_bound);
+    self->send(self, up_check_atom::value);
+  }
   self->set_down_handler([=](const down_msg& msg) {
     printf("down_msg(%p)\n", self);
     auto act = actor_cast<actor>(msg.source);
     auto it = self->state.publishers.right.find(act);
     if (it != std::end(self->state.publishers.right)) {
+      if (self->state.pushed.erase(it->second) && self->state.directory) {
+        self->send(self->state.directory, cluster_del_atom::value,
+                   it->second);
+      }
       self->state.publishers.right.erase(it);
     }
+    auto pulled = self->state.pulled.find(act);
+    if (pulled != std::end(self->state.pulled)) {
+      self->state.upstreams.release(pulled->second);
+      self->state.pulled.erase(pulled);
+    }
   });
 
   return {
     [=](const new_connection_msg& msg) {
       cout << "new_connection_msg " << msg.handle.id() << endl;
-      self->configure_read(msg.handle, receive_policy::at_most(1024));
+      acceptConnection(self, msg.handle);
+    },
 
-      auto it = self->state.procs.find(msg.handle);
-      if (it == std::end(self->state.procs)) {
-        cout << "create new http context" << endl;
-        std::shared_ptr<HttpReqContext> ctx(new HttpReqContext);
-        ctx->status = HttpReqContext::HEADER;
-        self->state.procs[msg.handle] = ctx;
+    [=](tls_conn_atom, int fd) {
+      auto hdl = self->add_tcp_scribe(fd);
+      if (!hdl) {
+        cout << "cannot take over tls connection: "
+             << self->system().render(hdl.error()) << endl;
+        close(fd);
+        return;
       }
+      cout << "tls connection " << hdl->id() << endl;
+      acceptConnection(self, *hdl);
     },
 
     [=](const new_data_msg& msg) {
@@ -62,44 +246,77 @@ behavior HttpMaster(HttpMasterBroker* self,
         auto query = ctx->request.getQuery();
         if (method == HTTP_GET) {
           cout << "HTTP_GET " << path << "\n";
+          std::string stream, file;
           auto it = state.publishers.left.find(path);
-          if (it != std::end(state.publishers.left)) {
-            auto worker = self->fork(HttpSubscribe, msg.handle, ctx->request.getBody());
-            //self->monitor(worker);
-            self->link_to(worker);
-            anon_send(it->second, register_atom::value, worker);
-            anon_send(worker, sub_init_atom::value, it->second);
-          } else if (!state.upstream.empty()) {
-            http::UrlParser parser(state.upstream);
-            if (parser.parse() != 0) {
-              cout << "Upstream url parse failed!" << endl;
+          // the upstream is always pulled as flv, only our own
+          // subscriber gets to know about the format
+          auto sub_query = query;
+          if (it == std::end(state.publishers.left) &&
+              stripMp4Suffix(path)) {
+            sub_query += sub_query.empty() ? "format=mp4" : "&format=mp4";
+            it = state.publishers.left.find(path);
+          }
+          // another node pulling from us, packets go out as parsed
+          if (ctx->request.hasField("Accept") &&
+              ctx->request.getField("Accept").find(relay::MIME) !=
+                std::string::npos) {
+            sub_query += sub_query.empty() ? "format=relay" : "&format=relay";
+          }
+          // websocket players get the same stream, framed
+          std::string upgrade;
+          if (http::ws::isUpgrade(ctx->request)) {
+            upgrade = http::ws::handshake(ctx->request);
+            if (upgrade.empty()) {
               self->write(msg.handle, strlen(http_error), http_error);
               self->flush(msg.handle);
               self->close(msg.handle);
               return;
             }
-            auto host = parser.getHost();
-            auto port = std::stol(parser.getPort());
+          }
+          bool fanout = getConfig(self->system()).publish_fanout &&
+                        upgrade.empty() && sub_query.empty();
+          if (it != std::end(state.publishers.left)) {
+            if (state.directory) {
+              state.hits[it->first]++;
+            }
+            if (fanout) {
+              handOver(self, msg.handle, it->second);
+            } else {
+              auto worker = self->fork(HttpSubscribe, msg.handle,
+                                       ctx->request.getBody(), sub_query,
+                                       upgrade);
+              //self->monitor(worker);
+              self->link_to(worker);
+              anon_send(it->second, register_atom::value, worker);
+              anon_send(worker, sub_init_atom::value, it->second);
+            }
+          } else if (splitHlsPath(path, stream, file) &&
+                     (it = state.publishers.left.find(stream)) !=
+                       std::end(state.publishers.left)) {
+            auto worker = self->fork(HttpHls, msg.handle, file, query);
+            self->link_to(worker);
+            anon_send(worker, sub_init_atom::value, it->second);
+          } else if (vodPath(self, path, file)) {
+            auto worker = self->fork(HttpVod, msg.handle, file, query);
+            self->link_to(worker);
+          } else if (!state.worker &&
+                     (!state.upstreams.empty() || state.located.count(path))) {
             std::string res_path = path;
-            if (!query.empty()) {
-              res_path += "?" + query;
+            auto origin_query = originQuery(query);
+            if (!origin_query.empty()) {
+              res_path += "?" + origin_query;
             }
-            auto client =
-              self->parent().spawn_client(HttpRevPublish,
-                                          host,
-                                          port,
-                                          res_path,
-                                          self->address());
-            if (client) {
-              self->monitor(*client);
-              self->link_to(*client);
-              state.publishers.insert(HttpMasterState::PublisherMap::value_type(path, *client));
-
-              auto worker = self->fork(HttpSubscribe, msg.handle, ctx->request.getBody());
+            auto client = spawnPull(self, path, res_path);
+            if (client && fanout) {
+              handOver(self, msg.handle, client);
+            } else if (client) {
+              auto worker = self->fork(HttpSubscribe, msg.handle,
+                                     ctx->request.getBody(), sub_query,
+                                     upgrade);
               //self->monitor(worker);
               self->link_to(worker);
-              anon_send(*client, register_atom::value, worker);
-              anon_send(worker, sub_init_atom::value, *client);
+              anon_send(client, register_atom::value, worker);
+              anon_send(worker, sub_init_atom::value, client);
             } else {
               self->write(msg.handle, strlen(http_error), http_error);
               self->flush(msg.handle);
@@ -110,14 +327,34 @@ behavior HttpMaster(HttpMasterBroker* self,
             self->flush(msg.handle);
             self->close(msg.handle);
           }
+        } else if (method == HTTP_HEAD) {
+          // the health check of edges pulling from here
+          self->write(msg.handle, strlen(http_ok), http_ok);
+          self->flush(msg.handle);
+          self->close(msg.handle);
         } else if (method == HTTP_POST) {
           cout << "HTTP_POST " << path << "\n";
           auto it = state.publishers.left.find(path);
-          if (it == std::end(state.publishers.left)) {
-            auto worker = self->fork(HttpPublish, msg.handle, ctx->request.getBody());
+          if (state.worker) {
+            // streams are pushed to the ingesting process
+            self->write(msg.handle, strlen(http_error), http_error);
+            self->flush(msg.handle);
+            self->close(msg.handle);
+          } else if (it == std::end(state.publishers.left)) {
+            auto worker = self->fork(HttpPublish, msg.handle,
+                                     ctx->request.getBody(), path);
             state.publishers.insert(HttpMasterState::PublisherMap::value_type(path, worker));
+            state.pushed.insert(path);
+            if (state.directory) {
+              self->send(state.directory, cluster_add_atom::value, path);
+            }
             self->monitor(worker);
             self->link_to(worker);
+          } else if (state.pushed.count(path)) {
+            // the encoder came back, its subscribers stay where they are
+            auto feeder = self->fork(HttpFeed, msg.handle,
+                                     ctx->request.getBody(), it->second);
+            self->link_to(feeder);
           } else {
             self->write(msg.handle, strlen(http_error), http_error);
             self->flush(msg.handle);
@@ -128,11 +365,125 @@ behavior HttpMaster(HttpMasterBroker* self,
       }
     },
 
+    [=](up_check_atom) {
+      for (auto& origin : self->state.upstreams.origins()) {
+        self->spawn<detached>(UpstreamProbe, origin, actor_cast<actor>(self));
+      }
+      auto interval = getConfig(self->system()).upstream_check_ms;
+      if (interval > 0) {
+        self->delayed_send(self,
+                           std::chrono::milliseconds(interval),
+                           up_check_atom::value);
+      }
+    },
+
+    [=](up_report_atom, const std::string& name, bool ok,
+        int64_t connect_ms, int64_t ttfb_ms) {
+      auto& state = self->state;
+      state.upstreams.report(name, ok, connect_ms, ttfb_ms);
+      // a pull that failed over now loads another origin
+      auto it = state.pulled.find(actor_cast<actor>(self->current_sender()));
+      if (ok && it != std::end(state.pulled) && it->second != name) {
+        state.upstreams.release(it->second);
+        state.upstreams.acquire(name);
+        it->second = name;
+      }
+    },
+
+    [=](cluster_join_atom, const actor& directory) {
+      self->state.directory = directory;
+      for (auto& path : self->state.pushed) {
+        self->send(directory, cluster_add_atom::value, path);
+      }
+      if (getConfig(self->system()).cluster_warm_threshold > 0) {
+        self->delayed_send(self, RANK_INTERVAL, cluster_rank_atom::value);
+      }
+    },
+
+    [=](cluster_rank_atom) {
+      auto& state = self->state;
+      double threshold = getConfig(self->system()).cluster_warm_threshold;
+      double scale = std::chrono::minutes(1) / RANK_INTERVAL;
+      std::vector<std::string> hot;
+      for (auto& hit : state.hits) {
+        state.popularity[hit.first];
+      }
+      for (auto it = state.popularity.begin();
+           it != state.popularity.end();) {
+        auto hit = state.hits.find(it->first);
+        double rate = hit == std::end(state.hits) ? 0 : hit->second * scale;
+        it->second += RANK_ALPHA * (rate - it->second);
+        if (it->second >= threshold && state.pushed.count(it->first)) {
+          hot.push_back(it->first);
+        }
+        if (it->second < 0.5) {
+          it = state.popularity.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      state.hits.clear();
+      self->send(state.directory, cluster_hot_atom::value, hot);
+      self->delayed_send(self, RANK_INTERVAL, cluster_rank_atom::value);
+    },
+
+    [=](cluster_warm_atom, const std::string& path, const std::string& url) {
+      auto& state = self->state;
+      int64_t ttl = getConfig(self->system()).cluster_warm_ttl * 1000LL;
+      auto it = state.publishers.left.find(path);
+      if (it != std::end(state.publishers.left)) {
+        if (!state.pushed.count(path)) {
+          self->send(it->second, warm_atom::value, ttl);
+        }
+        return;
+      }
+      // nobody asked yet, the peer's directory entry may not even be
+      // here: the hint says where the stream is
+      if (!state.located.count(path)) {
+        state.located[path] = url;
+      }
+      cout << "Warming " << path << " from " << url << endl;
+      auto client = spawnPull(self, path, path);
+      if (client) {
+        self->send(client, warm_atom::value, ttl);
+      }
+    },
+
+    [=](cluster_loc_atom, const std::string& path, const std::string& url) {
+      if (url.empty()) {
+        self->state.located.erase(path);
+      } else {
+        self->state.located[path] = url;
+      }
+    },
+
+    [=](shm_stream_atom, const std::string& path, int fd) {
+      printf("shm_stream_atom(%s)\n", path.c_str());
+      auto& state = self->state;
+      // a publisher still here is that of the previous push, draining
+      auto it = state.publishers.left.find(path);
+      if (it != std::end(state.publishers.left)) {
+        state.publishers.left.erase(it);
+      }
+      auto publisher = self->spawn(ShmPublish, fd, path);
+      self->monitor(publisher);
+      state.publishers.insert(
+        HttpMasterState::PublisherMap::value_type(path, publisher));
+    },
+
     [=](const connection_closed_msg& msg) {
       auto& procs = self->state.procs;
-      procs.erase(procs.find(msg.handle));
+      procs.erase(msg.handle);
     }
   };
 }
 
-
+behavior HttpWorker(HttpMasterBroker* self, network::native_socket fd) {
+  self->state.worker = true;
+  auto doorman = self->add_tcp_doorman(fd);
+  if (!doorman) {
+    cerr << "cannot accept on the workers port: "
+         << self->system().render(doorman.error()) << endl;
+  }
+  return HttpMaster(self, std::string());
+}
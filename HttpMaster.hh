@@ -7,8 +7,12 @@
 
 #include "utils.hh"
 #include "HttpPublish.hh"
+#include "upstream.hh"
+#include "cluster.hh"
+#include "workers.hh"
 #include <boost/config.hpp>
 #include <boost/bimap.hpp>
+#include <unordered_set>
 
 struct HttpReqContext {
   http::Request request;
@@ -26,8 +30,22 @@ struct HttpMasterState {
   using RequestProcMap =
     std::unordered_map<connection_handle, std::shared_ptr<HttpReqContext>>;
 
-  std::string upstream;
+  UpstreamPool upstreams;
+  // the origin each pulled stream comes from
+  std::unordered_map<actor, std::string> pulled;
+  // the cluster directory, if any, and the streams it knows peers have
+  actor directory;
+  std::unordered_map<std::string, std::string> located;
+  // requests per stream since the last ranking, and their smoothed
+  // rate per minute
+  std::unordered_map<std::string, int> hits;
+  std::unordered_map<std::string, double> popularity;
+  // a worker process: serves what the ingesting one hands it, nothing
+  // else
+  bool worker {false};
   PublisherMap publishers;
+  // paths that are pushed to us, not pulled from the upstream
+  std::unordered_set<std::string> pushed;
   RequestProcMap procs;
 };
 
@@ -35,3 +53,6 @@ using HttpMasterBroker = caf::stateful_actor<HttpMasterState, broker>;
 behavior HttpMaster(HttpMasterBroker* self,
                     const std::string& up_stream_url);
 
+// The master of a worker process, accepting on `fd`.
+behavior HttpWorker(HttpMasterBroker* self, network::native_socket fd);
+
@@ -5,12 +5,55 @@
 
 #include "HttpPublish.hh"
 #include "HttpSubscribe.hh"
+#include "HttpHls.hh"
+
+// Archives the stream pushed on `path` if the [record] section asks
+// for it. The disk is only ever touched by the RecordWriter thread.
+static void recordOpen(HttpPubBroker* self, const std::string& path) {
+  auto& cfg = getConfig(self->system());
+  if (cfg.record_dir.empty()) {
+    return;
+  }
+  auto name = path;
+  std::replace(name.begin(), name.end(), '/', '_');
+  auto& state = self->state;
+  state.recorder.reset(new Recorder(cfg.record_dir + "/" + name,
+                                    cfg.record_rollover_min * 60000LL,
+                                    cfg.record_queue_blocks));
+  state.cache.addSink(state.recorder.get());
+}
+
+// Hands the stream to the worker processes, if there are any.
+static void shmOpen(HttpPubBroker* self, const std::string& path) {
+  auto& hub = WorkerHub::instance();
+  if (!hub.active()) {
+    return;
+  }
+  auto& state = self->state;
+  std::unique_ptr<ShmRing> shm(new ShmRing);
+  if (!shm->create("flv:" + path,
+                   (size_t)getConfig(self->system()).workers_ring_mb << 20)) {
+    cout << "Cannot create the shared ring of " << path << endl;
+    return;
+  }
+  state.cache.addSink(shm.get());
+  hub.announce(path, shm->fd());
+  state.shm = std::move(shm);
+}
 
 behavior HttpPublish(HttpPubBroker* self,
                      connection_handle hdl,
-                     const std::vector<char>& residue) {
+                     const std::vector<char>& residue,
+                     const std::string& path) {
   self->write(hdl, strlen(http_ok), http_ok);
-  self->state.parser.parse(residue);
+  dvrOpen(self, path);
+  recordOpen(self, path);
+  shmOpen(self, path);
+  self->state.node = numa::streamNode(self->id());
+  {
+    numa::NodeScope scope(self->state.node);
+    self->state.parser.parse(residue);
+  }
   self->set_down_handler([=](const down_msg& msg) {
     printf("down_msg(%p)\n", self);
     self->state.nsubs--;
@@ -19,7 +62,45 @@ behavior HttpPublish(HttpPubBroker* self,
   return {
     [=](const new_data_msg& msg) {
       self->configure_read(msg.handle, receive_policy::at_least(1024));
+      numa::NodeScope scope(self->state.node);
       self->state.parser.parse(msg.buf);
+      hlsWake(self, false);
+    },
+
+    [=](adopt_atom, const actor& feeder) {
+      printf("adopt_atom(%p)\n", self);
+      auto& state = self->state;
+      // whoever was pushing before is done, even if it does not know yet
+      if (state.feeder) {
+        self->send(actor_cast<actor>(state.feeder), feed_stop_atom::value);
+      } else {
+        self->close(hdl);
+      }
+      state.feeder = feeder.address();
+      state.gen++;
+      state.parser.reset();
+    },
+
+    [=](feed_atom, const std::vector<char>& buf) {
+      if (actor_cast<actor_addr>(self->current_sender()) !=
+          self->state.feeder) {
+        return;
+      }
+      numa::NodeScope scope(self->state.node);
+      self->state.parser.parse(buf);
+      hlsWake(self, false);
+    },
+
+    [=](feed_end_atom) {
+      if (actor_cast<actor_addr>(self->current_sender()) !=
+          self->state.feeder) {
+        return;
+      }
+      printf("feed_end_atom(%p)\n", self);
+      self->delayed_send(self,
+                         std::chrono::seconds(3),
+                         delay_shut_atom::value,
+                         self->state.gen);
     },
 
     [=](register_atom, const actor& subscriber) {
@@ -29,21 +110,23 @@ behavior HttpPublish(HttpPubBroker* self,
       self->link_to(subscriber);
     },
 
-    [=](resync_atom, const actor_addr& subscriber) {
+    [=](fanout_add_atom, int fd) {
+      fanoutAdd(self, fd);
+    },
+
+    [=](fanout_tick_atom) {
+      fanoutTick(self);
+    },
+
+    [=](resync_atom, const actor_addr& subscriber,
+        FlvPacketCache::Mode mode, SubFormat format,
+        int64_t delay, int64_t resume) {
       printf("resync_atom(%p)\n", self);
-      auto& cache = self->state.cache;
-      FlvPacketList* pkts = new FlvPacketList;
-      FlvPacketCache::ErrorCode err = FlvPacketCache::OK;
-      auto dcrs = cache.getDCR();
-      pkts->splice(pkts->end(), std::move(dcrs));
-      for (ssize_t id = -1;
-           PACKET_IS_GOOD(err);) {
-        FlvPacket out;
-        err = cache.getNext(id, out);
-        if (PACKET_IS_GOOD(err)) {
-          id = out.id;
-          pkts->emplace_back(std::move(out));
-        }
+      FlvPacketList* pkts = resyncPackets(self, format, mode, delay, resume);
+      if (!pkts) {
+        self->send(actor_cast<actor>(subscriber),
+                   eagain_atom::value);
+        return;
       }
       self->send(actor_cast<actor>(subscriber),
                  read_resp_atom::value,
@@ -51,34 +134,62 @@ behavior HttpPublish(HttpPubBroker* self,
                  true);
     },
 
-    [=](read_some_atom, int64_t old, const actor_addr& subscriber) {
+    [=](read_some_atom, int64_t old, int64_t last,
+        const actor_addr& subscriber,
+        FlvPacketCache::Mode mode, SubFormat format) {
       //printf("read_some_atom(%p)\n", self);
-      ssize_t oldId = -1;
       FlvPacketList* pkts = (FlvPacketList*)old;
       for (auto& pkt : *pkts) {
         pkt.payload->release();
-        oldId = pkt.id;
       }
       delete pkts;
 
-      FlvPacketCache::ErrorCode err = FlvPacketCache::OK;
       pkts = new FlvPacketList;
-      auto& cache = self->state.cache;
-      for (ssize_t id = oldId;
-           PACKET_IS_GOOD(err);) {
-        FlvPacket out;
-        err = cache.getNext(id, out);
-        if (PACKET_IS_GOOD(err)) {
-          id = out.id;
-          pkts->emplace_back(std::move(out));
-        }
+      sourceCache(self, format).getAll(last, *pkts, mode);
+      self->send(actor_cast<actor>(subscriber),
+                 read_resp_atom::value,
+                 (int64_t)pkts,
+                 false);
+    },
+
+    [=](dvr_seek_atom, const actor_addr& subscriber, int64_t offset) {
+      printf("dvr_seek_atom(%p)\n", self);
+      FlvPacketList* pkts = dvrSeek(self, offset);
+      if (!pkts) {
+        self->send(actor_cast<actor>(subscriber),
+                   dvr_none_atom::value);
+        return;
+      }
+      self->send(actor_cast<actor>(subscriber),
+                 read_resp_atom::value,
+                 (int64_t)pkts,
+                 true);
+    },
+
+    [=](dvr_read_atom, int64_t old, int64_t pos, int64_t until,
+        const actor_addr& subscriber) {
+      FlvPacketList* pkts = (FlvPacketList*)old;
+      for (auto& pkt : *pkts) {
+        pkt.payload->release();
       }
+      delete pkts;
+
+      pkts = dvrPackets(self, pos, until);
       self->send(actor_cast<actor>(subscriber),
                  read_resp_atom::value,
                  (int64_t)pkts,
                  false);
     },
 
+    [=](hls_get_atom, const std::string& file, int64_t msn, int64_t part,
+        const actor_addr& requester) {
+      hlsGet(self, file, msn, part, requester);
+    },
+
+    [=](hls_check_atom) {
+      hlsWake(self, true);
+    },
+
     [=](reclaim_atom, int64_t old) {
       printf("reclaim_atom(%p)\n", self);
       FlvPacketList* pkts = (FlvPacketList*)old;
@@ -90,6 +201,9 @@ behavior HttpPublish(HttpPubBroker* self,
 
     [=](const connection_closed_msg& msg) {
       printf("connection_closed_msg(%p)\n", self);
+      if (self->state.feeder) {
+        return;
+      }
       self->delayed_send(self,
                          std::chrono::seconds(3),
                          delay_shut_atom::value,
@@ -104,3 +218,41 @@ behavior HttpPublish(HttpPubBroker* self,
     }
   };
 }
+
+behavior HttpFeed(HttpFeedBroker* self,
+                  connection_handle hdl,
+                  const std::vector<char>& residue,
+                  const actor& publisher) {
+  self->state.publisher = publisher;
+  self->write(hdl, strlen(http_ok), http_ok);
+  // adopt goes first, so the publisher knows whose bytes follow
+  self->send(publisher, adopt_atom::value, actor_cast<actor>(self));
+  if (!residue.empty()) {
+    self->send(publisher, feed_atom::value, residue);
+  }
+  self->monitor(publisher);
+  self->set_down_handler([=](const down_msg& msg) {
+    printf("down_msg(%p)\n", self);
+    self->close(hdl);
+    self->quit();
+  });
+
+  return {
+    [=](const new_data_msg& msg) {
+      self->configure_read(msg.handle, receive_policy::at_least(1024));
+      self->send(self->state.publisher, feed_atom::value, msg.buf);
+    },
+
+    [=](feed_stop_atom) {
+      printf("feed_stop_atom(%p)\n", self);
+      self->close(hdl);
+      self->quit();
+    },
+
+    [=](const connection_closed_msg& msg) {
+      printf("connection_closed_msg(%p)\n", self);
+      self->send(self->state.publisher, feed_end_atom::value);
+      self->quit();
+    }
+  };
+}
@@ -6,6 +6,13 @@
 #pragma once
 
 #include "utils.hh"
+#include "hls.hh"
+#include "fmp4.hh"
+#include "dvr.hh"
+#include "recorder.hh"
+#include "fanout.hh"
+#include "workers.hh"
+#include "config.hh"
 
 #define PACKET_IS_GOOD(e) ((e) == FlvPacketCache::ErrorCode::OK ||\
                            (e) == FlvPacketCache::ErrorCode::SKIP)
@@ -13,8 +20,17 @@
 struct HttpPubState {
   FlvPacketCache cache {256};
   FlvParser parser {cache};
+  HlsContext hls;
+  std::unique_ptr<Fmp4Stream> fmp4;
+  std::unique_ptr<DvrRing> dvr;
+  std::unique_ptr<Recorder> recorder;
+  std::unique_ptr<ShmRing> shm;
+  actor_addr feeder;
   int nsubs {0};
   int gen {0};
+  // the NUMA node the payloads are allocated on
+  int node {-1};
+  std::unique_ptr<Fanout> fanout;
 };
 
 using register_atom = atom_constant<atom("sub_reg")>;
@@ -22,10 +38,204 @@ using resync_atom = atom_constant<atom("resync")>;
 using read_some_atom = atom_constant<atom("read_some")>;
 using delay_shut_atom = atom_constant<atom("delay_shut")>;
 using reclaim_atom = atom_constant<atom("reclaim")>;
+using adopt_atom = atom_constant<atom("adopt")>;
+using feed_atom = atom_constant<atom("feed")>;
+using feed_end_atom = atom_constant<atom("feed_end")>;
+using feed_stop_atom = atom_constant<atom("feed_stop")>;
+using dvr_seek_atom = atom_constant<atom("dvr_seek")>;
+using dvr_read_atom = atom_constant<atom("dvr_read")>;
+using dvr_none_atom = atom_constant<atom("dvr_none")>;
+// keep a pulled stream for that many ms, subscribers or not
+using warm_atom = atom_constant<atom("warm")>;
+// master -> publisher ([publish] fanout): the socket of a plain FLV
+// viewer, served by the publisher from now on
+using fanout_add_atom = atom_constant<atom("fan_add")>;
+using fanout_tick_atom = atom_constant<atom("fan_tick")>;
+
+enum SubFormat : uint8_t {
+  FORMAT_FLV,
+  FORMAT_FMP4,
+  FORMAT_RELAY   // an edge pulling, see relay.hh
+};
+
+// Publisher side, shared by HttpPublish and HttpRevPublish: the cache a
+// subscriber of `format` reads from. The fmp4 fragments are muxed on
+// the first fmp4 request and kept in step with the stream afterwards.
+template <class Broker>
+FlvPacketCache& sourceCache(Broker* self, SubFormat format) {
+  auto& state = self->state;
+  if (format != FORMAT_FMP4) {
+    return state.cache;
+  }
+  if (!state.fmp4) {
+    state.fmp4.reset(
+      new Fmp4Stream(getConfig(self->system()).fmp4_fragment_ms));
+    FlvPacketList pkts(state.cache.getDCR());
+    state.cache.getAll(-1, pkts);
+    for (auto& pkt : pkts) {
+      state.fmp4->onPacket(pkt);
+      pkt.payload->release();
+    }
+    state.cache.addSink(state.fmp4.get());
+  }
+  return state.fmp4->fragments();
+}
+
+// What a resyncing subscriber starts with, nullptr while there is
+// nothing it could decode yet. A `resume` id still cached continues
+// right after it. Otherwise `delay` ms behind live puts it at the
+// keyframe before that point instead of at the oldest packet cached;
+// a fmp4 player always has to begin with a keyframe fragment.
+template <class Broker>
+FlvPacketList* resyncPackets(Broker* self,
+                             SubFormat format,
+                             FlvPacketCache::Mode mode,
+                             int64_t delay,
+                             int64_t resume) {
+  auto& cache = sourceCache(self, format);
+  if (format != FORMAT_FMP4) {
+    FlvPacketList* pkts = new FlvPacketList(cache.getDCR(mode));
+    if (resume >= 0 && cache.resumable(resume)) {
+      cache.getAll(resume, *pkts, mode);
+    } else if (delay > 0) {
+      cache.getSince(cache.lastDts() - delay, *pkts, mode);
+    } else {
+      cache.getAll(-1, *pkts, mode);
+    }
+    return pkts;
+  }
+
+  ssize_t key = cache.seek(cache.lastDts() - delay);
+  if (key == FlvPacketCache::INVALID) {
+    return nullptr;
+  }
+  FlvPacketList* pkts = new FlvPacketList(cache.getDCR());
+  cache.getAll(key - 1, *pkts);
+  return pkts;
+}
+
+// Publisher side, shared by all publishers: takes the viewer on `fd`
+// into the fanout, which ticks for as long as it has viewers. Both
+// return how many viewers were dropped meanwhile, already taken off
+// nsubs.
+template <class Broker>
+size_t fanoutTick(Broker* self) {
+  auto& fanout = *self->state.fanout;
+  size_t dropped = fanout.tick(self->state.cache);
+  self->state.nsubs -= dropped;
+  fanout.ticking = fanout.size() > 0;
+  if (fanout.ticking) {
+    self->delayed_send(self,
+                       std::chrono::milliseconds(200),
+                       fanout_tick_atom::value);
+  }
+  return dropped;
+}
+
+template <class Broker>
+size_t fanoutAdd(Broker* self, int fd) {
+  auto& state = self->state;
+  if (!state.fanout) {
+    state.fanout.reset(new Fanout);
+  }
+  state.nsubs++;
+  size_t dropped = state.fanout->add(fd, state.cache);
+  state.nsubs -= dropped;
+  if (!state.fanout->ticking && state.fanout->size() > 0) {
+    state.fanout->ticking = true;
+    self->delayed_send(self,
+                       std::chrono::milliseconds(200),
+                       fanout_tick_atom::value);
+  }
+  return dropped;
+}
+
+// Starts recording the stream published on `path` to its DVR ring, if
+// the [dvr] section asks for it.
+template <class Broker>
+void dvrOpen(Broker* self, const std::string& path) {
+  auto& cfg = getConfig(self->system());
+  if (cfg.dvr_dir.empty()) {
+    return;
+  }
+  auto name = path.substr(0, path.find('?'));
+  std::replace(name.begin(), name.end(), '/', '_');
+  std::unique_ptr<DvrRing> dvr(new DvrRing);
+  if (!dvr->open(cfg.dvr_dir + "/" + name + ".dvr",
+                 (size_t)cfg.dvr_size_mb << 20)) {
+    cout << "Cannot open dvr ring for " << path << endl;
+    return;
+  }
+  self->state.cache.addSink(dvr.get());
+  self->state.dvr = std::move(dvr);
+}
+
+// DVR packets from `pos` up to dts `until`, a few megabytes at most. A
+// position the ring has overwritten restarts at its oldest keyframe.
+template <class Broker>
+FlvPacketList* dvrPackets(Broker* self, uint64_t pos, int64_t until) {
+  FlvPacketList* pkts = new FlvPacketList;
+  if (!self->state.dvr) {
+    return pkts;
+  }
+  auto& dvr = *self->state.dvr;
+  size_t bytes = 0;
+  while (bytes < (4 << 20)) {
+    uint64_t next = pos;
+    FlvPacket pkt;
+    auto err = dvr.read(next, pkt);
+    if (err == FlvPacketCache::ERROR &&
+        dvr.seek(std::numeric_limits<int64_t>::min(), pos)) {
+      continue;
+    } else if (err != FlvPacketCache::OK) {
+      break;
+    } else if ((pkt.type == VIDEO || pkt.type == AUDIO) &&
+               pkt.dts > until) {
+      pkt.payload->release();
+      break;
+    }
+    pos = next;
+    bytes += pkt.payload->size();
+    pkts->push_back(pkt);
+  }
+  return pkts;
+}
+
+// What a subscriber starting `offset` ms behind live gets first: the
+// DCRs, then the ring from the keyframe before that point on, a second
+// ahead. nullptr if there is no DVR to serve it from.
+template <class Broker>
+FlvPacketList* dvrSeek(Broker* self, int64_t offset) {
+  auto& dvr = self->state.dvr;
+  uint64_t pos;
+  int64_t target = dvr ? dvr->lastDts() + offset : 0;
+  if (!dvr || !dvr->seek(target, pos)) {
+    return nullptr;
+  }
+  FlvPacketList* pkts = new FlvPacketList(self->state.cache.getDCR());
+  FlvPacketList* some = dvrPackets(self, pos, target + 1000);
+  pkts->splice(std::end(*pkts), *some);
+  delete some;
+  return pkts;
+}
 
 using HttpPubBroker = caf::stateful_actor<HttpPubState, broker>;
 behavior HttpPublish(HttpPubBroker* self,
                      connection_handle hdl,
-                     const std::vector<char>& residue);
+                     const std::vector<char>& residue,
+                     const std::string& path);
+
+// A POST to a path whose publisher is still around: the connection is
+// read here and its bytes fed to that publisher, which carries on with
+// the subscribers it has.
+struct HttpFeedState {
+  actor publisher;
+};
+
+using HttpFeedBroker = caf::stateful_actor<HttpFeedState, broker>;
+behavior HttpFeed(HttpFeedBroker* self,
+                  connection_handle hdl,
+                  const std::vector<char>& residue,
+                  const actor& publisher);
 
 
@@ -7,44 +7,121 @@
 #include "HttpRevPublish.hh"
 #include "HttpPublish.hh"
 #include "HttpSubscribe.hh"
+#include "HttpHls.hh"
 
 enum ShutDownReason : uint8_t {
-  UPSTREAM_NETWORK_DOWN,
   NO_MORE_SUBSCIRBER,
+  WARM_EXPIRED,
 };
 
+using reconnect_atom = atom_constant<atom("reconnect")>;
+
+// Upstream reconnect backoff, and how long a stream may stay down
+// before its subscribers are let go.
+static const int64_t RECONNECT_MIN_MS = 250;
+static const int64_t RECONNECT_MAX_MS = 5000;
+static const auto RECONNECT_GIVE_UP = std::chrono::seconds(30);
+
+static void requestStream(HttpRevPubBroker* self, connection_handle hdl) {
+  auto& state = self->state;
+  state.resp.reset(new HttpResp);
+  state.resp->status = HttpResp::HEADER;
+  state.requested_at = std::chrono::steady_clock::now();
+  self->write(hdl, state.request.length(), state.request.c_str());
+  self->configure_read(hdl, receive_policy::at_least(8));
+  self->flush(hdl);
+}
+
+static void reportOrigin(HttpRevPubBroker* self, bool ok, int64_t ttfbMs) {
+  auto& state = self->state;
+  self->send(actor_cast<actor>(state.master),
+             up_report_atom::value,
+             state.origins[state.current].name(),
+             ok,
+             (int64_t)-1,
+             ttfbMs);
+}
+
+// Schedules the next connect attempt, on the next origin in the list:
+// right away while some of them have not been tried yet, with backoff
+// once all of them failed. The cache, and with it every subscriber,
+// stays as it is; the parser rebases the new connection's timestamps
+// on top of the old ones.
+static void upstreamLost(HttpRevPubBroker* self) {
+  auto& state = self->state;
+  auto now = std::chrono::steady_clock::now();
+  if (state.streaming) {
+    state.streaming = false;
+    state.down_since = now;
+    state.backoff_ms = 0;
+    state.tried = 0;
+  }
+  if (now - state.down_since > RECONNECT_GIVE_UP) {
+    cout << "Upstreams gone, giving up" << endl;
+    self->quit();
+    return;
+  }
+
+  int64_t delay = 0;
+  state.current = (state.current + 1) % state.origins.size();
+  if (++state.tried >= state.origins.size()) {
+    state.tried = 0;
+    state.backoff_ms = state.backoff_ms == 0
+      ? RECONNECT_MIN_MS
+      : std::min(state.backoff_ms * 2, RECONNECT_MAX_MS);
+    delay = state.backoff_ms;
+  }
+  state.gen++;
+  self->delayed_send(self,
+                     std::chrono::milliseconds(delay),
+                     reconnect_atom::value,
+                     state.gen);
+}
+
+// The last subscriber gone: the stream is let go of unless someone
+// comes back in time.
+static void idleCheck(HttpRevPubBroker* self) {
+  if (self->state.nsubs == 0) {
+    self->delayed_send(self,
+                       std::chrono::seconds(5),
+                       delay_shut_atom::value,
+                       self->state.gen,
+                       NO_MORE_SUBSCIRBER);
+  }
+}
+
 behavior HttpRevPublish(HttpRevPubBroker* self,
                         connection_handle hdl,
+                        const std::vector<Upstream>& origins,
+                        size_t current,
                         const std::string& path,
                         const actor_addr& addr) {
   self->set_down_handler([=](const down_msg& msg) {
     printf("down_msg(%p)\n", self);
-    if (--self->state.nsubs == 0) {
-      self->delayed_send(self,
-                         std::chrono::seconds(5),
-                         delay_shut_atom::value,
-                         self->state.gen,
-                         NO_MORE_SUBSCIRBER);
-    }
+    --self->state.nsubs;
+    idleCheck(self);
   });
 
   std::stringstream ss;
   ss << "GET " << path << " HTTP/1.1\r\n"
       << "User-Agent: Mozilla/5.0 (Windows NT 6.1; WOW64)\r\n"
       << "Host: \r\n"
-      << "Accept: */*\r\n"
+      << "Accept: " << relay::MIME << ", video/x-flv, */*\r\n"
       << "Connection: keep-alive\r\n"
       << "\r\n";
-  auto http_req = ss.str();
+  self->state.origins = origins;
+  self->state.current = current;
+  self->state.down_since = std::chrono::steady_clock::now();
+  self->state.request = ss.str();
   self->state.master = addr;
-  self->state.resp.reset(new HttpResp);
-  self->state.resp->status = HttpResp::HEADER;
-  self->write(hdl, http_req.length(), http_req.c_str());
-  self->configure_read(hdl, receive_policy::at_least(8));
-  self->flush(hdl);
+  self->state.node = numa::streamNode(self->id());
+  self->state.relay_reader.reset(origins[current].name());
+  dvrOpen(self, path);
+  requestStream(self, hdl);
   return {
     [=](const new_data_msg& msg) {
       //printf("new_data_msg(%p)\n", self);
+      numa::NodeScope scope(self->state.node);
       auto& state = self->state;
       auto& resp = state.resp;
       if (resp->status == HttpResp::HEADER) {
@@ -54,7 +131,7 @@ behavior HttpRevPublish(HttpRevPubBroker* self,
         } else if (res < 0) {
           cout << "Might get an invalid request!" << endl;
           self->close(msg.handle);
-          self->quit();
+          upstreamLost(self);
           return;
         }
 
@@ -62,16 +139,44 @@ behavior HttpRevPublish(HttpRevPubBroker* self,
         if (status != 200) {
           cout << "Bad http response: " << status << endl;
           self->close(msg.handle);
-          self->quit();
+          reportOrigin(self, false, -1);
+          upstreamLost(self);
           return;
         }
 
+        state.streaming = true;
+        reportOrigin(self, true,
+                     std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() -
+                       state.requested_at).count());
+        // origins running this server send parsed packets, anything
+        // else plain flv
+        state.relayed =
+          resp->response.hasField("Content-Type") &&
+          resp->response.getField("Content-Type") == relay::MIME;
         auto residue = resp->response.getBody();
-        state.flv_parser.parse(residue);
         resp->status = HttpResp::BODY;
+        if (state.relayed) {
+          if (state.relay_reader.parse(residue) < 0) {
+            cout << "Bad relay stream!" << endl;
+            self->close(msg.handle);
+            upstreamLost(self);
+            return;
+          }
+        } else {
+          state.flv_parser.parse(residue);
+        }
       } else if (resp->status == HttpResp::BODY) {
-        state.flv_parser.parse(msg.buf);
+        if (!state.relayed) {
+          state.flv_parser.parse(msg.buf);
+        } else if (state.relay_reader.parse(msg.buf) < 0) {
+          cout << "Bad relay stream!" << endl;
+          self->close(msg.handle);
+          upstreamLost(self);
+          return;
+        }
       }
+      hlsWake(self, false);
     },
 
     [=](register_atom, const actor& subscriber) {
@@ -81,61 +186,93 @@ behavior HttpRevPublish(HttpRevPubBroker* self,
       self->link_to(subscriber);
     },
 
-    [=](resync_atom, const actor_addr& subscriber) {
+    [=](fanout_add_atom, int fd) {
+      if (fanoutAdd(self, fd) > 0) {
+        idleCheck(self);
+      }
+    },
+
+    [=](fanout_tick_atom) {
+      if (fanoutTick(self) > 0) {
+        idleCheck(self);
+      }
+    },
+
+    [=](resync_atom, const actor_addr& subscriber,
+        FlvPacketCache::Mode mode, SubFormat format,
+        int64_t delay, int64_t resume) {
       printf("resync_atom(%p)\n", self);
-      if (self->state.resp->status != HttpResp::BODY) {
+      FlvPacketList* pkts = nullptr;
+      if (self->state.resp->status == HttpResp::BODY) {
+        pkts = resyncPackets(self, format, mode, delay, resume);
+      }
+      if (!pkts) {
         self->send(actor_cast<actor>(subscriber),
                    eagain_atom::value);
         return;
       }
-      auto& cache = self->state.cache;
-      FlvPacketList* pkts = new FlvPacketList;
-      FlvPacketCache::ErrorCode err = FlvPacketCache::OK;
-      auto dcrs = cache.getDCR();
-      pkts->splice(pkts->end(), std::move(dcrs));
-      for (ssize_t id = -1;
-           PACKET_IS_GOOD(err);) {
-        FlvPacket out;
-        err = cache.getNext(id, out);
-        if (PACKET_IS_GOOD(err)) {
-          id = out.id;
-          pkts->emplace_back(std::move(out));
-        }
-      }
       self->send(actor_cast<actor>(subscriber),
                  read_resp_atom::value,
                  (int64_t)pkts,
                  true);
     },
 
-    [=](read_some_atom, int64_t old, const actor_addr& subscriber) {
+    [=](read_some_atom, int64_t old, int64_t last,
+        const actor_addr& subscriber,
+        FlvPacketCache::Mode mode, SubFormat format) {
       //printf("read_some_atom(%p)\n", self);
-      ssize_t oldId = -1;
       FlvPacketList* pkts = (FlvPacketList*)old;
       for (auto& pkt : *pkts) {
         pkt.payload->release();
-        oldId = pkt.id;
       }
       delete pkts;
 
-      FlvPacketCache::ErrorCode err = FlvPacketCache::OK;
       pkts = new FlvPacketList;
-      auto& cache = self->state.cache;
-      for (ssize_t id = oldId;
-           PACKET_IS_GOOD(err);) {
-        FlvPacket out;
-        err = cache.getNext(id, out);
-        if (PACKET_IS_GOOD(err)) {
-          id = out.id;
-          pkts->emplace_back(std::move(out));
-        }
+      sourceCache(self, format).getAll(last, *pkts, mode);
+      self->send(actor_cast<actor>(subscriber),
+                 read_resp_atom::value,
+                 (int64_t)pkts,
+                 false);
+    },
+
+    [=](dvr_seek_atom, const actor_addr& subscriber, int64_t offset) {
+      printf("dvr_seek_atom(%p)\n", self);
+      FlvPacketList* pkts = dvrSeek(self, offset);
+      if (!pkts) {
+        self->send(actor_cast<actor>(subscriber),
+                   dvr_none_atom::value);
+        return;
       }
+      self->send(actor_cast<actor>(subscriber),
+                 read_resp_atom::value,
+                 (int64_t)pkts,
+                 true);
+    },
+
+    [=](dvr_read_atom, int64_t old, int64_t pos, int64_t until,
+        const actor_addr& subscriber) {
+      FlvPacketList* pkts = (FlvPacketList*)old;
+      for (auto& pkt : *pkts) {
+        pkt.payload->release();
+      }
+      delete pkts;
+
+      pkts = dvrPackets(self, pos, until);
       self->send(actor_cast<actor>(subscriber),
                  read_resp_atom::value,
                  (int64_t)pkts,
                  false);
     },
 
+    [=](hls_get_atom, const std::string& file, int64_t msn, int64_t part,
+        const actor_addr& requester) {
+      hlsGet(self, file, msn, part, requester);
+    },
+
+    [=](hls_check_atom) {
+      hlsWake(self, true);
+    },
+
     [=](reclaim_atom, int64_t old) {
       printf("reclaim_atom(%p)\n", self);
       FlvPacketList* pkts = (FlvPacketList*)old;
@@ -147,24 +284,67 @@ behavior HttpRevPublish(HttpRevPubBroker* self,
 
     [=](const connection_closed_msg& msg) {
       printf("connection_closed_msg(%p)\n", self);
-      self->delayed_send(self,
-                         std::chrono::seconds(3),
-                         delay_shut_atom::value,
-                         self->state.gen,
-                         UPSTREAM_NETWORK_DOWN);
+      upstreamLost(self);
+    },
+
+    [=](reconnect_atom, int gen) {
+      auto& state = self->state;
+      if (state.gen != gen) {
+        return;
+      }
+      auto& origin = state.origins[state.current];
+      printf("reconnect_atom(%p, %s)\n", self, origin.name().c_str());
+      auto hdl = self->add_tcp_scribe(origin.host, origin.port);
+      if (!hdl) {
+        reportOrigin(self, false, -1);
+        upstreamLost(self);
+        return;
+      }
+      state.flv_parser.reset();
+      state.relay_reader.reset(origin.name());
+      requestStream(self, *hdl);
+    },
+
+    [=](warm_atom, int64_t ttl_ms) {
+      auto& state = self->state;
+      state.warm_until =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl_ms);
+      // hints come every second, one timer follows warm_until along
+      if (!state.warm_timer) {
+        state.warm_timer = true;
+        self->delayed_send(self,
+                           std::chrono::milliseconds(ttl_ms),
+                           delay_shut_atom::value,
+                           state.gen,
+                           WARM_EXPIRED);
+      }
     },
 
     [=](delay_shut_atom, int gen, ShutDownReason reason) {
       printf("delay_shut_atom(%p, %d)\n", self, gen);
       switch (reason) {
-        case UPSTREAM_NETWORK_DOWN: {
-          if (self->state.gen == gen) {
+        case NO_MORE_SUBSCIRBER: {
+          if (self->state.nsubs == 0 &&
+              std::chrono::steady_clock::now() >= self->state.warm_until) {
             self->quit();
           }
           break;
         }
-        case NO_MORE_SUBSCIRBER: {
-          if (self->state.nsubs == 0) {
+        case WARM_EXPIRED: {
+          auto& state = self->state;
+          auto now = std::chrono::steady_clock::now();
+          if (now < state.warm_until) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+              state.warm_until - now) + std::chrono::milliseconds(1);
+            self->delayed_send(self,
+                               left,
+                               delay_shut_atom::value,
+                               gen,
+                               WARM_EXPIRED);
+            break;
+          }
+          state.warm_timer = false;
+          if (state.nsubs == 0) {
             self->quit();
           }
           break;
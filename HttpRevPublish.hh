@@ -7,6 +7,8 @@
 
 #include "utils.hh"
 #include "HttpMaster.hh"
+#include "upstream.hh"
+#include "relay.hh"
 
 struct HttpResp {
   http::Response response;
@@ -19,16 +21,38 @@ struct HttpResp {
 };
 
 struct HttpRevPubState {
+  // origins in order of preference, and the one being pulled from
+  std::vector<Upstream> origins;
+  size_t current {0};
+  size_t tried {0};
+  std::string request;
+  std::chrono::steady_clock::time_point requested_at;
   std::unique_ptr<HttpResp> resp;
   FlvPacketCache cache {256};
   FlvParser flv_parser {cache};
+  relay::Reader relay_reader {cache};
+  // whether the upstream answered with relay batches rather than flv
+  bool relayed {false};
+  HlsContext hls;
+  std::unique_ptr<Fmp4Stream> fmp4;
+  std::unique_ptr<DvrRing> dvr;
   actor_addr master;
   int nsubs {0};
   int gen {0};
+  // kept alive without subscribers until then
+  std::chrono::steady_clock::time_point warm_until;
+  bool warm_timer {false};
+  bool streaming {false};
+  int64_t backoff_ms {0};
+  std::chrono::steady_clock::time_point down_since;
+  int node {-1};
+  std::unique_ptr<Fanout> fanout;
 };
 
 using HttpRevPubBroker = caf::stateful_actor<HttpRevPubState, broker>;
 behavior HttpRevPublish(HttpRevPubBroker* self,
                         connection_handle hdl,
+                        const std::vector<Upstream>& origins,
+                        size_t current,
                         const std::string& path,
                         const actor_addr& addr);
@@ -4,9 +4,11 @@
  */
 
 #include "HttpSubscribe.hh"
+#include "relay.hh"
 #include <chrono>
 #include <arpa/inet.h>
 
+#define SIZE_OF_FLV_HEADER 13
 #define SIZE_OF_TAG_HEADER 11
 
 constexpr char http_flv[] = "HTTP/1.1 200 OK\r\n"
@@ -15,14 +17,230 @@ constexpr char http_flv[] = "HTTP/1.1 200 OK\r\n"
                             "Content-Type: video/x-flv\r\n"
                             "\r\n";
 
+constexpr char http_relay[] = "HTTP/1.1 200 OK\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Pragma: no-cache\r\n"
+                              "Content-Type: application/x-flv-relay\r\n"
+                              "\r\n";
+
+constexpr char http_mp4[] = "HTTP/1.1 200 OK\r\n"
+                            "Cache-Control: no-cache\r\n"
+                            "Pragma: no-cache\r\n"
+                            "Content-Type: video/mp4\r\n"
+                            "\r\n";
+
+// The flv tag a packet goes out as, false if it is not sent at all.
+static bool tagType(const FlvPacket& pkt, uint8_t& type) {
+  if (pkt.type == VIDEO ||
+      pkt.type == VIDEO_DCR) {
+    type = FlvParser::TAG_VIDEO;
+  } else if (pkt.type == AUDIO ||
+             pkt.type == AUDIO_DCR) {
+    type = FlvParser::TAG_AUDIO;
+  } else if (pkt.type == SCRIPT ||
+             pkt.type == METADATA) {
+    type = FlvParser::TAG_SCRIPT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// An onStreamPosition script tag: {id, base, epoch}, the id of the
+// packet sent last, the timestamp this subscriber rebases to and the
+// publisher the id is from (ids start over with every publish).
+// Reconnecting with ?resume_from=<id>&ts_base=<base>&epoch=<epoch>
+// continues right after that packet and on the same timeline, as long
+// as the same publisher still has it cached.
+static std::vector<uint8_t> positionTag(int64_t id,
+                                        int64_t base,
+                                        uint64_t epoch,
+                                        uint32_t dts) {
+  std::vector<uint8_t> tag(SIZE_OF_TAG_HEADER);
+  auto putString = [&](const std::string& str) {
+    tag.push_back(str.size() >> 8);
+    tag.push_back(str.size());
+    tag.insert(std::end(tag), std::begin(str), std::end(str));
+  };
+  auto putNumber = [&](double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    tag.push_back(0x00);
+    for (int i = 7; i >= 0; --i) {
+      tag.push_back(bits >> (8 * i));
+    }
+  };
+
+  tag.push_back(0x02);
+  putString("onStreamPosition");
+  tag.insert(std::end(tag), {0x08, 0x00, 0x00, 0x00, 0x03});
+  putString("id");
+  putNumber(id);
+  putString("base");
+  putNumber(base);
+  putString("epoch");
+  putNumber(epoch);
+  tag.insert(std::end(tag), {0x00, 0x00, 0x09});
+
+  uint32_t size = tag.size() - SIZE_OF_TAG_HEADER;
+  tag[0] = FlvParser::TAG_SCRIPT;
+  tag[1] = size >> 16;
+  tag[2] = size >> 8;
+  tag[3] = size;
+  tag[4] = dts >> 16;
+  tag[5] = dts >> 8;
+  tag[6] = dts;
+  tag[7] = dts >> 24;
+  uint32_t prev = tag.size();
+  for (int i = 3; i >= 0; --i) {
+    tag.push_back(prev >> (8 * i));
+  }
+  return tag;
+}
+
+// Asks the publisher for what comes after the batch just sent, handing
+// its list back.
+static void readNext(HttpSubBroker* self, int64_t some, bool resync) {
+  if (self->state.dvr_offset < 0) {
+    // played back at the pace it was recorded, a second ahead
+    auto now = std::chrono::steady_clock::now();
+    if (resync) {
+      self->state.dvr_clock = now;
+    }
+    auto played = std::chrono::duration_cast<std::chrono::milliseconds>(
+      now - self->state.dvr_clock).count();
+    self->delayed_send(self->state.publisher,
+                       std::chrono::milliseconds(500),
+                       dvr_read_atom::value,
+                       some,
+                       self->state.last_id,
+                       self->state.dvr_until + played + 500,
+                       self->address());
+    return;
+  }
+  self->delayed_send(self->state.publisher,
+                     std::chrono::milliseconds(500),
+                     read_some_atom::value,
+                     some,
+                     self->state.last_id,
+                     self->address(),
+                     self->state.mode,
+                     self->state.format);
+}
+
 behavior HttpSubscribe(HttpSubBroker* self,
                        connection_handle hdl,
-                       const std::vector<char>& residue) {
+                       const std::vector<char>& residue,
+                       const std::string& query,
+                       const std::string& upgrade) {
   self->state.handle = hdl;
   self->state.quiting = false;
-  self->write(hdl, strlen(http_flv), http_flv);
+  self->state.websocket = !upgrade.empty();
+
+  auto params = http::parseQuery(query);
+  auto only = params.find("only");
+  if (only != std::end(params)) {
+    if (only->second == "audio") {
+      self->state.mode = FlvPacketCache::AUDIO_ONLY;
+    } else if (only->second == "video") {
+      self->state.mode = FlvPacketCache::VIDEO_ONLY;
+    }
+  }
+  // fmp4 is served as muxed, with both tracks
+  auto format = params.find("format");
+  if (format != std::end(params) && format->second == "mp4") {
+    self->state.format = FORMAT_FMP4;
+    self->state.mode = FlvPacketCache::NORMAL;
+  } else if (format != std::end(params) && format->second == "relay") {
+    self->state.format = FORMAT_RELAY;
+    self->state.mode = FlvPacketCache::NORMAL;
+  }
+  // "delay_ms=3000" starts at the keyframe three seconds behind live,
+  // trading latency for a buffer the player can ride out jitter with
+  auto delay = params.find("delay_ms");
+  if (delay != std::end(params)) {
+    self->state.delay =
+      std::max<int64_t>(strtoll(delay->second.c_str(), nullptr, 10), 0);
+  }
+  auto resume = params.find("resume_from");
+  if (resume != std::end(params)) {
+    self->state.resume = strtoll(resume->second.c_str(), nullptr, 10);
+    auto base = params.find("ts_base");
+    if (base != std::end(params)) {
+      self->state.ts_base = strtoll(base->second.c_str(), nullptr, 10);
+    }
+    auto epoch = params.find("epoch");
+    if (epoch != std::end(params)) {
+      self->state.resume_epoch =
+        strtoull(epoch->second.c_str(), nullptr, 10);
+    }
+  }
+  // "offset=-600" starts ten minutes behind live, from the DVR ring
+  auto offset = params.find("offset");
+  if (offset != std::end(params) &&
+      self->state.format == FORMAT_FLV &&
+      self->state.mode == FlvPacketCache::NORMAL) {
+    self->state.dvr_offset =
+      std::min<int64_t>(strtoll(offset->second.c_str(), nullptr, 10), 0) *
+        1000;
+  }
+
+  // The batches go out on a dup of the socket: a scribe's id is its fd
+  // with the default multiplexer, and the dup stays valid should the
+  // middleman close the scribe while a batch is in flight. Websockets
+  // stay with the middleman, their control frames would race the
+  // batches.
+  if (UringEgress::active() && !self->state.websocket) {
+    int fd = dup(hdl.id());
+    if (fd >= 0) {
+      self->state.uring_sock = std::make_shared<EgressSocket>(fd);
+    }
+  }
+
+  if (self->state.websocket) {
+    self->write(hdl, upgrade.size(), upgrade.data());
+  } else {
+    const char* head = self->state.format == FORMAT_FMP4 ?
+                         http_mp4 : self->state.format == FORMAT_RELAY ?
+                           http_relay : http_flv;
+    if (self->state.uring_sock) {
+      self->state.preamble = head;
+    } else {
+      self->write(hdl, strlen(head), head);
+    }
+  }
   return {
     [=](const new_data_msg& msg) {
+      if (!self->state.websocket) {
+        return;
+      }
+      auto& in = self->state.ws_in;
+      in.insert(std::end(in), std::begin(msg.buf), std::end(msg.buf));
+      http::ws::Frame frame;
+      while (http::ws::parseFrame(in, frame)) {
+        if (frame.op == http::ws::OP_PING) {
+          uint8_t hdr[http::ws::MAX_HEADER_SIZE];
+          size_t n = http::ws::frameHeader(hdr,
+                                           http::ws::OP_PONG,
+                                           frame.payload.size());
+          self->write(hdl, n, hdr);
+          self->write(hdl, frame.payload.size(), frame.payload.data());
+          self->flush(hdl);
+        } else if (frame.op == http::ws::OP_CLOSE) {
+          uint8_t hdr[http::ws::MAX_HEADER_SIZE];
+          size_t n = http::ws::frameHeader(hdr, http::ws::OP_CLOSE, 0);
+          self->write(hdl, n, hdr);
+          self->flush(hdl);
+          self->close(hdl);
+          self->state.quiting = true;
+          return;
+        }
+      }
+      // players only ever send control frames
+      if (in.size() > 4096) {
+        self->close(hdl);
+        self->state.quiting = true;
+      }
     },
   
     [=](sub_init_atom, const actor& publisher) {
@@ -32,9 +250,44 @@ behavior HttpSubscribe(HttpSubBroker* self,
         self->quit();
         return;
       }
-      self->send(self->state.publisher, 
+      // a position from before a republish means nothing to this one,
+      // neither its id nor its timeline
+      if (self->state.resume >= 0 &&
+          self->state.resume_epoch != publisher.id()) {
+        self->state.resume = -1;
+        self->state.ts_base = -1;
+      }
+      if (self->state.dvr_offset < 0) {
+        self->send(self->state.publisher,
+                   dvr_seek_atom::value,
+                   self->address(),
+                   self->state.dvr_offset);
+        return;
+      }
+      self->send(self->state.publisher,
                  resync_atom::value,
-                 self->address());
+                 self->address(),
+                 self->state.mode,
+                 self->state.format,
+                 self->state.delay,
+                 self->state.resume);
+    },
+
+    [=](dvr_none_atom) {
+      printf("dvr_none_atom(%p)\n", self);
+      if (self->state.quiting) {
+        self->quit();
+        return;
+      }
+      // nothing recorded, play live instead
+      self->state.dvr_offset = 0;
+      self->send(self->state.publisher,
+                 resync_atom::value,
+                 self->address(),
+                 self->state.mode,
+                 self->state.format,
+                 self->state.delay,
+                 self->state.resume);
     },
 
     [=](read_resp_atom, int64_t some, bool resync) {
@@ -46,35 +299,122 @@ behavior HttpSubscribe(HttpSubBroker* self,
         self->quit();
         return;
       }
-      if (resync) {
+      FlvPacketList* pkts = (FlvPacketList*)some;
+      // everything goes to the middleman, or into a single batch for
+      // the io_uring egress, which references the payloads
+      std::unique_ptr<EgressBatch> out;
+      if (self->state.uring_sock) {
+        out.reset(new EgressBatch);
+        out->copy(self->state.preamble.data(), self->state.preamble.size());
+        self->state.preamble.clear();
+      }
+      auto put = [&](size_t size, const void* data, bool payload) {
+        if (!out) {
+          self->write(self->state.handle, size, data);
+        } else if (payload) {
+          out->ref(data, size);
+        } else {
+          out->copy(data, size);
+        }
+      };
+      auto flush = [&] {
+        if (!out) {
+          self->flush(self->state.handle);
+        }
+      };
+      bool flv = self->state.format == FORMAT_FLV;
+      uint64_t batch = resync && flv ? SIZE_OF_FLV_HEADER : 0;
+      bool dvr = self->state.dvr_offset < 0;
+      int64_t last_dts = -1;
+      // only the DCRs heading a resync are not read from the cache (or
+      // the DVR ring): they carry no position and keep their own
+      // timestamps, those changing mid-batch are rebased like the media
+      size_t leading = 0;
+      bool heading = resync;
+      for (const auto& pkt : *pkts) {
+        bool media = pkt.type != VIDEO_DCR &&
+                     pkt.type != AUDIO_DCR &&
+                     pkt.type != METADATA;
+        heading = heading && !media;
+        if (heading) {
+          leading++;
+        } else {
+          self->state.last_id = pkt.id;
+        }
+        if (media) {
+          if (self->state.ts_base < 0) {
+            self->state.ts_base = pkt.dts;
+          }
+          last_dts = pkt.dts;
+        }
+        if (dvr && resync &&
+            (pkt.type == VIDEO || pkt.type == AUDIO)) {
+          self->state.dvr_until = pkt.dts;
+        }
+        uint8_t type;
+        if (!flv) {
+          batch += pkt.payload->size();
+        } else if (tagType(pkt, type)) {
+          batch += SIZE_OF_TAG_HEADER + pkt.payload->size() + sizeof(uint32_t);
+        }
+      }
+      // an edge gets the batch as is, in one piece
+      std::vector<uint8_t> relayed;
+      if (self->state.format == FORMAT_RELAY) {
+        relay::encode(*pkts, relayed);
+        batch = relayed.size();
+      }
+      // tells the player where to resume from should it reconnect
+      std::vector<uint8_t> position;
+      if (flv && !dvr && last_dts >= 0) {
+        position = positionTag(self->state.last_id,
+                               self->state.ts_base,
+                               self->state.publisher.id(),
+                               last_dts - self->state.ts_base);
+        batch += position.size();
+      }
+      // the whole batch is a single binary message
+      if (self->state.websocket && batch > 0) {
+        uint8_t hdr[http::ws::MAX_HEADER_SIZE];
+        size_t n = http::ws::frameHeader(hdr, http::ws::OP_BINARY, batch);
+        put(n, hdr, false);
+      }
+      if (resync && flv) {
+        char flags =
+          self->state.mode == FlvPacketCache::AUDIO_ONLY ?
+            0x04 : self->state.mode == FlvPacketCache::VIDEO_ONLY ?
+              0x01 : 0x04 | 0x01;
         char hdr_with_size[] = {
-          0x46, 0x4c, 0x56, 0x01, 0x04 | 0x01,
+          0x46, 0x4c, 0x56, 0x01, flags,
           0x00, 0x00, 0x00, 0x09, 0x00,
           0x00, 0x00, 0x00
         };
-        self->write(self->state.handle,
-                    arraySize(hdr_with_size),
-                    hdr_with_size);
+        put(arraySize(hdr_with_size), hdr_with_size, false);
       }
-      FlvPacketList* pkts = (FlvPacketList*)some;
+      if (!relayed.empty()) {
+        put(relayed.size(), relayed.data(), false);
+        flush();
+      }
+      size_t index = 0;
       for (const auto& pkt : *pkts) {
+        if (!relayed.empty()) {
+          break;
+        }
+        bool head = index++ < leading;
+        // init segment and fragments go out as they are
+        if (!flv) {
+          put(pkt.payload->size(), pkt.payload->constBytes(), true);
+          flush();
+          continue;
+        }
+
         uint8_t type;
-        if (pkt.type == VIDEO ||
-            pkt.type == VIDEO_DCR) {
-          type = FlvParser::TAG_VIDEO;
-        } else if (pkt.type == AUDIO ||
-                   pkt.type == AUDIO_DCR) {
-          type = FlvParser::TAG_AUDIO;
-        } else {
+        if (!tagType(pkt, type)) {
           continue;
         }
 
         uint32_t dts = pkt.dts;
-        if (pkt.type != VIDEO_DCR &&
-            pkt.type != AUDIO_DCR) {
-          if (self->state.ts_base < 0) {
-            self->state.ts_base = pkt.dts;
-          }
+        if (!head) {
           dts -= self->state.ts_base;
         }
 
@@ -92,24 +432,44 @@ behavior HttpSubscribe(HttpSubBroker* self,
         htag[6] = (dts & 0x000000ff);
         htag[7] = (dts & 0xff000000) >> 24;
 
-        self->write(self->state.handle,
-                    sizeof(htag),
-                    &htag);
-        self->write(self->state.handle,
-                    pkt.payload->size(),
-                    pkt.payload->constBytes());
+        put(sizeof(htag), &htag, false);
+        put(pkt.payload->size(), pkt.payload->constBytes(), true);
         uint32_t prev_tag_size = pkt.payload->size() + SIZE_OF_TAG_HEADER;
         prev_tag_size = htonl(prev_tag_size);
-        self->write(self->state.handle,
-                    sizeof(prev_tag_size),
-                    &prev_tag_size);
-        self->flush(self->state.handle);
+        put(sizeof(prev_tag_size), &prev_tag_size, false);
+        flush();
       }
-      self->delayed_send(self->state.publisher,
-                         std::chrono::milliseconds(500),
-                         read_some_atom::value,
-                         (int64_t)pkts,
-                         self->address());
+      if (!position.empty()) {
+        put(position.size(), position.data(), false);
+        flush();
+      }
+      if (out && !out->empty()) {
+        // the list stays here until the kernel is done with it
+        self->state.sending = some;
+        self->state.sending_resync = resync;
+        // the publisher is the stream, its id picks the home loop
+        auto& egress = UringEgress::pick(self->state.publisher.id());
+        egress.send(self->state.uring_sock,
+                    std::move(out),
+                    actor_cast<actor>(self));
+        return;
+      }
+      readNext(self, some, resync);
+    },
+
+    [=](egress_done_atom, int64_t result) {
+      int64_t some = self->state.sending;
+      self->state.sending = 0;
+      if (result < 0) {
+        printf("egress(%p): %s\n", self, strerror(-result));
+        self->state.quiting = true;
+      }
+      if (self->state.quiting) {
+        self->send(self->state.publisher, reclaim_atom::value, some);
+        self->quit();
+        return;
+      }
+      readNext(self, some, self->state.sending_resync);
     },
 
     [=](eagain_atom) {
@@ -121,7 +481,11 @@ behavior HttpSubscribe(HttpSubBroker* self,
       self->delayed_send(self->state.publisher,
                          std::chrono::milliseconds(200),
                          resync_atom::value,
-                         self->address());
+                         self->address(),
+                         self->state.mode,
+                         self->state.format,
+                         self->state.delay,
+                         self->state.resume);
     },
 
     [=](const connection_closed_msg& msg) {
@@ -7,12 +7,42 @@
 
 #include "utils.hh"
 #include "HttpPublish.hh"
+#include "uring.hh"
+#include <unistd.h>
+#include <sys/socket.h>
 
 struct HttpSubState {
   actor publisher;
   connection_handle handle;
   int64_t ts_base {-1};
+  int64_t last_id {-1};
+  FlvPacketCache::Mode mode {FlvPacketCache::NORMAL};
+  SubFormat format {FORMAT_FLV};
+  int64_t delay {0};
+  int64_t resume {-1};
+  // the publisher `resume` was sent by
+  uint64_t resume_epoch {0};
+  bool websocket {false};
+  int64_t dvr_offset {0};
+  int64_t dvr_until {-1};
+  std::chrono::steady_clock::time_point dvr_clock;
+  std::vector<char> ws_in;
   bool quiting {false};
+  // with the io_uring egress: the socket the batches are sent on, the
+  // response head going out with the first one, the list in flight
+  std::shared_ptr<EgressSocket> uring_sock;
+  std::string preamble;
+  int64_t sending {0};
+  bool sending_resync {false};
+
+  ~HttpSubState() {
+    // killed with a batch in flight: the send fails now rather than
+    // waiting on a viewer that may never read again, and the socket is
+    // closed once the egress lets go of it
+    if (uring_sock && sending) {
+      shutdown(uring_sock->fd(), SHUT_RDWR);
+    }
+  }
 };
 
 using sub_init_atom = atom_constant<atom("sub_init")>;
@@ -22,4 +52,6 @@ using eagain_atom = atom_constant<atom("eagain")>;
 using HttpSubBroker = caf::stateful_actor<HttpSubState, broker>;
 behavior HttpSubscribe(HttpSubBroker* self,
                        connection_handle hdl,
-                       const std::vector<char>& residue);
+                       const std::vector<char>& residue,
+                       const std::string& query,
+                       const std::string& upgrade);
@@ -0,0 +1,231 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "HttpVod.hh"
+#include <fcntl.h>
+#include <unistd.h>
+
+constexpr char http_not_found[] = "HTTP/1.1 404 Not Found\r\n"
+                                  "Connection: close\r\n"
+                                  "Content-Length: 0\r\n"
+                                  "\r\n";
+
+// Bytes handed to the scribe at once, and how far its buffer has to
+// drain before the next ones follow.
+constexpr size_t VOD_CHUNK = 256 * 1024;
+constexpr size_t VOD_LOW_WATER = 64 * 1024;
+// Bytes read ahead at once, and at most waiting in the page cache.
+constexpr size_t VOD_AHEAD = 1024 * 1024;
+constexpr size_t VOD_WARM = 2 * VOD_AHEAD;
+
+// The broker runs on the middleman's thread, with every other broker:
+// opening a file (a full scan of its tags for the index, the first
+// time) or faulting a cold mapping in there would stall all the live
+// streams. So this actor, on a thread of its own, opens, maps and
+// indexes the file, then reads every range the broker asks for once
+// through its own fd, so that the broker copies it out of the page
+// cache. It never touches the mapping, which is the broker's.
+static behavior VodReader(event_based_actor* self,
+                          const std::string& path,
+                          size_t cached,
+                          const actor& broker) {
+  auto file = VodFile::open(path, cached);
+  int fd = file ? ::open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+  self->send(broker, vod_open_atom::value, (int64_t)file.release());
+
+  self->monitor(broker);
+  self->set_down_handler([=](const down_msg& msg) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    self->quit();
+  });
+
+  auto buf = std::make_shared<std::vector<uint8_t>>(VOD_AHEAD);
+  return {
+    [=](vod_ahead_atom, uint64_t begin, uint64_t end) {
+      uint64_t off = begin;
+      while (fd >= 0 && off < end) {
+        ssize_t n = pread(fd, buf->data(),
+                          std::min<uint64_t>(end - off, buf->size()), off);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        } else if (n <= 0) {
+          break;
+        }
+        off += n;
+      }
+      self->send(broker, vod_warm_atom::value, begin, end);
+    }
+  };
+}
+
+// Asks the reader for the next cold bytes, while less than VOD_WARM
+// of them wait to be sent.
+static void prefetch(HttpVodBroker* self, const actor& reader) {
+  auto& state = self->state;
+  if (state.fetching || state.cold.empty()) {
+    return;
+  }
+  uint64_t warm = 0;
+  for (const auto& range : state.ranges) {
+    warm += range.second - range.first;
+  }
+  if (warm >= VOD_WARM) {
+    return;
+  }
+  auto& range = state.cold.front();
+  uint64_t end = std::min<uint64_t>(range.second, range.first + VOD_AHEAD);
+  self->send(reader, vod_ahead_atom::value, range.first, end);
+  state.fetching = true;
+  range.first = end;
+  if (range.first == range.second) {
+    state.cold.pop_front();
+  }
+}
+
+// Queues the next chunks of the file, straight out of the mapping.
+// Not sendfile(): the socket (hdl.id()) is still the scribe's, which
+// may be flushing the response head into it, and the broker learns
+// about room in it only through data_transferred_msg. Sending around
+// the scribe would need a poll loop (or a thread) of its own per
+// viewer; this way it is one copy and the middleman paces it. Only
+// what the reader has read ahead goes, so the copy does not wait on
+// the disk.
+static void pump(HttpVodBroker* self,
+                 connection_handle hdl,
+                 const actor& reader) {
+  auto& state = self->state;
+  size_t queued = 0;
+  while (queued < 4 * VOD_CHUNK && !state.ranges.empty()) {
+    auto& range = state.ranges.front();
+    size_t n = std::min<uint64_t>(range.second - range.first, VOD_CHUNK);
+    self->write(hdl, n, state.file->data() + range.first);
+    range.first += n;
+    queued += n;
+    if (range.first == range.second) {
+      state.ranges.pop_front();
+    }
+  }
+  state.starved = queued == 0;
+  if (queued > 0) {
+    self->flush(hdl);
+  }
+  prefetch(self, reader);
+}
+
+// Answers with the file, from `query`'s start.
+static void serve(HttpVodBroker* self,
+                  connection_handle hdl,
+                  const std::string& query,
+                  const actor& reader) {
+  auto& state = self->state;
+
+  // "start=90" plays from the keyframe before 1'30". The file goes out
+  // untouched from its beginning; otherwise a new flv header and the
+  // file's own header tags come first.
+  auto params = http::parseQuery(query);
+  int64_t start = params.count("start") ?
+    strtod(params["start"].c_str(), nullptr) * 1000 : 0;
+  auto& file = *state.file;
+  auto& index = file.index();
+  if (start <= 0) {
+    state.cold.emplace_back(0, file.size());
+  } else {
+    const char hdr[] = {
+      0x46, 0x4c, 0x56, 0x01, (char)index.flags,
+      0x00, 0x00, 0x00, 0x09,
+      0x00, 0x00, 0x00, 0x00
+    };
+    state.head.assign(hdr, sizeof(hdr));
+    for (const auto& range : index.headers) {
+      state.cold.push_back(range);
+    }
+    state.cold.emplace_back(index.seek(start), file.size());
+  }
+
+  uint64_t length = state.head.size();
+  for (const auto& range : state.cold) {
+    length += range.second - range.first;
+  }
+  std::stringstream ss;
+  ss << "HTTP/1.1 200 OK\r\n"
+     << "Connection: close\r\n"
+     << "Access-Control-Allow-Origin: *\r\n"
+     << "Content-Type: video/x-flv\r\n"
+     << "Content-Length: " << length << "\r\n"
+     << "\r\n";
+  auto resp = ss.str();
+  self->write(hdl, resp.size(), resp.data());
+  self->write(hdl, state.head.size(), state.head.data());
+  self->ack_writes(hdl, true);
+  self->flush(hdl);
+  // nothing to send before the first read ahead is back
+  state.starved = true;
+  prefetch(self, reader);
+}
+
+behavior HttpVod(HttpVodBroker* self,
+                 connection_handle hdl,
+                 const std::string& path,
+                 const std::string& query) {
+  auto reader = self->spawn<detached>(VodReader, path,
+                                      getConfig(self->system()).vod_index_cache,
+                                      actor_cast<actor>(self));
+
+  return {
+    [=](const new_data_msg& msg) {
+    },
+
+    [=](vod_open_atom, int64_t some) {
+      auto& state = self->state;
+      state.file.reset((VodFile*)some);
+      if (state.quiting) {
+        self->quit();
+        return;
+      }
+      if (!state.file) {
+        self->write(hdl, strlen(http_not_found), http_not_found);
+        self->flush(hdl);
+        self->close(hdl);
+        self->quit();
+        return;
+      }
+      serve(self, hdl, query, reader);
+    },
+
+    [=](vod_warm_atom, uint64_t begin, uint64_t end) {
+      auto& state = self->state;
+      state.fetching = false;
+      state.ranges.emplace_back(begin, end);
+      if (state.starved) {
+        pump(self, hdl, reader);
+      } else {
+        prefetch(self, reader);
+      }
+    },
+
+    [=](const data_transferred_msg& msg) {
+      auto& state = self->state;
+      if (msg.remaining == 0 && state.ranges.empty() &&
+          state.cold.empty() && !state.fetching) {
+        self->close(hdl);
+        self->quit();
+      } else if (msg.remaining < VOD_LOW_WATER) {
+        pump(self, hdl, reader);
+      }
+    },
+
+    [=](const connection_closed_msg& msg) {
+      printf("connection_closed_msg(%p)\n", self);
+      if (!self->state.file) {
+        // the reader's answer still has to be freed
+        self->state.quiting = true;
+        return;
+      }
+      self->quit();
+    }
+  };
+}
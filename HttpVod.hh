@@ -0,0 +1,37 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include "vod.hh"
+#include "config.hh"
+
+struct HttpVodState {
+  std::unique_ptr<VodFile> file;
+  std::string head;
+  // what is left to send after `head`, as [begin, end) of the file:
+  // read ahead already, and not yet
+  std::deque<std::pair<uint64_t, uint64_t>> ranges;
+  std::deque<std::pair<uint64_t, uint64_t>> cold;
+  // a read ahead is running
+  bool fetching {false};
+  // the scribe ran dry waiting for one
+  bool starved {false};
+  // the viewer left before the file was open
+  bool quiting {false};
+};
+
+// broker <- reader: the VodFile*, null if it cannot be served
+using vod_open_atom = atom_constant<atom("vod_open")>;
+// broker -> reader -> broker: [begin, end) is in the page cache
+using vod_ahead_atom = atom_constant<atom("vod_ahead")>;
+using vod_warm_atom = atom_constant<atom("vod_warm")>;
+
+using HttpVodBroker = caf::stateful_actor<HttpVodState, broker>;
+behavior HttpVod(HttpVodBroker* self,
+                 connection_handle hdl,
+                 const std::string& path,
+                 const std::string& query);
@@ -0,0 +1,214 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+// Subscriber egress, io_uring against what the middleman does with
+// epoll: `sockets` subscribers, each sent `packets` tags of `payload`
+// bytes per round, drained by a thread of their peers. Counts the
+// syscalls of the sending side only.
+//
+//   make bench && ./bench/egress --mode=epoll && ./bench/egress --mode=uring
+
+#include "../uring.hh"
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+namespace {
+
+class bench_config : public actor_system_config {
+public:
+  std::string mode {"uring"};
+  uint32_t sockets {400};
+  uint32_t packets {10};
+  uint32_t payload {8192};
+  uint32_t rounds {40};
+
+  bench_config() {
+    opt_group{custom_options_, "global"}
+      .add(mode,    "mode,m",    "\"epoll\" (the middleman) or \"uring\"")
+      .add(sockets, "sockets,s", "subscribers")
+      .add(packets, "packets",   "tags per subscriber and round")
+      .add(payload, "payload",   "bytes per tag")
+      .add(rounds,  "rounds,r",  "rounds");
+  }
+};
+
+struct Pair {
+  int out;
+  int in;
+};
+
+void drain(const std::vector<Pair>& pairs, const std::atomic<bool>& stop) {
+  int ep = epoll_create1(0);
+  for (size_t i = 0; i < pairs.size(); i++) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, pairs[i].in, &ev);
+  }
+  std::vector<char> buf(1 << 18);
+  struct epoll_event events[256];
+  while (!stop) {
+    int n = epoll_wait(ep, events, 256, 100);
+    for (int i = 0; i < n; i++) {
+      int fd = pairs[events[i].data.u64].in;
+      while (read(fd, buf.data(), buf.size()) > 0) {
+      }
+    }
+  }
+  close(ep);
+}
+
+// The middleman: the tags copied to the scribe buffer, EPOLLOUT turned
+// on by the flush, written once writable, off again once empty.
+uint64_t viaEpoll(const bench_config& cfg,
+                  const std::vector<Pair>& pairs,
+                  const uint8_t* tag, size_t tagSize) {
+  uint64_t syscalls = 0;
+  int ep = epoll_create1(0);
+  for (size_t i = 0; i < pairs.size(); i++) {
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.u64 = i;
+    epoll_ctl(ep, EPOLL_CTL_ADD, pairs[i].out, &ev);
+  }
+
+  std::vector<std::vector<uint8_t>> wbuf(pairs.size());
+  std::vector<size_t> offset(pairs.size());
+  struct epoll_event events[256];
+  for (uint32_t r = 0; r < cfg.rounds; r++) {
+    size_t pending = 0;
+    for (size_t i = 0; i < pairs.size(); i++) {
+      auto& w = wbuf[i];
+      w.clear();
+      offset[i] = 0;
+      for (uint32_t p = 0; p < cfg.packets; p++) {
+        w.insert(std::end(w), tag, tag + tagSize);
+      }
+      struct epoll_event ev;
+      ev.events = EPOLLOUT;
+      ev.data.u64 = i;
+      epoll_ctl(ep, EPOLL_CTL_MOD, pairs[i].out, &ev);
+      syscalls++;
+      pending++;
+    }
+    while (pending > 0) {
+      int n = epoll_wait(ep, events, 256, -1);
+      syscalls++;
+      for (int k = 0; k < n; k++) {
+        size_t i = events[k].data.u64;
+        ssize_t c = ::send(pairs[i].out, wbuf[i].data() + offset[i],
+                           wbuf[i].size() - offset[i], MSG_NOSIGNAL);
+        syscalls++;
+        if (c > 0) {
+          offset[i] += c;
+        }
+        if (offset[i] == wbuf[i].size()) {
+          struct epoll_event ev;
+          ev.events = 0;
+          ev.data.u64 = i;
+          epoll_ctl(ep, EPOLL_CTL_MOD, pairs[i].out, &ev);
+          syscalls++;
+          pending--;
+        }
+      }
+    }
+  }
+  close(ep);
+  return syscalls;
+}
+
+// Each subscriber hands a batch per round to the loop, with the tag
+// headers copied and the payloads referenced, as HttpSubscribe does.
+uint64_t viaUring(actor_system& system,
+                  const bench_config& cfg,
+                  const std::vector<Pair>& pairs,
+                  const uint8_t* tag, size_t tagSize) {
+  auto& loop = UringEgress::at(0);
+  auto sink = system.spawn([]() -> behavior {
+    return {
+      [](egress_done_atom, int64_t) {
+      }
+    };
+  });
+
+  std::vector<std::shared_ptr<EgressSocket>> socks;
+  for (const auto& pair : pairs) {
+    socks.push_back(std::make_shared<EgressSocket>(dup(pair.out)));
+  }
+  for (uint32_t r = 0; r < cfg.rounds; r++) {
+    for (const auto& sock : socks) {
+      std::unique_ptr<EgressBatch> batch(new EgressBatch);
+      for (uint32_t p = 0; p < cfg.packets; p++) {
+        batch->copy(tag, 11);
+        batch->ref(tag + 11, tagSize - 15);
+        batch->copy(tag + tagSize - 4, 4);
+      }
+      loop.send(sock, std::move(batch), sink);
+    }
+    while (loop.load() > 0) {
+      std::this_thread::yield();
+    }
+  }
+  return loop.syscalls();
+}
+
+} // namespace
+
+void caf_main(actor_system& system, const bench_config& cfg) {
+  bool uring = cfg.mode == "uring";
+  if (!uring && cfg.mode != "epoll") {
+    printf("unknown mode %s\n", cfg.mode.c_str());
+    return;
+  }
+  if (uring) {
+    if (!UringEgress::init(1, 4096)) {
+      printf("no io_uring here\n");
+      return;
+    }
+    system.spawn<detached>(UringLoop, size_t(0), -1);
+  }
+
+  std::vector<Pair> pairs;
+  for (uint32_t i = 0; i < cfg.sockets; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      return;
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    pairs.push_back({sv[0], sv[1]});
+  }
+  std::vector<uint8_t> tag(11 + cfg.payload + 4, 7);
+
+  std::atomic<bool> stop {false};
+  std::thread drainer(drain, std::cref(pairs), std::cref(stop));
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t syscalls = uring
+    ? viaUring(system, cfg, pairs, tag.data(), tag.size())
+    : viaEpoll(cfg, pairs, tag.data(), tag.size());
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+  double gbit = 8.0 * tag.size() * cfg.packets * cfg.sockets * cfg.rounds / 1e9;
+  printf("%s: %.2f Gbit in %.2fs = %.2f Gbps, %llu syscalls, %.0f syscalls/Gbit\n",
+         cfg.mode.c_str(), gbit, took.count(), gbit / took.count(),
+         (unsigned long long)syscalls, syscalls / gbit);
+
+  stop = true;
+  drainer.join();
+  for (const auto& pair : pairs) {
+    close(pair.out);
+    close(pair.in);
+  }
+  // the loop never returns, its thread goes with the process
+  exit(0);
+}
+
+CAF_MAIN()
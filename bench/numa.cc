@@ -0,0 +1,160 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+// Payloads parsed on one node and read on another, as a publisher and
+// the egress loops of its subscribers would. Without --arena they land
+// where the ingest thread first touches them, with it they come from
+// the readers' node arena (what [numa] enable does with the stream's
+// node). Prints the read bandwidth and how many payloads sit on the
+// readers' node.
+//
+//   make bench && ./bench/numa && ./bench/numa --arena
+//
+// Needs two nodes: a two socket box, or a kernel booted with
+// numa=fake=2 to check that it runs (fake nodes share the same memory,
+// so no difference in bandwidth is to be expected there). For the
+// remote traffic itself, run both under
+// perf stat -e node-loads,node-load-misses.
+
+#include "../utils.hh"
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+namespace {
+
+struct Options {
+  bool arena {false};
+  int ingest {0};
+  int readers {-1};
+  size_t threads {4};
+  size_t packets {20000};
+  size_t payload {8192};
+  size_t passes {20};
+};
+
+bool parse(int argc, char** argv, Options& opts) {
+  static const struct option longs[] = {
+    {"arena",   no_argument,       nullptr, 'a'},
+    {"ingest",  required_argument, nullptr, 'i'},
+    {"readers", required_argument, nullptr, 'r'},
+    {"threads", required_argument, nullptr, 't'},
+    {"packets", required_argument, nullptr, 'n'},
+    {"payload", required_argument, nullptr, 's'},
+    {"passes",  required_argument, nullptr, 'p'},
+    {nullptr,   0,                 nullptr, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "", longs, nullptr)) != -1) {
+    switch (c) {
+      case 'a': opts.arena = true; break;
+      case 'i': opts.ingest = atoi(optarg); break;
+      case 'r': opts.readers = atoi(optarg); break;
+      case 't': opts.threads = strtoul(optarg, nullptr, 10); break;
+      case 'n': opts.packets = strtoul(optarg, nullptr, 10); break;
+      case 's': opts.payload = strtoul(optarg, nullptr, 10); break;
+      case 'p': opts.passes = strtoul(optarg, nullptr, 10); break;
+      default:
+        printf("usage: %s [--arena] [--ingest=node] [--readers=node] "
+               "[--threads=n] [--packets=n] [--payload=bytes] "
+               "[--passes=n]\n", argv[0]);
+        return false;
+    }
+  }
+  return true;
+}
+
+int pageNode(const void* p) {
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p,
+              MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+    return -1;
+  }
+  return node;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Options opts;
+  if (!parse(argc, argv, opts)) {
+    return 1;
+  }
+  if (!numa::init()) {
+    printf("no NUMA topology in sysfs\n");
+    return 1;
+  }
+  if (opts.readers < 0) {
+    opts.readers = numa::nodes() - 1;
+  }
+  if (opts.ingest == opts.readers) {
+    printf("ingest and readers both on node %d, nothing is remote\n",
+           opts.ingest);
+  }
+
+  std::vector<byte_t*> bytes;
+  std::thread([&] {
+    if (!numa::bindThread(opts.ingest)) {
+      printf("ingest not bound to node %d\n", opts.ingest);
+    }
+    std::vector<uint8_t> data(opts.payload, 7);
+    numa::NodeScope scope(opts.arena ? opts.readers : -1);
+    for (size_t i = 0; i < opts.packets; i++) {
+      bytes.push_back(byte_t::create(data.data(), data.size()));
+    }
+  }).join();
+
+  size_t local = 0;
+  for (auto b : bytes) {
+    local += pageNode(b->constBytes()) == opts.readers;
+  }
+
+  std::atomic<uint64_t> sum {0};
+  std::vector<std::thread> readers;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t t = 0; t < opts.threads; t++) {
+    readers.emplace_back([&, t] {
+      if (!numa::bindThread(opts.readers)) {
+        printf("reader %zu not bound to node %d\n", t, opts.readers);
+      }
+      uint64_t s = 0;
+      for (size_t pass = 0; pass < opts.passes; pass++) {
+        // each thread starts elsewhere, like loops serving different
+        // subscribers of the same packets
+        for (size_t k = 0; k < bytes.size(); k++) {
+          const byte_t* b = bytes[(k + t * bytes.size() / opts.threads) %
+                                  bytes.size()];
+          const uint64_t* p = (const uint64_t*)b->constBytes();
+          for (size_t w = 0; w < b->size() / sizeof(uint64_t); w++) {
+            s += p[w];
+          }
+        }
+      }
+      sum += s;
+    });
+  }
+  for (auto& r : readers) {
+    r.join();
+  }
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+  double gb = 1.0 * opts.payload * opts.packets * opts.passes *
+              opts.threads / 1e9;
+  printf("%s: node %d -> %d, %.2f GB read in %.2fs = %.2f GB/s, "
+         "%zu of %zu payloads on node %d (%llu)\n",
+         opts.arena ? "arena" : "malloc", opts.ingest, opts.readers,
+         gb, took.count(), gb / took.count(),
+         local, bytes.size(), opts.readers,
+         (unsigned long long)sum.load());
+
+  for (auto b : bytes) {
+    b->release();
+  }
+  return 0;
+}
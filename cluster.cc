@@ -0,0 +1,172 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "cluster.hh"
+#include "config.hh"
+#include <unistd.h>
+
+// peers not heard of for this long are taken for gone
+static const auto PEER_EXPIRY = std::chrono::seconds(3);
+static const auto SYNC_INTERVAL = std::chrono::seconds(1);
+
+// "a:9000, b:9000"
+static std::vector<ClusterSeed> parseSeeds(const std::string& peers) {
+  std::vector<ClusterSeed> seeds;
+  std::stringstream ss(peers);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t") + 1);
+    auto colon = item.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+      if (!item.empty()) {
+        cout << "Bad cluster peer: " << item << endl;
+      }
+      continue;
+    }
+    ClusterSeed seed;
+    seed.host = item.substr(0, colon);
+    seed.port = std::stoi(item.substr(colon + 1));
+    seeds.push_back(seed);
+  }
+  return seeds;
+}
+
+// Works out where every remote stream lives, and tells the master what
+// changed. A stream pushed to several peers goes to the lowest url, so
+// every node picks the same one.
+static void relocate(ClusterActor* self) {
+  auto& state = self->state;
+  std::map<std::string, std::string> located;
+  for (auto& peer : state.peers) {
+    for (auto& path : peer.second.streams) {
+      if (!located.count(path)) {
+        located[path] = peer.first;
+      }
+    }
+  }
+
+  for (auto& loc : located) {
+    auto it = state.located.find(loc.first);
+    if (it == state.located.end() || it->second != loc.second) {
+      self->send(state.master, cluster_loc_atom::value,
+                 loc.first, loc.second);
+    }
+  }
+  for (auto& loc : state.located) {
+    if (!located.count(loc.first)) {
+      self->send(state.master, cluster_loc_atom::value,
+                 loc.first, std::string());
+    }
+  }
+  state.located.swap(located);
+}
+
+behavior ClusterDirectory(ClusterActor* self, const actor& master) {
+  auto& cfg = getConfig(self->system());
+  auto& state = self->state;
+  state.master = master;
+  state.url = cfg.cluster_advertise;
+  if (state.url.empty()) {
+    char host[256] = {0};
+    gethostname(host, sizeof(host) - 1);
+    state.url = std::string("http://") + host + ":" +
+                std::to_string(cfg.port);
+  }
+  state.seeds = parseSeeds(cfg.cluster_peers);
+
+  auto port = self->system().middleman().publish(actor_cast<actor>(self),
+                                                 cfg.cluster_port);
+  if (!port) {
+    cerr << "cannot publish the cluster directory on "
+         << cfg.cluster_port << ": "
+         << self->system().render(port.error()) << endl;
+    self->quit();
+    return {};
+  }
+  cout << "cluster node " << state.url
+       << " listening on " << *port << endl;
+
+  self->set_down_handler([=](const down_msg& msg) {
+    for (auto& seed : self->state.seeds) {
+      if (seed.node && seed.node.address() == msg.source) {
+        seed.node = actor();
+      }
+    }
+  });
+
+  self->send(master, cluster_join_atom::value, actor_cast<actor>(self));
+  self->send(self, cluster_tick_atom::value);
+  return {
+    [=](cluster_add_atom, const std::string& path) {
+      self->state.local.insert(path);
+    },
+
+    [=](cluster_del_atom, const std::string& path) {
+      self->state.local.erase(path);
+    },
+
+    [=](cluster_hot_atom, const std::vector<std::string>& hot) {
+      self->state.hot = hot;
+    },
+
+    [=](cluster_sync_atom, const std::string& url,
+        const std::vector<std::string>& streams,
+        const std::vector<std::string>& hot) {
+      auto& state = self->state;
+      if (url == state.url) {
+        return;
+      }
+      auto& peer = state.peers[url];
+      peer.node = actor_cast<actor>(self->current_sender());
+      peer.streams = streams;
+      peer.last_seen = std::chrono::steady_clock::now();
+      relocate(self);
+      for (auto& path : hot) {
+        self->send(state.master, cluster_warm_atom::value, path, url);
+      }
+    },
+
+    [=](cluster_tick_atom) {
+      auto& state = self->state;
+      auto now = std::chrono::steady_clock::now();
+      for (auto it = state.peers.begin(); it != state.peers.end();) {
+        if (now - it->second.last_seen > PEER_EXPIRY) {
+          cout << "cluster peer " << it->first << " gone" << endl;
+          it = state.peers.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      relocate(self);
+
+      std::vector<std::string> streams(state.local.begin(),
+                                       state.local.end());
+      std::set<actor> sent;
+      for (auto& seed : state.seeds) {
+        if (!seed.node) {
+          auto node = self->system().middleman().remote_actor(seed.host,
+                                                              seed.port);
+          if (!node) {
+            continue;
+          }
+          seed.node = *node;
+          self->monitor(seed.node);
+        }
+        if (sent.insert(seed.node).second) {
+          self->send(seed.node, cluster_sync_atom::value,
+                     state.url, streams, state.hot);
+        }
+      }
+      for (auto& peer : state.peers) {
+        if (sent.insert(peer.second.node).second) {
+          self->send(peer.second.node, cluster_sync_atom::value,
+                     state.url, streams, state.hot);
+        }
+      }
+      self->delayed_send(self, SYNC_INTERVAL, cluster_tick_atom::value);
+    }
+  };
+}
@@ -0,0 +1,65 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include <map>
+#include <set>
+
+// master -> directory: a stream got pushed to / left this node
+using cluster_add_atom  = atom_constant<atom("cl_add")>;
+using cluster_del_atom  = atom_constant<atom("cl_del")>;
+// directory -> master: the directory is up / where a stream lives now,
+// an empty url when no peer has it any more
+using cluster_join_atom = atom_constant<atom("cl_join")>;
+using cluster_loc_atom  = atom_constant<atom("cl_loc")>;
+// directory <-> directory: the full list of streams pushed to a node
+using cluster_sync_atom = atom_constant<atom("cl_sync")>;
+using cluster_tick_atom = atom_constant<atom("cl_tick")>;
+// master -> directory: the streams pushed here that are hot right now
+using cluster_hot_atom  = atom_constant<atom("cl_hot")>;
+// directory -> master: a peer has a hot stream, pull it ahead of time
+using cluster_warm_atom = atom_constant<atom("cl_warm")>;
+// master, to itself: time to rank the streams
+using cluster_rank_atom = atom_constant<atom("cl_rank")>;
+
+struct ClusterSeed {
+  std::string host;
+  uint16_t port {0};
+  actor node;
+};
+
+struct ClusterPeer {
+  actor node;
+  std::vector<std::string> streams;
+  std::chrono::steady_clock::time_point last_seen;
+};
+
+struct ClusterState {
+  actor master;
+  // the url peers pull our streams from
+  std::string url;
+  std::vector<ClusterSeed> seeds;
+  std::set<std::string> local;
+  std::vector<std::string> hot;
+  // keyed by the peers' urls
+  std::map<std::string, ClusterPeer> peers;
+  // what the master was last told: path -> peer url
+  std::map<std::string, std::string> located;
+};
+
+// One per node when [cluster] port is set. Publishes itself on that
+// port, and once a second sends the streams pushed to this node to
+// every peer it knows: the configured ones, and whoever synced with
+// it. Peers not heard of for a few seconds are forgotten. The stream
+// locations that result are passed on to the master, which pulls from
+// the peer instead of the upstream on a miss. Streams the master finds
+// hot go along with every sync, and peers start pulling them before
+// anyone asks.
+//
+// Runs detached, connecting to a peer blocks.
+using ClusterActor = caf::stateful_actor<ClusterState, event_based_actor>;
+behavior ClusterDirectory(ClusterActor* self, const actor& master);
@@ -0,0 +1,112 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+
+class config : public actor_system_config {
+public:
+  uint16_t port {0};
+  std::string up_stream_url;
+  uint32_t upstream_check_ms {5000};
+  std::string upstream_routing {"latency"};
+  uint32_t upstream_load_bound {125};
+  bool publish_fanout {false};
+
+  uint32_t hls_segment_ms {2000};
+  uint32_t hls_part_ms {500};
+  uint32_t hls_segments {6};
+
+  uint32_t fmp4_fragment_ms {500};
+
+  std::string dvr_dir;
+  uint32_t dvr_size_mb {512};
+
+  std::string record_dir;
+  uint32_t record_rollover_min {10};
+  uint32_t record_queue_blocks {64};
+
+  std::string vod_dir;
+  uint32_t vod_index_cache {1024};
+
+  uint16_t cluster_port {0};
+  std::string cluster_peers;
+  std::string cluster_advertise;
+  uint32_t cluster_warm_threshold {30};
+  uint32_t cluster_warm_ttl {60};
+
+  uint32_t workers_count {0};
+  uint16_t workers_port {0};
+  uint32_t workers_ring_mb {16};
+  int32_t workers_control_fd {-1};
+
+  std::string egress_backend {"epoll"};
+  uint32_t egress_uring_entries {4096};
+  uint32_t egress_loops {1};
+  std::string egress_cpus;
+
+  bool numa_enable {false};
+
+  uint16_t tls_port {0};
+  std::string tls_cert;
+  std::string tls_key;
+  uint32_t tls_max_handshakes {256};
+
+  config() {
+    opt_group{custom_options_, "publish"}
+      .add(port,          "port,p",     "set hdl server port")
+      .add(up_stream_url, "upstream,u", "define upstreams to pull streams from, comma separated")
+      .add(upstream_check_ms, "upstream-check", "interval of the upstream health checks (ms)")
+      .add(upstream_routing, "upstream-routing", "pick the upstream by \"latency\", or by \"hash\" of the stream path")
+      .add(upstream_load_bound, "upstream-load-bound", "with hash routing, most streams per upstream, in % of the average")
+      .add(publish_fanout, "fanout", "plain FLV viewers are written by their stream's publisher, with no broker of their own");
+    opt_group{custom_options_, "hls"}
+      .add(hls_segment_ms, "segment-duration", "target segment duration (ms)")
+      .add(hls_part_ms,    "part-duration",    "LL-HLS part duration (ms), 0 disables parts")
+      .add(hls_segments,   "segments",         "number of segments in the playlist");
+    opt_group{custom_options_, "fmp4"}
+      .add(fmp4_fragment_ms, "fragment-duration", "longest fmp4 fragment (ms), 0 cuts at keyframes only");
+    opt_group{custom_options_, "dvr"}
+      .add(dvr_dir,     "dir",  "directory of the per-stream DVR ring files, empty disables DVR")
+      .add(dvr_size_mb, "size", "size of each ring file (MB)");
+    opt_group{custom_options_, "record"}
+      .add(record_dir,          "dir",      "directory pushed streams are archived to, empty disables recording")
+      .add(record_rollover_min, "rollover", "start a new file every N minutes")
+      .add(record_queue_blocks, "queue",    "1MB blocks the writer thread may lag behind before dropping");
+    opt_group{custom_options_, "vod"}
+      .add(vod_dir, "dir", "directory of flv files served when no live stream matches")
+      .add(vod_index_cache, "index-cache", "keyframe indexes kept, least recently used files go first");
+    opt_group{custom_options_, "cluster"}
+      .add(cluster_port,      "port",      "port the stream directory is published on, 0 runs standalone")
+      .add(cluster_peers,     "peers",     "directory ports of other nodes, as host:port, comma separated")
+      .add(cluster_advertise, "advertise", "url other nodes pull our streams from (default http://<hostname>:<publish port>)")
+      .add(cluster_warm_threshold, "warm-threshold", "requests per minute that make a stream pushed here hot, 0 never warms peers")
+      .add(cluster_warm_ttl,       "warm-ttl",       "seconds peers keep pulling a hot stream nobody watches");
+    opt_group{custom_options_, "workers"}
+      .add(workers_count,      "count",      "worker processes serving pushed streams, 0 serves them from this one only")
+      .add(workers_port,       "port",       "port the workers share (SO_REUSEPORT)")
+      .add(workers_ring_mb,    "ring-size",  "shared memory ring per pushed stream (MB)")
+      .add(workers_control_fd, "control-fd", "set on the workers, never by hand");
+    opt_group{custom_options_, "egress"}
+      .add(egress_backend,       "backend",       "how subscribers are written to: \"epoll\" (the middleman) or \"uring\"")
+      .add(egress_uring_entries, "uring-entries", "submission ring size of the io_uring egress")
+      .add(egress_loops,         "loops",         "io_uring egress loops (threads), streams are spread over them")
+      .add(egress_cpus,          "cpus",          "cores the egress loops are pinned to, e.g. \"0-7\", in turn; empty leaves them to the kernel");
+    opt_group{custom_options_, "numa"}
+      .add(numa_enable, "enable", "place streams, their payloads, egress loops and workers on NUMA nodes");
+    opt_group{custom_options_, "tls"}
+      .add(tls_port, "port", "HTTPS port, 0 serves plain HTTP only")
+      .add(tls_cert, "cert", "certificate chain (PEM)")
+      .add(tls_key,  "key",  "private key (PEM)")
+      .add(tls_max_handshakes, "max-handshakes", "handshakes running at once, more connections are closed");
+  }
+};
+
+// The actor system keeps a reference to the config CAF_MAIN created,
+// which is always ours.
+inline const config& getConfig(actor_system& system) {
+  return static_cast<const config&>(system.config());
+}
@@ -0,0 +1,144 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "dvr.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace {
+
+// [size:32][type:8][key:8][reserved:16][dts:64], then the payload,
+// padded to a multiple of the header size
+const uint32_t WRAP_MARKER = 0xffffffff;
+
+size_t recordSize(size_t payload) {
+  size_t n = DvrRing::RECORD_HEADER_SIZE + payload;
+  return (n + DvrRing::RECORD_HEADER_SIZE - 1) &
+    ~(size_t)(DvrRing::RECORD_HEADER_SIZE - 1);
+}
+
+}
+
+DvrRing::~DvrRing() {
+  if (_base) {
+    munmap(_base, _capacity);
+  }
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+bool DvrRing::open(const std::string& file, size_t capacity) {
+  capacity &= ~(size_t)(RECORD_HEADER_SIZE - 1);
+  _fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (_fd < 0) {
+    return false;
+  }
+  // a previous run's records are not trusted, the index is gone anyway
+  if (ftruncate(_fd, 0) != 0 ||
+      posix_fallocate(_fd, 0, capacity) != 0) {
+    return false;
+  }
+  void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, _fd, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  madvise(p, capacity, MADV_SEQUENTIAL);
+  _base = static_cast<uint8_t*>(p);
+  _capacity = capacity;
+  return true;
+}
+
+void DvrRing::onPacket(const FlvPacket& pkt) {
+  if (!_base) {
+    return;
+  }
+  size_t size = pkt.payload->size();
+  size_t n = recordSize(size);
+  if (n > _capacity / 2) {
+    return;
+  }
+
+  // records never straddle the end of the file
+  size_t off = _head % _capacity;
+  if (off + n > _capacity) {
+    memcpy(_base + off, &WRAP_MARKER, sizeof(WRAP_MARKER));
+    _head += _capacity - off;
+    off = 0;
+  }
+
+  uint8_t* p = _base + off;
+  uint32_t size32 = size;
+  memcpy(p, &size32, sizeof(size32));
+  p[4] = pkt.type;
+  p[5] = pkt.key;
+  p[6] = p[7] = 0;
+  memcpy(p + 8, &pkt.dts, sizeof(pkt.dts));
+  memcpy(p + RECORD_HEADER_SIZE, pkt.payload->constBytes(), size);
+
+  // keyframes index the video, one entry a second the audio only ones
+  bool indexed = false;
+  if (pkt.type == VIDEO) {
+    _hasVideo = true;
+    indexed = pkt.key;
+  } else if (pkt.type == AUDIO && !_hasVideo) {
+    indexed = _keys.empty() || pkt.dts - _keys.back().dts >= 1000;
+  }
+  if (indexed) {
+    _keys.push_back(KeyFrame {pkt.dts, _head});
+  }
+  if (pkt.type == VIDEO || pkt.type == AUDIO) {
+    _lastDts = pkt.dts;
+  }
+
+  _head += n;
+  while (!_keys.empty() && _keys.front().pos < tail()) {
+    _keys.pop_front();
+  }
+}
+
+bool DvrRing::seek(int64_t dts, uint64_t& pos) const {
+  if (_keys.empty()) {
+    return false;
+  }
+  auto it = std::upper_bound(_keys.begin(), _keys.end(), dts,
+                             [](int64_t dts, const KeyFrame& k) {
+                               return dts < k.dts;
+                             });
+  if (it != _keys.begin()) {
+    --it;
+  }
+  pos = it->pos;
+  return true;
+}
+
+FlvPacketCache::ErrorCode DvrRing::read(uint64_t& pos,
+                                        FlvPacket& out) const {
+  if (pos < tail()) {
+    return FlvPacketCache::ERROR;
+  }
+  for (;;) {
+    if (pos >= _head) {
+      return FlvPacketCache::AGAIN;
+    }
+    const uint8_t* p = _base + pos % _capacity;
+    uint32_t size;
+    memcpy(&size, p, sizeof(size));
+    if (size != WRAP_MARKER) {
+      out.type = static_cast<packet_t>(p[4]);
+      out.key = p[5];
+      memcpy(&out.dts, p + 8, sizeof(out.dts));
+      out.payload = byte_t::create(const_cast<uint8_t*>(p) +
+                                     RECORD_HEADER_SIZE,
+                                   size);
+      pos += recordSize(size);
+      out.id = pos;
+      return FlvPacketCache::OK;
+    }
+    pos += _capacity - pos % _capacity;
+  }
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+
+// The disk tier of one stream: a preallocated, mmap'd ring file the
+// packets are appended to as fixed-header records, plus an in memory
+// index of its keyframes to seek by timestamp.
+//
+// Positions are logical, the total number of bytes written before the
+// record, so a reader can tell an overwritten position from a live one.
+class DvrRing : public FlvPacketSink {
+public:
+  enum : size_t { RECORD_HEADER_SIZE = 16 };
+
+  DvrRing() = default;
+  ~DvrRing();
+
+  DvrRing(const DvrRing&) = delete;
+  DvrRing& operator=(const DvrRing&) = delete;
+
+  // Creates (or reuses) `file` with `capacity` bytes and maps it.
+  bool open(const std::string& file, size_t capacity);
+
+  void onPacket(const FlvPacket& pkt) override;
+
+  // Position of the last keyframe at or before `dts`, the oldest one
+  // kept if `dts` is older still. False if there is none yet.
+  bool seek(int64_t dts, uint64_t& pos) const;
+
+  // Copies the record at `pos` out and moves `pos` past it. The packet
+  // id is the new position. AGAIN at the head, ERROR if `pos` has been
+  // overwritten meanwhile.
+  FlvPacketCache::ErrorCode read(uint64_t& pos, FlvPacket& out) const;
+
+  int64_t lastDts() const {
+    return _lastDts;
+  }
+
+private:
+  struct KeyFrame {
+    int64_t  dts;
+    uint64_t pos;
+  };
+
+  uint64_t tail() const {
+    return _head > _capacity ? _head - _capacity : 0;
+  }
+
+  int _fd {-1};
+  uint8_t* _base {nullptr};
+  size_t _capacity {0};
+  uint64_t _head {0};
+  int64_t _lastDts {0};
+  bool _hasVideo {false};
+  std::deque<KeyFrame> _keys;
+};
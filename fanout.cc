@@ -0,0 +1,200 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "fanout.hh"
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define SIZE_OF_TAG_HEADER 11
+
+// a viewer further behind than that is dropped
+static const size_t MAX_QUEUED = 8 << 20;
+
+constexpr char http_flv[] = "HTTP/1.1 200 OK\r\n"
+                            "Cache-Control: no-cache\r\n"
+                            "Pragma: no-cache\r\n"
+                            "Content-Type: video/x-flv\r\n"
+                            "\r\n";
+
+Fanout::~Fanout() {
+  for (auto& viewer : _viewers) {
+    close(viewer.fd);
+  }
+}
+
+size_t Fanout::add(int fd, const FlvPacketCache& cache) {
+  // the others first, the newcomer then starts right where they are
+  size_t dropped = tick(cache);
+  Viewer viewer;
+  viewer.fd = fd;
+  viewer.started = start(viewer, cache);
+  if (viewer.dead) {
+    close(fd);
+    return dropped + 1;
+  }
+  _viewers.push_back(std::move(viewer));
+  return dropped;
+}
+
+size_t Fanout::tick(const FlvPacketCache& cache) {
+  FlvPacketList pkts;
+  cache.getAll(_lastId, pkts);
+  if (!pkts.empty()) {
+    _lastId = pkts.back().id;
+  }
+
+  // made into tags once, for everyone already started
+  bool started = std::any_of(std::begin(_viewers), std::end(_viewers),
+                             [](const Viewer& viewer) {
+                               return viewer.started;
+                             });
+  auto chunk = std::make_shared<std::vector<uint8_t>>();
+  for (auto& pkt : pkts) {
+    if (started) {
+      encode(pkt, false, *chunk);
+    }
+    pkt.payload->release();
+  }
+
+  for (auto& viewer : _viewers) {
+    if (!viewer.started) {
+      viewer.started = start(viewer, cache);
+    } else if (!push(viewer, chunk)) {
+      viewer.dead = true;
+    }
+  }
+
+  size_t dropped = 0;
+  for (size_t i = 0; i < _viewers.size();) {
+    if (!_viewers[i].dead) {
+      i++;
+      continue;
+    }
+    close(_viewers[i].fd);
+    _viewers[i] = std::move(_viewers.back());
+    _viewers.pop_back();
+    dropped++;
+  }
+  return dropped;
+}
+
+bool Fanout::start(Viewer& viewer, const FlvPacketCache& cache) {
+  FlvPacketList configs(cache.getDCR());
+  bool decodable = std::any_of(std::begin(configs), std::end(configs),
+                               [](const FlvPacket& pkt) {
+                                 return pkt.type == VIDEO_DCR ||
+                                        pkt.type == AUDIO_DCR;
+                               });
+  FlvPacketList pkts;
+  if (decodable) {
+    cache.getAll(-1, pkts);
+  }
+
+  auto chunk = std::make_shared<std::vector<uint8_t>>(
+    http_flv, http_flv + strlen(http_flv));
+  const uint8_t header[] = {
+    0x46, 0x4c, 0x56, 0x01, 0x05,
+    0x00, 0x00, 0x00, 0x09, 0x00,
+    0x00, 0x00, 0x00
+  };
+  chunk->insert(std::end(*chunk), header, header + sizeof(header));
+  for (auto& pkt : configs) {
+    if (decodable) {
+      encode(pkt, true, *chunk);
+    }
+    pkt.payload->release();
+  }
+  for (auto& pkt : pkts) {
+    encode(pkt, false, *chunk);
+    pkt.payload->release();
+  }
+
+  if (!decodable) {
+    return false;
+  }
+  if (!push(viewer, chunk)) {
+    viewer.dead = true;
+  }
+  return true;
+}
+
+void Fanout::encode(const FlvPacket& pkt,
+                    bool config,
+                    std::vector<uint8_t>& out) {
+  uint8_t type;
+  if (pkt.type == VIDEO || pkt.type == VIDEO_DCR) {
+    type = FlvParser::TAG_VIDEO;
+  } else if (pkt.type == AUDIO || pkt.type == AUDIO_DCR) {
+    type = FlvParser::TAG_AUDIO;
+  } else if (pkt.type == SCRIPT || pkt.type == METADATA) {
+    type = FlvParser::TAG_SCRIPT;
+  } else {
+    return;
+  }
+
+  // the configs a viewer starts with keep their own timestamps, like
+  // for a subscriber
+  uint32_t dts = pkt.dts;
+  if (!config) {
+    if (_base < 0 &&
+        pkt.type != VIDEO_DCR &&
+        pkt.type != AUDIO_DCR &&
+        pkt.type != METADATA) {
+      _base = pkt.dts;
+    }
+    dts = std::max<int64_t>(pkt.dts - std::max<int64_t>(_base, 0), 0);
+  }
+
+  uint32_t size = pkt.payload->size();
+  uint8_t tag[SIZE_OF_TAG_HEADER] = {
+    type,
+    (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size,
+    (uint8_t)(dts >> 16), (uint8_t)(dts >> 8), (uint8_t)dts,
+    (uint8_t)(dts >> 24),
+    0, 0, 0
+  };
+  out.insert(std::end(out), tag, tag + sizeof(tag));
+  out.insert(std::end(out),
+             pkt.payload->constBytes(),
+             pkt.payload->constBytes() + size);
+  uint32_t prev = size + SIZE_OF_TAG_HEADER;
+  const uint8_t trailer[] = {
+    (uint8_t)(prev >> 24), (uint8_t)(prev >> 16),
+    (uint8_t)(prev >> 8), (uint8_t)prev
+  };
+  out.insert(std::end(out), trailer, trailer + sizeof(trailer));
+}
+
+bool Fanout::push(Viewer& viewer, const Chunk& chunk) {
+  if (!chunk->empty()) {
+    viewer.queue.push_back(chunk);
+    viewer.queued += chunk->size();
+    if (viewer.queued - viewer.offset > MAX_QUEUED) {
+      return false;
+    }
+  }
+  return flush(viewer);
+}
+
+bool Fanout::flush(Viewer& viewer) {
+  while (!viewer.queue.empty()) {
+    const auto& front = *viewer.queue.front();
+    ssize_t n = send(viewer.fd,
+                     front.data() + viewer.offset,
+                     front.size() - viewer.offset,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    viewer.offset += n;
+    if (viewer.offset < front.size()) {
+      return true;
+    }
+    viewer.queued -= front.size();
+    viewer.offset = 0;
+    viewer.queue.pop_front();
+  }
+  return true;
+}
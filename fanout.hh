@@ -0,0 +1,65 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include <deque>
+
+// Plain FLV viewers served by their stream's publisher itself
+// ([publish] fanout): no HttpSubscribe broker, mailbox, monitor or timer
+// each, just a socket and what it still has to take. Every tick the
+// packets the cache got since the last one are made into FLV tags once,
+// and that one buffer is written to all the sockets. To share it, all
+// viewers are on the stream's timeline: timestamps start where the
+// first viewer joined, not at zero for each.
+class Fanout {
+public:
+  Fanout() = default;
+  ~Fanout();
+
+  Fanout(const Fanout&) = delete;
+  Fanout& operator=(const Fanout&) = delete;
+
+  // A viewer on `fd`, which is owned from now on. Starts with the
+  // configs and the newest keyframe on, or as soon as the cache has
+  // them. Returns how many viewers were dropped, like tick().
+  size_t add(int fd, const FlvPacketCache& cache);
+
+  // Sends what `cache` got since the last tick. Returns how many
+  // viewers were dropped, gone or too far behind.
+  size_t tick(const FlvPacketCache& cache);
+
+  size_t size() const {
+    return _viewers.size();
+  }
+
+  // whether tick() is scheduled, by the publisher
+  bool ticking {false};
+
+private:
+  using Chunk = std::shared_ptr<const std::vector<uint8_t>>;
+
+  struct Viewer {
+    int fd;
+    // waiting for the cache to have something to start with
+    bool started {false};
+    bool dead {false};
+    std::deque<Chunk> queue;
+    size_t offset {0};
+    size_t queued {0};
+  };
+
+  bool start(Viewer& viewer, const FlvPacketCache& cache);
+  void encode(const FlvPacket& pkt, bool config, std::vector<uint8_t>& out);
+  // Queues `chunk` and writes as much as the socket takes, false if the
+  // viewer is to be dropped.
+  bool push(Viewer& viewer, const Chunk& chunk);
+  bool flush(Viewer& viewer);
+
+  std::vector<Viewer> _viewers;
+  int64_t _lastId {-1};
+  int64_t _base {-1};
+};
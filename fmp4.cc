@@ -0,0 +1,655 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "fmp4.hh"
+
+namespace {
+
+void put8(std::vector<uint8_t>& out, uint8_t v) {
+  out.push_back(v);
+}
+
+void put16(std::vector<uint8_t>& out, uint16_t v) {
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+void put32(std::vector<uint8_t>& out, uint32_t v) {
+  out.push_back(v >> 24);
+  out.push_back(v >> 16);
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+void put64(std::vector<uint8_t>& out, uint64_t v) {
+  put32(out, v >> 32);
+  put32(out, v);
+}
+
+void putBytes(std::vector<uint8_t>& out, const void* p, size_t n) {
+  auto b = static_cast<const uint8_t*>(p);
+  out.insert(out.end(), b, b + n);
+}
+
+void putZeros(std::vector<uint8_t>& out, size_t n) {
+  out.insert(out.end(), n, 0);
+}
+
+void patch32(std::vector<uint8_t>& out, size_t pos, uint32_t v) {
+  out[pos]     = v >> 24;
+  out[pos + 1] = v >> 16;
+  out[pos + 2] = v >> 8;
+  out[pos + 3] = v;
+}
+
+// Writes the box header now and its size when going out of scope.
+class Box {
+public:
+  Box(std::vector<uint8_t>& out, const char* type)
+    : _out(out)
+    , _pos(out.size()) {
+    put32(out, 0);
+    putBytes(out, type, 4);
+  }
+
+  Box(std::vector<uint8_t>& out, const char* type,
+      uint8_t version, uint32_t flags)
+    : Box(out, type) {
+    put32(out, (version << 24) | (flags & 0xffffff));
+  }
+
+  ~Box() {
+    patch32(_out, _pos, _out.size() - _pos);
+  }
+
+private:
+  std::vector<uint8_t>& _out;
+  size_t _pos;
+};
+
+void putMatrix(std::vector<uint8_t>& out) {
+  const uint32_t m[9] = {
+    0x00010000, 0, 0,
+    0, 0x00010000, 0,
+    0, 0, 0x40000000
+  };
+  for (auto v : m) {
+    put32(out, v);
+  }
+}
+
+// Exp-golomb reader for the SPS. Unlike Bitstream it reads zeros past
+// the end instead of asserting, SPS come straight from the publisher.
+class GolombReader {
+public:
+  GolombReader(const std::vector<uint8_t>& rbsp)
+    : _data(rbsp) {
+  }
+
+  uint32_t bits(int n) {
+    uint32_t v = 0;
+    while (n-- > 0) {
+      size_t byte = _pos >> 3;
+      int bit = byte < _data.size() ?
+        (_data[byte] >> (7 - (_pos & 7))) & 1 : 0;
+      v = (v << 1) | bit;
+      _pos++;
+    }
+    return v;
+  }
+
+  uint32_t ue() {
+    int zeros = 0;
+    while (bits(1) == 0) {
+      // no 32 bit value has more, and past the end only zeros come
+      if (++zeros > 31) {
+        _error = true;
+        return 0;
+      }
+    }
+    return ((1u << zeros) - 1) + bits(zeros);
+  }
+
+  int32_t se() {
+    uint32_t v = ue();
+    return (v & 1) ? (int32_t)((v + 1) / 2) : -(int32_t)(v / 2);
+  }
+
+  // false once a code did not fit or reading went past the end
+  bool ok() const {
+    return !_error && _pos <= _data.size() * 8;
+  }
+
+private:
+  const std::vector<uint8_t>& _data;
+  size_t _pos {0};
+  bool _error {false};
+};
+
+// H.264 SPS -> coded picture size after cropping.
+void parseAvcSize(const uint8_t* nal, size_t size,
+                  uint16_t& width, uint16_t& height) {
+  std::vector<uint8_t> rbsp;
+  for (size_t i = 1; i < size; ++i) {
+    // drop emulation prevention bytes
+    if (i >= 3 && nal[i] == 0x03 && nal[i - 1] == 0 && nal[i - 2] == 0) {
+      continue;
+    }
+    rbsp.push_back(nal[i]);
+  }
+
+  GolombReader r(rbsp);
+  uint32_t profile = r.bits(8);
+  r.bits(16);
+  r.ue();
+  uint32_t chroma = 1;
+  if (profile == 100 || profile == 110 || profile == 122 ||
+      profile == 244 || profile == 44  || profile == 83  ||
+      profile == 86  || profile == 118 || profile == 128 ||
+      profile == 138 || profile == 139 || profile == 134) {
+    chroma = r.ue();
+    if (chroma == 3) {
+      r.bits(1);
+    }
+    r.ue();
+    r.ue();
+    r.bits(1);
+    if (r.bits(1)) {
+      for (int i = 0; i < (chroma == 3 ? 12 : 8); ++i) {
+        if (!r.bits(1)) {
+          continue;
+        }
+        int last = 8, next = 8;
+        for (int j = 0; j < (i < 6 ? 16 : 64) && next != 0; ++j) {
+          next = (last + r.se() + 256) % 256;
+          last = next == 0 ? last : next;
+        }
+      }
+    }
+  }
+  r.ue();
+  uint32_t pocType = r.ue();
+  if (pocType == 0) {
+    r.ue();
+  } else if (pocType == 1) {
+    r.bits(1);
+    r.se();
+    r.se();
+    uint32_t n = r.ue();
+    for (uint32_t i = 0; i < n && i < 256; ++i) {
+      r.se();
+    }
+  }
+  r.ue();
+  r.bits(1);
+  uint32_t w = r.ue() + 1;
+  uint32_t h = r.ue() + 1;
+  uint32_t frameMbsOnly = r.bits(1);
+  if (!frameMbsOnly) {
+    r.bits(1);
+  }
+  r.bits(1);
+  uint32_t cl = 0, cr = 0, ct = 0, cb = 0;
+  if (r.bits(1)) {
+    cl = r.ue();
+    cr = r.ue();
+    ct = r.ue();
+    cb = r.ue();
+  }
+  if (!r.ok()) {
+    // truncated or corrupt, the size stays unknown (0x0)
+    return;
+  }
+  uint32_t cropX = chroma == 0 || chroma == 3 ? 1 : 2;
+  uint32_t cropY = (chroma == 1 ? 2 : 1) * (2 - frameMbsOnly);
+  width = w * 16 - (cl + cr) * cropX;
+  height = (2 - frameMbsOnly) * h * 16 - (ct + cb) * cropY;
+}
+
+}
+
+void Fmp4Muxer::setVideoConfig(const FlvPacket& dcr) {
+  const uint8_t* p = dcr.payload->constBytes();
+  size_t size = dcr.payload->size();
+  _videoConfig.clear();
+  _width = _height = 0;
+  if (size < 5) {
+    return;
+  }
+
+  uint8_t codec = FlvParser::videoCodec(p, size);
+  if (!codec) {
+    return;
+  }
+  _hevc = codec == FlvParser::CODECID_HEVC;
+  _videoConfig.assign(p + 5, p + size);
+
+  // first SPS of the avcC, HEVC keeps 0x0 and lets the decoder decide
+  const auto& rec = _videoConfig;
+  if (!_hevc && rec.size() > 8 && (rec[5] & 0x1f) > 0) {
+    size_t len = (rec[6] << 8) | rec[7];
+    if (8 + len <= rec.size()) {
+      parseAvcSize(&rec[8], len, _width, _height);
+    }
+  }
+}
+
+void Fmp4Muxer::setAudioConfig(const FlvPacket& pkt) {
+  const uint8_t* p = pkt.payload->constBytes();
+  size_t size = pkt.payload->size();
+  if (size < 1) {
+    return;
+  }
+
+  static const uint32_t aacRates[] = {
+    96000, 88200, 64000, 48000, 44100, 32000,
+    24000, 22050, 16000, 12000, 11025, 8000, 7350
+  };
+  static const uint32_t flvRates[] = {5512, 11025, 22050, 44100};
+
+  int format = p[0] >> 4;
+  if (format == 2) {
+    _audioObjectType = 0x6b;
+    _audioConfig.clear();
+    _sampleRate = flvRates[(p[0] >> 2) & 0x03];
+    _channels = (p[0] & 0x01) + 1;
+  } else if (format == 10 && pkt.type == AUDIO_DCR && size >= 4) {
+    _audioObjectType = 0x40;
+    _audioConfig.assign(p + 2, p + size);
+    Bitstream bs(p + 2, size - 2);
+                 bs.skip(5);
+    int index  = bs.read(4);
+    _channels  = bs.read(4);
+    _sampleRate = index < 13 ? aacRates[index] : 44100;
+  }
+}
+
+bool Fmp4Muxer::videoSample(const FlvPacket& pkt, Sample& out) const {
+  const uint8_t* p = pkt.payload->constBytes();
+  size_t size = pkt.payload->size();
+  size_t hdr;
+  int32_t cts;
+  if (!FlvParser::videoFrame(p, size, hdr, cts)) {
+    return false;
+  }
+
+  out.dts = pkt.dts;
+  out.cts = cts;
+  out.duration = 0;
+  out.key = pkt.key;
+  out.data = p + hdr;
+  out.size = size - hdr;
+  return true;
+}
+
+bool Fmp4Muxer::audioSample(const FlvPacket& pkt, Sample& out) const {
+  const uint8_t* p = pkt.payload->constBytes();
+  size_t size = pkt.payload->size();
+  size_t hdr = _audioObjectType == 0x40 ? 2 : 1;
+  // AACPacketType 1: raw frame
+  if (size <= hdr || (hdr == 2 && p[1] != 0x01)) {
+    return false;
+  }
+
+  out.dts = pkt.dts;
+  out.cts = 0;
+  out.duration = 0;
+  out.key = true;
+  out.data = p + hdr;
+  out.size = size - hdr;
+  return true;
+}
+
+std::vector<uint8_t> Fmp4Muxer::init() const {
+  std::vector<uint8_t> out;
+  {
+    Box ftyp(out, "ftyp");
+    putBytes(out, "iso5", 4);
+    put32(out, 512);
+    putBytes(out, "iso5iso6mp41", 12);
+  }
+
+  writeMoov(out);
+  return out;
+}
+
+void Fmp4Muxer::writeMoov(std::vector<uint8_t>& out) const {
+  Box moov(out, "moov");
+  {
+    Box mvhd(out, "mvhd", 0, 0);
+    put32(out, 0);
+    put32(out, 0);
+    put32(out, 1000);
+    put32(out, 0);
+    put32(out, 0x00010000);
+    put16(out, 0x0100);
+    putZeros(out, 10);
+    putMatrix(out);
+    putZeros(out, 24);
+    put32(out, TRACK_AUDIO + 1);
+  }
+
+  for (uint32_t track : {TRACK_VIDEO, TRACK_AUDIO}) {
+    bool video = track == TRACK_VIDEO;
+    if ((video && !hasVideo()) || (!video && !hasAudio())) {
+      continue;
+    }
+
+    Box trak(out, "trak");
+    {
+      Box tkhd(out, "tkhd", 0, 0x000003);
+      put32(out, 0);
+      put32(out, 0);
+      put32(out, track);
+      put32(out, 0);
+      put32(out, 0);
+      putZeros(out, 8);
+      put16(out, 0);
+      put16(out, 0);
+      put16(out, video ? 0 : 0x0100);
+      put16(out, 0);
+      putMatrix(out);
+      put32(out, video ? _width << 16 : 0);
+      put32(out, video ? _height << 16 : 0);
+    }
+
+    Box mdia(out, "mdia");
+    {
+      Box mdhd(out, "mdhd", 0, 0);
+      put32(out, 0);
+      put32(out, 0);
+      put32(out, 1000);
+      put32(out, 0);
+      put16(out, 0x55c4);
+      put16(out, 0);
+    }
+    {
+      Box hdlr(out, "hdlr", 0, 0);
+      put32(out, 0);
+      putBytes(out, video ? "vide" : "soun", 4);
+      putZeros(out, 12);
+      const char* name = video ? "VideoHandler" : "SoundHandler";
+      putBytes(out, name, strlen(name) + 1);
+    }
+
+    Box minf(out, "minf");
+    if (video) {
+      Box vmhd(out, "vmhd", 0, 1);
+      putZeros(out, 8);
+    } else {
+      Box smhd(out, "smhd", 0, 0);
+      putZeros(out, 4);
+    }
+    {
+      Box dinf(out, "dinf");
+      Box dref(out, "dref", 0, 0);
+      put32(out, 1);
+      Box url(out, "url ", 0, 1);
+    }
+
+    Box stbl(out, "stbl");
+    {
+      Box stsd(out, "stsd", 0, 0);
+      put32(out, 1);
+      if (video) {
+        Box entry(out, _hevc ? "hvc1" : "avc1");
+        putZeros(out, 6);
+        put16(out, 1);
+        putZeros(out, 16);
+        put16(out, _width);
+        put16(out, _height);
+        put32(out, 0x00480000);
+        put32(out, 0x00480000);
+        put32(out, 0);
+        put16(out, 1);
+        putZeros(out, 32);
+        put16(out, 0x0018);
+        put16(out, 0xffff);
+        Box config(out, _hevc ? "hvcC" : "avcC");
+        putBytes(out, _videoConfig.data(), _videoConfig.size());
+      } else {
+        Box entry(out, "mp4a");
+        putZeros(out, 6);
+        put16(out, 1);
+        putZeros(out, 8);
+        put16(out, _channels);
+        put16(out, 16);
+        put16(out, 0);
+        put16(out, 0);
+        put32(out, _sampleRate << 16);
+
+        // ES_Descriptor > DecoderConfigDescriptor > DecoderSpecificInfo
+        size_t dsi = _audioConfig.empty() ? 0 : 2 + _audioConfig.size();
+        size_t dcd = 2 + 13 + dsi;
+        Box esds(out, "esds", 0, 0);
+        put8(out, 0x03);
+        put8(out, 3 + dcd + 3);
+        put16(out, track);
+        put8(out, 0);
+        put8(out, 0x04);
+        put8(out, 13 + dsi);
+        put8(out, _audioObjectType);
+        put8(out, 0x15);
+        putZeros(out, 3);
+        put32(out, 0);
+        put32(out, 0);
+        if (dsi) {
+          put8(out, 0x05);
+          put8(out, _audioConfig.size());
+          putBytes(out, _audioConfig.data(), _audioConfig.size());
+        }
+        put8(out, 0x06);
+        put8(out, 0x01);
+        put8(out, 0x02);
+      }
+    }
+    for (const char* type : {"stts", "stsc", "stco"}) {
+      Box empty(out, type, 0, 0);
+      put32(out, 0);
+    }
+    {
+      Box stsz(out, "stsz", 0, 0);
+      put32(out, 0);
+      put32(out, 0);
+    }
+  }
+
+  Box mvex(out, "mvex");
+  for (uint32_t track : {TRACK_VIDEO, TRACK_AUDIO}) {
+    if ((track == TRACK_VIDEO && !hasVideo()) ||
+        (track == TRACK_AUDIO && !hasAudio())) {
+      continue;
+    }
+    Box trex(out, "trex", 0, 0);
+    put32(out, track);
+    put32(out, 1);
+    put32(out, 0);
+    put32(out, 0);
+    put32(out, 0);
+  }
+}
+
+std::vector<uint8_t> Fmp4Muxer::fragment(
+    uint32_t seq,
+    const std::vector<Sample>& video,
+    const std::vector<Sample>& audio) const {
+  std::vector<uint8_t> out;
+  std::vector<std::pair<size_t, const std::vector<Sample>*>> offsets;
+  {
+    Box moof(out, "moof");
+    {
+      Box mfhd(out, "mfhd", 0, 0);
+      put32(out, seq);
+    }
+
+    for (uint32_t track : {TRACK_VIDEO, TRACK_AUDIO}) {
+      const auto& samples = track == TRACK_VIDEO ? video : audio;
+      if (samples.empty()) {
+        continue;
+      }
+      bool isVideo = track == TRACK_VIDEO;
+
+      Box traf(out, "traf");
+      {
+        // default-base-is-moof
+        Box tfhd(out, "tfhd", 0, 0x020000);
+        put32(out, track);
+      }
+      {
+        Box tfdt(out, "tfdt", 1, 0);
+        put64(out, samples.front().dts);
+      }
+
+      // data-offset, duration, size, and for video flags + cts
+      Box trun(out, "trun", 1, isVideo ? 0x000f01 : 0x000301);
+      put32(out, samples.size());
+      offsets.push_back(std::make_pair(out.size(), &samples));
+      put32(out, 0);
+      for (const auto& s : samples) {
+        put32(out, s.duration);
+        put32(out, s.size);
+        if (isVideo) {
+          put32(out, s.key ? 0x02000000 : 0x01010000);
+          put32(out, s.cts);
+        }
+      }
+    }
+  }
+
+  // data offsets are relative to the moof, which starts at 0
+  size_t mdat = out.size() + 8;
+  for (auto& off : offsets) {
+    patch32(out, off.first, mdat);
+    for (const auto& s : *off.second) {
+      mdat += s.size;
+    }
+  }
+
+  {
+    Box box(out, "mdat");
+    for (const auto* samples : {&video, &audio}) {
+      for (const auto& s : *samples) {
+        putBytes(out, s.data, s.size);
+      }
+    }
+  }
+  return out;
+}
+
+Fmp4Stream::~Fmp4Stream() {
+  for (auto payload : _held) {
+    payload->release();
+  }
+}
+
+void Fmp4Stream::onPacket(const FlvPacket& pkt) {
+  Fmp4Muxer::Sample sample;
+  bool video = pkt.type == VIDEO;
+  switch (pkt.type) {
+    case VIDEO_DCR:
+      _muxer.setVideoConfig(pkt);
+      _initDirty = true;
+      return;
+    case AUDIO_DCR:
+      _muxer.setAudioConfig(pkt);
+      _initDirty = true;
+      return;
+    case VIDEO:
+      if (!_muxer.hasVideo() || !_muxer.videoSample(pkt, sample)) {
+        return;
+      }
+      break;
+    case AUDIO:
+      if (!_muxer.hasAudio()) {
+        _muxer.setAudioConfig(pkt);
+        _initDirty = _muxer.hasAudio();
+      }
+      if (!_muxer.hasAudio() || !_muxer.audioSample(pkt, sample)) {
+        return;
+      }
+      break;
+    default:
+      return;
+  }
+
+  // the previous sample of the track lasts until this one
+  auto& samples = video ? _video : _audio;
+  if (!samples.empty()) {
+    samples.back().duration = pkt.dts - samples.back().dts;
+  }
+
+  // video streams cut at keyframes, and within a GOP every
+  // fragment-duration; audio only streams just by duration
+  bool key = video ? pkt.key : !_muxer.hasVideo();
+  if (!_started) {
+    if (!key) {
+      return;
+    }
+    _started = true;
+  }
+  int64_t every = _fragmentMs > 0 ? _fragmentMs :
+    (_muxer.hasVideo() ? 0 : 1000);
+  bool due = every > 0 && _start >= 0 && pkt.dts - _start >= every;
+  if (_muxer.hasVideo() ? video && (key || due) : due) {
+    flush();
+  }
+
+  if (_initDirty && _video.empty() && _audio.empty()) {
+    auto init = _muxer.init();
+    FlvPacket dcr;
+    dcr.type = VIDEO_DCR;
+    dcr.dts = pkt.dts;
+    dcr.payload = byte_t::create(init.data(), init.size());
+    _fragments.append(dcr);
+    _initAudio = _muxer.hasAudio();
+    _initDirty = false;
+  }
+
+  // a track the current init segment lacks would break the player
+  if (!video && !_initAudio) {
+    return;
+  }
+  if (_start < 0) {
+    _start = pkt.dts;
+  }
+  pkt.payload->acquire();
+  _held.push_back(pkt.payload);
+  samples.push_back(sample);
+}
+
+void Fmp4Stream::flush() {
+  if (_video.empty() && _audio.empty()) {
+    return;
+  }
+
+  // a track whose next sample is still unknown repeats the duration
+  // before it
+  for (auto samples : {&_video, &_audio}) {
+    if (samples->empty() || samples->back().duration > 0) {
+      continue;
+    }
+    if (samples->size() > 1) {
+      samples->back().duration = (*samples)[samples->size() - 2].duration;
+    } else {
+      samples->back().duration = samples == &_video ? 40 : 23;
+    }
+  }
+
+  auto frag = _muxer.fragment(++_seq, _video, _audio);
+  FlvPacket pkt;
+  pkt.type = VIDEO;
+  pkt.dts = _start;
+  pkt.key = !_video.empty() ? _video.front().key : 1;
+  pkt.payload = byte_t::create(frag.data(), frag.size());
+  _fragments.append(pkt);
+
+  for (auto payload : _held) {
+    payload->release();
+  }
+  _held.clear();
+  _video.clear();
+  _audio.clear();
+  _start = -1;
+}
@@ -0,0 +1,98 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+
+// ISO BMFF writer for fragmented mp4 (CMAF style: one init segment,
+// then moof/mdat pairs). Timescale is 1000 for every track, the same
+// milliseconds flv uses.
+class Fmp4Muxer {
+public:
+  enum : uint32_t {
+    TRACK_VIDEO = 1,
+    TRACK_AUDIO = 2
+  };
+
+  struct Sample {
+    int64_t  dts;
+    int32_t  cts;
+    uint32_t duration;
+    bool     key;
+    const uint8_t* data;
+    size_t   size;
+  };
+
+  void setVideoConfig(const FlvPacket& dcr);
+  void setAudioConfig(const FlvPacket& pkt);
+
+  bool hasVideo() const {
+    return !_videoConfig.empty();
+  }
+
+  bool hasAudio() const {
+    return _audioObjectType != 0;
+  }
+
+  // Points a sample at the coded frame inside an flv video/audio
+  // payload, false if the packet carries none.
+  bool videoSample(const FlvPacket& pkt, Sample& out) const;
+  bool audioSample(const FlvPacket& pkt, Sample& out) const;
+
+  std::vector<uint8_t> init() const;
+  std::vector<uint8_t> fragment(uint32_t seq,
+                                const std::vector<Sample>& video,
+                                const std::vector<Sample>& audio) const;
+
+private:
+  void writeMoov(std::vector<uint8_t>& out) const;
+
+  bool _hevc {false};
+  std::vector<uint8_t> _videoConfig;
+  uint16_t _width {0};
+  uint16_t _height {0};
+
+  uint8_t _audioObjectType {0};
+  std::vector<uint8_t> _audioConfig;
+  uint32_t _sampleRate {44100};
+  uint16_t _channels {2};
+};
+
+// Muxes one stream to fmp4 fragments, once, for all of its fmp4
+// subscribers. The fragments live in their own FlvPacketCache: the
+// init segment as its VIDEO_DCR and every fragment as a VIDEO packet
+// keyed when it starts with a keyframe, so the usual resync/read_some
+// path serves them.
+class Fmp4Stream : public FlvPacketSink {
+public:
+  Fmp4Stream(int64_t fragmentMs)
+    : _fragmentMs(fragmentMs) {
+  }
+
+  ~Fmp4Stream();
+
+  void onPacket(const FlvPacket& pkt) override;
+
+  FlvPacketCache& fragments() {
+    return _fragments;
+  }
+
+private:
+  void flush();
+
+  Fmp4Muxer _muxer;
+  FlvPacketCache _fragments {64};
+  const int64_t _fragmentMs;
+
+  std::vector<Fmp4Muxer::Sample> _video;
+  std::vector<Fmp4Muxer::Sample> _audio;
+  std::vector<byte_t*> _held;
+  int64_t _start {-1};
+  bool _started {false};
+  bool _initDirty {false};
+  bool _initAudio {false};
+  uint32_t _seq {0};
+};
@@ -0,0 +1,609 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "hls.hh"
+#include <cmath>
+#include <iomanip>
+
+namespace {
+
+// MPEG-2 crc32: poly 0x04c11db7, msb first, no final xor
+uint32_t crc32(const uint8_t* p, size_t size) {
+  static uint32_t table[256] = {0};
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t k = i << 24;
+      for (int j = 0; j < 8; ++j) {
+        k = (k & 0x80000000) ? (k << 1) ^ 0x04c11db7 : (k << 1);
+      }
+      table[i] = k;
+    }
+  }
+
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < size; ++i) {
+    crc = (crc << 8) ^ table[((crc >> 24) ^ p[i]) & 0xff];
+  }
+  return crc;
+}
+
+// [length:16][nalu] -> start code + nalu
+bool appendParamSet(const uint8_t* rec, size_t size, size_t& off,
+                    std::vector<uint8_t>& out) {
+  if (off + 2 > size) {
+    return false;
+  }
+  size_t len = (rec[off] << 8) | rec[off + 1];
+  off += 2;
+  if (off + len > size) {
+    return false;
+  }
+  static const uint8_t sc[] = {0x00, 0x00, 0x00, 0x01};
+  out.insert(out.end(), sc, sc + sizeof(sc));
+  out.insert(out.end(), rec + off, rec + off + len);
+  off += len;
+  return true;
+}
+
+void writeTimestamp(uint8_t* p, uint8_t prefix, int64_t ts) {
+  p[0] = (prefix << 4) | (((ts >> 30) & 0x07) << 1) | 0x01;
+  p[1] = (ts >> 22) & 0xff;
+  p[2] = (((ts >> 15) & 0x7f) << 1) | 0x01;
+  p[3] = (ts >> 7) & 0xff;
+  p[4] = ((ts & 0x7f) << 1) | 0x01;
+}
+
+}
+
+void TsMuxer::setVideoConfig(const FlvPacket& dcr) {
+  const uint8_t* p = dcr.payload->constBytes();
+  size_t size = dcr.payload->size();
+  _videoType = STREAM_NONE;
+  _paramSets.clear();
+  if (size < 5) {
+    return;
+  }
+
+  StreamType type = STREAM_NONE;
+  switch (FlvParser::videoCodec(p, size)) {
+    case FlvParser::CODECID_H264: type = STREAM_H264; break;
+    case FlvParser::CODECID_HEVC: type = STREAM_HEVC; break;
+    default: break;
+  }
+
+  const uint8_t* rec = p + 5;
+  size_t len = size - 5;
+  size_t off = 0;
+  if (type == STREAM_H264) {
+    if (len < 7) {
+      return;
+    }
+    _nalLengthSize = (rec[4] & 0x03) + 1;
+    int nsps = rec[5] & 0x1f;
+    off = 6;
+    for (int i = 0; i < nsps; ++i) {
+      if (!appendParamSet(rec, len, off, _paramSets)) {
+        return;
+      }
+    }
+    int npps = off < len ? rec[off++] : 0;
+    for (int i = 0; i < npps; ++i) {
+      if (!appendParamSet(rec, len, off, _paramSets)) {
+        return;
+      }
+    }
+  } else if (type == STREAM_HEVC) {
+    if (len < 23) {
+      return;
+    }
+    _nalLengthSize = (rec[21] & 0x03) + 1;
+    int narrays = rec[22];
+    off = 23;
+    for (int i = 0; i < narrays; ++i) {
+      if (off + 3 > len) {
+        return;
+      }
+      int nnalus = (rec[off + 1] << 8) | rec[off + 2];
+      off += 3;
+      for (int j = 0; j < nnalus; ++j) {
+        if (!appendParamSet(rec, len, off, _paramSets)) {
+          return;
+        }
+      }
+    }
+  } else {
+    // av1/vp9 and the old codecs have no TS mapping here
+    return;
+  }
+  _videoType = type;
+}
+
+void TsMuxer::setAudioConfig(const FlvPacket& pkt) {
+  const uint8_t* p = pkt.payload->constBytes();
+  size_t size = pkt.payload->size();
+  if (size < 1) {
+    return;
+  }
+
+  int format = p[0] >> 4;
+  if (format == 2) {
+    _audioType = STREAM_MP3;
+  } else if (format == 10 && pkt.type == AUDIO_DCR && size >= 4) {
+    // AudioSpecificConfig: [object type:5][frequency index:4][channels:4]
+    Bitstream bs(p + 2, size - 2);
+    _aacProfile   = bs.read(5);
+    _aacFreqIndex = bs.read(4);
+    _aacChannels  = bs.read(4);
+    _audioType = STREAM_AAC;
+  }
+}
+
+void TsMuxer::writeSection(std::vector<uint8_t>& out,
+                           uint16_t pid,
+                           const std::vector<uint8_t>& section) {
+  uint8_t pkt[TS_PACKET_SIZE];
+  memset(pkt, 0xff, sizeof(pkt));
+  pkt[0] = 0x47;
+  pkt[1] = 0x40 | ((pid >> 8) & 0x1f);
+  pkt[2] = pid & 0xff;
+  pkt[3] = 0x10 | (_cc[pid]++ & 0x0f);
+  pkt[4] = 0x00;
+  memcpy(pkt + 5, section.data(), section.size());
+  uint32_t crc = crc32(section.data(), section.size());
+  uint8_t* q = pkt + 5 + section.size();
+  q[0] = crc >> 24;
+  q[1] = crc >> 16;
+  q[2] = crc >> 8;
+  q[3] = crc;
+  out.insert(out.end(), pkt, pkt + sizeof(pkt));
+}
+
+void TsMuxer::writeTables(std::vector<uint8_t>& out) {
+  std::vector<uint8_t> pat = {
+    0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    0x00, 0x01, (uint8_t)(0xe0 | (PID_PMT >> 8)), (uint8_t)(PID_PMT & 0xff)
+  };
+  writeSection(out, PID_PAT, pat);
+
+  uint16_t pcr = hasVideo() ? PID_VIDEO : PID_AUDIO;
+  std::vector<uint8_t> pmt = {
+    0x02, 0xb0, 0x00, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    (uint8_t)(0xe0 | (pcr >> 8)), (uint8_t)(pcr & 0xff), 0xf0, 0x00
+  };
+  if (hasVideo()) {
+    pmt.insert(pmt.end(), {
+      _videoType, (uint8_t)(0xe0 | (PID_VIDEO >> 8)),
+      (uint8_t)(PID_VIDEO & 0xff), 0xf0, 0x00
+    });
+  }
+  if (hasAudio()) {
+    pmt.insert(pmt.end(), {
+      _audioType, (uint8_t)(0xe0 | (PID_AUDIO >> 8)),
+      (uint8_t)(PID_AUDIO & 0xff), 0xf0, 0x00
+    });
+  }
+  pmt[2] = pmt.size() - 3 + 4;
+  writeSection(out, PID_PMT, pmt);
+}
+
+void TsMuxer::appendNalus(const uint8_t* p, size_t size) {
+  static const uint8_t sc[] = {0x00, 0x00, 0x00, 0x01};
+  size_t off = 0;
+  while (off + _nalLengthSize <= size) {
+    size_t len = 0;
+    for (size_t i = 0; i < _nalLengthSize; ++i) {
+      len = (len << 8) | p[off + i];
+    }
+    off += _nalLengthSize;
+    if (len == 0 || off + len > size) {
+      break;
+    }
+
+    // we write our own access unit delimiters
+    bool aud = _videoType == STREAM_H264 ?
+      (p[off] & 0x1f) == 9 : ((p[off] >> 1) & 0x3f) == 35;
+    if (!aud) {
+      _es.insert(_es.end(), sc, sc + sizeof(sc));
+      _es.insert(_es.end(), p + off, p + off + len);
+    }
+    off += len;
+  }
+}
+
+void TsMuxer::writeVideo(std::vector<uint8_t>& out, const FlvPacket& pkt) {
+  const uint8_t* p = pkt.payload->constBytes();
+  size_t size = pkt.payload->size();
+  size_t hdr;
+  int32_t cts;
+  if (!hasVideo() || !FlvParser::videoFrame(p, size, hdr, cts)) {
+    return;
+  }
+
+  static const uint8_t avcAud[] = {0x00, 0x00, 0x00, 0x01, 0x09, 0xf0};
+  static const uint8_t hevcAud[] = {0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50};
+  _es.clear();
+  if (_videoType == STREAM_H264) {
+    _es.insert(_es.end(), avcAud, avcAud + sizeof(avcAud));
+  } else {
+    _es.insert(_es.end(), hevcAud, hevcAud + sizeof(hevcAud));
+  }
+  if (pkt.key) {
+    _es.insert(_es.end(), _paramSets.begin(), _paramSets.end());
+  }
+  appendNalus(p + hdr, size - hdr);
+
+  writePes(out, PID_VIDEO, 0xe0,
+           (pkt.dts + cts) * 90, pkt.dts * 90, pkt.key);
+}
+
+void TsMuxer::writeAudio(std::vector<uint8_t>& out, const FlvPacket& pkt) {
+  const uint8_t* p = pkt.payload->constBytes();
+  size_t size = pkt.payload->size();
+  _es.clear();
+  if (_audioType == STREAM_AAC) {
+    // AACPacketType 1: raw frame
+    if (size < 3 || p[1] != 0x01) {
+      return;
+    }
+    size_t len = size - 2 + 7;
+    uint8_t profile = _aacProfile > 0 ? _aacProfile - 1 : 1;
+    uint8_t adts[7] = {
+      0xff, 0xf1,
+      (uint8_t)((profile << 6) | (_aacFreqIndex << 2) | (_aacChannels >> 2)),
+      (uint8_t)(((_aacChannels & 0x03) << 6) | (len >> 11)),
+      (uint8_t)((len >> 3) & 0xff),
+      (uint8_t)(((len & 0x07) << 5) | 0x1f),
+      0xfc
+    };
+    _es.insert(_es.end(), adts, adts + sizeof(adts));
+    _es.insert(_es.end(), p + 2, p + size);
+  } else if (_audioType == STREAM_MP3) {
+    if (size < 2) {
+      return;
+    }
+    _es.insert(_es.end(), p + 1, p + size);
+  } else {
+    return;
+  }
+
+  writePes(out, PID_AUDIO, 0xc0,
+           pkt.dts * 90, pkt.dts * 90, !hasVideo());
+}
+
+void TsMuxer::writePes(std::vector<uint8_t>& out,
+                       uint16_t pid,
+                       uint8_t sid,
+                       int64_t pts,
+                       int64_t dts,
+                       bool key) {
+  const int64_t mask = 0x1ffffffffLL;
+  pts &= mask;
+  dts &= mask;
+
+  uint8_t hdr[19];
+  bool withDts = pts != dts;
+  size_t hlen = withDts ? 10 : 5;
+  size_t pesLen = 3 + hlen + _es.size();
+  if (sid == 0xe0 || pesLen > 0xffff) {
+    pesLen = 0;
+  }
+  hdr[0] = 0x00;
+  hdr[1] = 0x00;
+  hdr[2] = 0x01;
+  hdr[3] = sid;
+  hdr[4] = pesLen >> 8;
+  hdr[5] = pesLen & 0xff;
+  hdr[6] = 0x80;
+  hdr[7] = withDts ? 0xc0 : 0x80;
+  hdr[8] = hlen;
+  writeTimestamp(hdr + 9, withDts ? 0x03 : 0x02, pts);
+  if (withDts) {
+    writeTimestamp(hdr + 14, 0x01, dts);
+  }
+  _es.insert(_es.begin(), hdr, hdr + 9 + hlen);
+
+  bool pcr = pid == (hasVideo() ? PID_VIDEO : PID_AUDIO);
+  const uint8_t* data = _es.data();
+  size_t remain = _es.size();
+  bool first = true;
+  while (remain > 0) {
+    uint8_t pkt[TS_PACKET_SIZE];
+    uint8_t af[TS_PACKET_SIZE];
+    size_t afSize = 0;
+    bool hasAf = false;
+    if (first && (pcr || key)) {
+      af[0] = (key ? 0x40 : 0x00) | (pcr ? 0x10 : 0x00);
+      afSize = 1;
+      if (pcr) {
+        af[1] = dts >> 25;
+        af[2] = dts >> 17;
+        af[3] = dts >> 9;
+        af[4] = dts >> 1;
+        af[5] = ((dts & 0x01) << 7) | 0x7e;
+        af[6] = 0x00;
+        afSize += 6;
+      }
+      hasAf = true;
+    }
+
+    size_t head = 4 + (hasAf ? 1 + afSize : 0);
+    size_t n = std::min(remain, TS_PACKET_SIZE - head);
+    size_t stuff = TS_PACKET_SIZE - head - n;
+    if (stuff > 0) {
+      if (!hasAf) {
+        hasAf = true;
+        stuff -= 1;
+        if (stuff > 0) {
+          af[0] = 0x00;
+          afSize = 1;
+          stuff -= 1;
+        }
+      }
+      memset(af + afSize, 0xff, stuff);
+      afSize += stuff;
+    }
+
+    uint8_t* q = pkt;
+    *q++ = 0x47;
+    *q++ = (first ? 0x40 : 0x00) | ((pid >> 8) & 0x1f);
+    *q++ = pid & 0xff;
+    *q++ = (hasAf ? 0x30 : 0x10) | (_cc[pid]++ & 0x0f);
+    if (hasAf) {
+      *q++ = afSize;
+      memcpy(q, af, afSize);
+      q += afSize;
+    }
+    memcpy(q, data, n);
+    out.insert(out.end(), pkt, pkt + TS_PACKET_SIZE);
+
+    data += n;
+    remain -= n;
+    first = false;
+  }
+}
+
+HlsSegmenter::~HlsSegmenter() {
+  for (auto& seg : _segments) {
+    for (auto& part : seg.parts) {
+      part.data->release();
+    }
+  }
+}
+
+void HlsSegmenter::onPacket(const FlvPacket& pkt) {
+  bool open = !_segments.empty() && !_segments.back().complete;
+  bool key = false;
+  switch (pkt.type) {
+    case VIDEO_DCR:
+      _muxer.setVideoConfig(pkt);
+      return;
+    case AUDIO_DCR:
+      _muxer.setAudioConfig(pkt);
+      return;
+    case VIDEO:
+      if (!_muxer.hasVideo()) {
+        return;
+      }
+      key = pkt.key;
+      break;
+    case AUDIO:
+      if (!_muxer.hasAudio()) {
+        _muxer.setAudioConfig(pkt);
+        if (!_muxer.hasAudio()) {
+          return;
+        }
+      }
+      // audio only streams may cut anywhere
+      key = !_muxer.hasVideo();
+      if (!key && !open) {
+        return;
+      }
+      break;
+    default:
+      return;
+  }
+
+  if (key && (!open || pkt.dts - _segments.back().start >= _segmentMs)) {
+    if (open) {
+      closeSegment(pkt.dts);
+    }
+    openSegment(pkt.dts);
+  } else if (!open) {
+    return;
+  } else if (_partMs > 0 && pkt.dts - _partStart >= _partMs) {
+    closePart(pkt.dts);
+    _partIndependent = key;
+    if (key) {
+      _muxer.writeTables(_buf);
+    }
+  }
+
+  if (pkt.type == VIDEO) {
+    _muxer.writeVideo(_buf, pkt);
+  } else {
+    _muxer.writeAudio(_buf, pkt);
+  }
+}
+
+void HlsSegmenter::openSegment(int64_t dts) {
+  HlsSegment seg;
+  seg.seq = _nextSeq++;
+  seg.start = dts;
+  _segments.push_back(seg);
+
+  _partStart = dts;
+  _partIndependent = true;
+  _buf.clear();
+  _muxer.writeTables(_buf);
+
+  // keep segments around for a while after they leave the playlist
+  while (_segments.size() > 2 * _window + 1) {
+    for (auto& part : _segments.front().parts) {
+      part.data->release();
+    }
+    _segments.pop_front();
+  }
+}
+
+void HlsSegmenter::closePart(int64_t dts) {
+  if (_buf.empty()) {
+    return;
+  }
+  HlsPart part;
+  part.data = byte_t::create(_buf.data(), _buf.size());
+  part.duration = dts - _partStart;
+  part.independent = _partIndependent;
+  _segments.back().parts.push_back(part);
+  _maxPartDuration = std::max(_maxPartDuration, part.duration);
+
+  _buf.clear();
+  _partStart = dts;
+  _version++;
+}
+
+void HlsSegmenter::closeSegment(int64_t dts) {
+  closePart(dts);
+  auto& seg = _segments.back();
+  seg.duration = dts - seg.start;
+  seg.complete = true;
+  _maxDuration = std::max(_maxDuration, seg.duration);
+  _version++;
+}
+
+const HlsSegment* HlsSegmenter::find(int64_t seq) const {
+  if (_segments.empty() ||
+      seq < _segments.front().seq ||
+      seq > _segments.back().seq) {
+    return nullptr;
+  }
+  return &_segments[seq - _segments.front().seq];
+}
+
+bool HlsSegmenter::ready(int64_t msn, int64_t part) const {
+  if (msn < 0 || msn < _nextSeq - (int64_t)_segments.size()) {
+    return true;
+  }
+  auto seg = find(msn);
+  if (!seg) {
+    return false;
+  }
+  return seg->complete || (part >= 0 && part < (int64_t)seg->parts.size());
+}
+
+bool HlsSegmenter::valid(int64_t msn, int64_t part) const {
+  if (msn < 0) {
+    return part < 0;
+  }
+  return msn <= _nextSeq - 1 + 2;
+}
+
+FlvPacketCache::ErrorCode HlsSegmenter::get(const std::string& file,
+                                            FlvPacketList& out) const {
+  // "<seq>.ts" or "<seq>.<part>.ts"
+  const char* s = file.c_str();
+  char* end = nullptr;
+  int64_t seq = strtoll(s, &end, 10);
+  int64_t part = -1;
+  if (end == s) {
+    return FlvPacketCache::ERROR;
+  }
+  if (strcmp(end, ".ts") != 0) {
+    s = end + 1;
+    part = strtoll(s, &end, 10);
+    if (*(s - 1) != '.' || end == s || strcmp(end, ".ts") != 0) {
+      return FlvPacketCache::ERROR;
+    }
+  }
+
+  auto seg = find(seq);
+  if (!seg) {
+    return seq == _nextSeq && part <= 0 ?
+      FlvPacketCache::AGAIN : FlvPacketCache::ERROR;
+  }
+
+  auto add = [&](const HlsPart& p) {
+    FlvPacket pkt;
+    pkt.id = seq;
+    pkt.dts = p.duration;
+    pkt.key = p.independent;
+    pkt.payload = p.data;
+    pkt.payload->acquire();
+    out.push_back(pkt);
+  };
+
+  if (part < 0) {
+    if (!seg->complete) {
+      return FlvPacketCache::AGAIN;
+    }
+    for (auto& p : seg->parts) {
+      add(p);
+    }
+    return FlvPacketCache::OK;
+  } else if (part < (int64_t)seg->parts.size()) {
+    add(seg->parts[part]);
+    return FlvPacketCache::OK;
+  } else if (!seg->complete && part == (int64_t)seg->parts.size()) {
+    return FlvPacketCache::AGAIN;
+  }
+  return FlvPacketCache::ERROR;
+}
+
+std::string HlsSegmenter::playlist() const {
+  auto seconds = [](int64_t ms) {
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(3) << ms / 1000.0;
+    return os.str();
+  };
+
+  size_t complete = 0;
+  for (auto& seg : _segments) {
+    complete += seg.complete ? 1 : 0;
+  }
+  size_t first = complete > _window ? complete - _window : 0;
+  int64_t target = std::max((_segmentMs + 999) / 1000,
+                            (_maxDuration + 500) / 1000);
+  int64_t partTarget = std::max(_partMs, _maxPartDuration);
+
+  std::ostringstream os;
+  os << "#EXTM3U\n"
+     << "#EXT-X-VERSION:" << (_partMs > 0 ? 9 : 3) << "\n"
+     << "#EXT-X-TARGETDURATION:" << target << "\n"
+     << "#EXT-X-INDEPENDENT-SEGMENTS\n";
+  if (_partMs > 0) {
+    os << "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK="
+       << seconds(3 * partTarget) << "\n"
+       << "#EXT-X-PART-INF:PART-TARGET=" << seconds(partTarget) << "\n";
+  }
+  os << "#EXT-X-MEDIA-SEQUENCE:"
+     << (first < _segments.size() ? _segments[first].seq : _nextSeq) << "\n";
+
+  for (size_t i = first; i < _segments.size(); ++i) {
+    auto& seg = _segments[i];
+    // parts are only listed close to the live edge
+    if (_partMs > 0 && i + 3 >= _segments.size()) {
+      for (size_t j = 0; j < seg.parts.size(); ++j) {
+        os << "#EXT-X-PART:DURATION=" << seconds(seg.parts[j].duration)
+           << ",URI=\"" << seg.seq << "." << j << ".ts\""
+           << (seg.parts[j].independent ? ",INDEPENDENT=YES" : "") << "\n";
+      }
+    }
+    if (seg.complete) {
+      os << "#EXTINF:" << seconds(seg.duration) << ",\n"
+         << seg.seq << ".ts\n";
+    }
+  }
+
+  if (_partMs > 0) {
+    bool open = !_segments.empty() && !_segments.back().complete;
+    os << "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"";
+    if (open) {
+      os << _segments.back().seq << "." << _segments.back().parts.size();
+    } else {
+      os << _nextSeq << ".0";
+    }
+    os << ".ts\"\n";
+  }
+  return os.str();
+}
@@ -0,0 +1,154 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+
+// Turns flv packets into MPEG-TS. Only the bitstream conversion lives
+// here, cutting segments is up to the caller.
+class TsMuxer {
+public:
+  enum StreamType : uint8_t {
+    STREAM_NONE = 0x00,
+    STREAM_MP3  = 0x03,
+    STREAM_AAC  = 0x0f,
+    STREAM_H264 = 0x1b,
+    STREAM_HEVC = 0x24
+  };
+
+  enum : uint16_t {
+    PID_PAT   = 0x0000,
+    PID_PMT   = 0x1000,
+    PID_VIDEO = 0x0100,
+    PID_AUDIO = 0x0101
+  };
+
+  enum : size_t { TS_PACKET_SIZE = 188 };
+
+  void setVideoConfig(const FlvPacket& dcr);
+  void setAudioConfig(const FlvPacket& dcr);
+
+  bool hasVideo() const {
+    return _videoType != STREAM_NONE;
+  }
+
+  bool hasAudio() const {
+    return _audioType != STREAM_NONE;
+  }
+
+  void writeTables(std::vector<uint8_t>& out);
+  void writeVideo(std::vector<uint8_t>& out, const FlvPacket& pkt);
+  void writeAudio(std::vector<uint8_t>& out, const FlvPacket& pkt);
+
+private:
+  void writePes(std::vector<uint8_t>& out,
+                uint16_t pid,
+                uint8_t sid,
+                int64_t pts,
+                int64_t dts,
+                bool key);
+  void writeSection(std::vector<uint8_t>& out,
+                    uint16_t pid,
+                    const std::vector<uint8_t>& section);
+  void appendNalus(const uint8_t* p, size_t size);
+
+  StreamType _videoType {STREAM_NONE};
+  StreamType _audioType {STREAM_NONE};
+  size_t _nalLengthSize {4};
+  std::vector<uint8_t> _paramSets;
+  uint8_t _aacProfile {1};
+  uint8_t _aacFreqIndex {4};
+  uint8_t _aacChannels {2};
+  std::vector<uint8_t> _es;
+  std::unordered_map<uint16_t, uint8_t> _cc;
+};
+
+struct HlsPart {
+  byte_t*  data {nullptr};
+  int64_t  duration {0};
+  bool     independent {false};
+};
+
+struct HlsSegment {
+  int64_t seq {0};
+  int64_t start {0};
+  int64_t duration {0};
+  std::vector<HlsPart> parts;
+  bool complete {false};
+};
+
+// Cuts keyframe aligned TS segments, and LL-HLS parts of them, out of
+// the packets of one stream. Every segment is muxed once and then
+// handed out by reference to all viewers.
+class HlsSegmenter : public FlvPacketSink {
+public:
+  HlsSegmenter(int64_t segmentMs, int64_t partMs, size_t window)
+    : _segmentMs(segmentMs)
+    , _partMs(partMs)
+    , _window(window) {
+  }
+
+  ~HlsSegmenter();
+
+  void onPacket(const FlvPacket& pkt) override;
+
+  // Whether a playlist request blocking on (msn, part) can be answered.
+  // msn < 0 never blocks.
+  bool ready(int64_t msn, int64_t part) const;
+
+  // Whether (msn, part) is a blocking request at all: not a part without
+  // a msn, nor a msn more than two segments past the last one. Others
+  // are answered 400 at once.
+  bool valid(int64_t msn, int64_t part) const;
+
+  std::string playlist() const;
+
+  // Appends the chunks of "<seq>.ts" or "<seq>.<part>.ts" to out.
+  // AGAIN means the file is about to be produced (preload hint).
+  FlvPacketCache::ErrorCode get(const std::string& file,
+                                FlvPacketList& out) const;
+
+  // Bumped whenever a part or segment gets closed.
+  uint64_t version() const {
+    return _version;
+  }
+
+private:
+  void openSegment(int64_t dts);
+  void closeSegment(int64_t dts);
+  void closePart(int64_t dts);
+  const HlsSegment* find(int64_t seq) const;
+
+  TsMuxer _muxer;
+  const int64_t _segmentMs;
+  const int64_t _partMs;
+  const size_t _window;
+
+  std::deque<HlsSegment> _segments;
+  std::vector<uint8_t> _buf;
+  int64_t _partStart {-1};
+  bool _partIndependent {false};
+  int64_t _nextSeq {0};
+  int64_t _maxDuration {0};
+  int64_t _maxPartDuration {0};
+  uint64_t _version {0};
+};
+
+// A playlist or segment request waiting for the segmenter.
+struct HlsPending {
+  actor_addr requester;
+  std::string file;
+  int64_t msn;
+  int64_t part;
+  std::chrono::steady_clock::time_point deadline;
+};
+
+// What a publisher keeps to serve HLS, created on the first request.
+struct HlsContext {
+  std::unique_ptr<HlsSegmenter> segmenter;
+  std::list<HlsPending> pending;
+  uint64_t version {0};
+};
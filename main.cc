@@ -2,20 +2,44 @@
 #include <chrono>
 
 #include "HttpMaster.hh"
+#include "cluster.hh"
+#include "tls.hh"
+#include "uring.hh"
+#include "config.hh"
 
-class config : public actor_system_config {
-public:
-  uint16_t port {0};
-  std::string up_stream_url;
-
-  config() {
-    opt_group{custom_options_, "publish"}
-      .add(port,          "port,p",     "set hdl server port")
-      .add(up_stream_url, "upstream,u", "define an upstream to pull stream");
+// Subscribers fall back to the middleman when io_uring is missing.
+static void startEgress(actor_system& system, const config& cfg) {
+  if (cfg.egress_backend != "uring") {
+    return;
+  }
+  size_t loops = std::max<size_t>(cfg.egress_loops, 1);
+  if (!UringEgress::init(loops, cfg.egress_uring_entries)) {
+    cerr << "io_uring not available, egress stays on epoll" << endl;
+    return;
   }
-};
+  auto cpus = numa::parseList(cfg.egress_cpus);
+  for (size_t i = 0; i < UringEgress::count(); i++) {
+    int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+    system.spawn<detached>(UringLoop, i, cpu);
+  }
+}
 
 void caf_main(actor_system& system, const config& cfg) {
+  if (cfg.numa_enable && !numa::init()) {
+    cerr << "cannot read the NUMA topology, placement disabled" << endl;
+  }
+  startEgress(system, cfg);
+  if (cfg.workers_control_fd >= 0) {
+    int fd = listenReusePort(cfg.workers_port);
+    if (fd < 0) {
+      cerr << "cannot listen on " << cfg.workers_port << endl;
+      return;
+    }
+    auto master = system.middleman().spawn_broker(HttpWorker, fd);
+    system.spawn<detached>(WorkerControl, cfg.workers_control_fd, master);
+    return;
+  }
+
   auto server_actor =
     system.middleman().spawn_server(HttpMaster,
                                     cfg.port,
@@ -25,6 +49,29 @@ void caf_main(actor_system& system, const config& cfg) {
          << system.render(server_actor.error()) << endl;
     return;
   }
+  if (cfg.cluster_port != 0) {
+    system.spawn<detached>(ClusterDirectory, *server_actor);
+  }
+  if (cfg.tls_port != 0) {
+    auto server = std::make_shared<TlsServer>();
+    if (!server->init(cfg.tls_cert, cfg.tls_key)) {
+      cerr << "cannot set up tls" << endl;
+    } else {
+      system.spawn<detached>(TlsAcceptor, cfg.tls_port,
+                             (size_t)cfg.tls_max_handshakes, server,
+                             *server_actor);
+    }
+  }
+  if (cfg.workers_count > 0) {
+    if (cfg.workers_port == 0) {
+      cerr << "[workers] count needs a port" << endl;
+    } else if (!WorkerHub::instance().launch(cfg.workers_count)) {
+      cerr << "cannot start the workers" << endl;
+    }
+    if (WorkerHub::instance().active()) {
+      system.spawn<detached>(WorkerReaper);
+    }
+  }
 }
 
 CAF_MAIN(io::middleman)
@@ -0,0 +1,264 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "numa.hh"
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+namespace numa {
+
+namespace {
+
+// payloads from 256 bytes to 256 KB come in classes four to a power
+// of two (256, 320, 384, 448, 512, 640...), so that one wastes at most a
+// fifth of its size, carved out of 2 MB slabs placed on the node; they
+// are recycled, never returned to the system. Larger ones are mapped
+// on the node each and unmapped when released.
+const size_t MIN_CLASS_SHIFT = 8;
+const size_t CLASSES = 41;
+const size_t MAX_CLASS_SIZE = 256 << 10;
+const size_t SLAB_SIZE = 2 << 20;
+const int LARGE = CLASSES;
+// before a large payload, its mapping's length
+const size_t LARGE_HEADER_SIZE = 16;
+
+struct Arena {
+  std::mutex mutex;
+  std::vector<void*> free[CLASSES];
+  uint8_t* slab {nullptr};
+  size_t used {SLAB_SIZE};
+};
+
+size_t classSize(size_t cls) {
+  return (4 + cls % 4) << (MIN_CLASS_SHIFT - 2 + cls / 4);
+}
+
+// the smallest class `size` fits
+size_t classOf(size_t size) {
+  if (size <= ((size_t)1 << MIN_CLASS_SHIFT)) {
+    return 0;
+  }
+  // 2^shift < size <= 2^(shift + 1), in quarters of 2^shift
+  size_t shift = 63 - __builtin_clzll(size - 1);
+  size_t step = (size_t)1 << (shift - 2);
+  size_t quarters = (size - ((size_t)1 << shift) + step - 1) / step;
+  return (shift - MIN_CLASS_SHIFT) * 4 + quarters;
+}
+
+bool on = false;
+int homeNode = -1;
+std::vector<std::vector<int>> nodeCpus;
+std::vector<std::unique_ptr<Arena>> arenas;
+thread_local int currentNode = -1;
+
+std::string readLine(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+long setPolicy(int mode, int node) {
+  unsigned long mask = 1UL << node;
+  return syscall(SYS_set_mempolicy, mode, &mask, sizeof(mask) * 8 + 1);
+}
+
+uint8_t* mapOn(int node, size_t size) {
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  // preferred rather than bound: a full node spills over
+  unsigned long mask = 1UL << node;
+  if (syscall(SYS_mbind, p, size, MPOL_PREFERRED,
+              &mask, sizeof(mask) * 8 + 1, 0) != 0) {
+    perror("mbind");
+  }
+  return static_cast<uint8_t*>(p);
+}
+
+// What is left of a slab goes to the free lists of the classes it fits,
+// largest first, rather than being abandoned with it. Sizes are all
+// multiples of 64 bytes, less than the smallest class is lost.
+void carve(Arena& arena) {
+  size_t cls = CLASSES;
+  while (cls-- > 0) {
+    size_t n = classSize(cls);
+    while (SLAB_SIZE - arena.used >= n) {
+      arena.free[cls].push_back(arena.slab + arena.used);
+      arena.used += n;
+    }
+  }
+}
+
+}
+
+std::vector<int> parseList(const std::string& list) {
+  std::vector<int> items;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    int first, last;
+    int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (n == 1) {
+      last = first;
+    } else if (n != 2) {
+      continue;
+    }
+    for (int i = first; i <= last; i++) {
+      items.push_back(i);
+    }
+  }
+  return items;
+}
+
+bool init() {
+  auto online = parseList(readLine("/sys/devices/system/node/online"));
+  if (online.empty()) {
+    return false;
+  }
+  // node ids are dense on anything we run on, a hole gets no cpus
+  nodeCpus.assign(online.back() + 1, std::vector<int>());
+  for (int node : online) {
+    nodeCpus[node] = parseList(readLine("/sys/devices/system/node/node" +
+                                        std::to_string(node) +
+                                        "/cpulist"));
+  }
+  for (size_t node = 0; node < nodeCpus.size(); node++) {
+    arenas.emplace_back(new Arena);
+  }
+  // started bound to a single node, by bindThread() before the exec
+  int mode;
+  unsigned long mask = 0;
+  if (syscall(SYS_get_mempolicy, &mode, &mask, sizeof(mask) * 8 + 1,
+              nullptr, 0) == 0 &&
+      mode == MPOL_PREFERRED && mask && !(mask & (mask - 1))) {
+    homeNode = __builtin_ctzl(mask);
+  }
+  on = true;
+  return true;
+}
+
+int home() {
+  return homeNode;
+}
+
+bool enabled() {
+  return on;
+}
+
+size_t nodes() {
+  return nodeCpus.size();
+}
+
+const std::vector<int>& cpus(size_t node) {
+  return nodeCpus[node];
+}
+
+int streamNode(uint64_t key) {
+  if (!on) {
+    return -1;
+  }
+  return homeNode >= 0 ? homeNode : key % nodeCpus.size();
+}
+
+bool bindThread(int node) {
+  if (!on || node < 0 || nodeCpus[node].empty()) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : nodeCpus[node]) {
+    CPU_SET(cpu, &set);
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0 &&
+         setPolicy(MPOL_PREFERRED, node) == 0;
+}
+
+void* alloc(int node, size_t size, int& cls) {
+  cls = -1;
+  if (node < 0 || (size_t)node >= arenas.size()) {
+    return malloc(size);
+  }
+  if (size > MAX_CLASS_SIZE) {
+    size_t n = LARGE_HEADER_SIZE + size;
+    uint8_t* p = mapOn(node, n);
+    if (!p) {
+      return malloc(size);
+    }
+    memcpy(p, &n, sizeof(n));
+    cls = LARGE;
+    return p + LARGE_HEADER_SIZE;
+  }
+
+  size_t c = classOf(size);
+  size_t n = classSize(c);
+  Arena& arena = *arenas[node];
+  std::lock_guard<std::mutex> lock(arena.mutex);
+  auto& list = arena.free[c];
+  if (!list.empty()) {
+    cls = c;
+    void* p = list.back();
+    list.pop_back();
+    return p;
+  }
+  if (arena.used + n > SLAB_SIZE) {
+    uint8_t* slab = mapOn(node, SLAB_SIZE);
+    if (!slab) {
+      return malloc(size);
+    }
+    if (arena.slab) {
+      carve(arena);
+    }
+    arena.slab = slab;
+    arena.used = 0;
+  }
+  cls = c;
+  void* p = arena.slab + arena.used;
+  arena.used += n;
+  return p;
+}
+
+void release(void* p, int node, int cls) {
+  if (cls < 0) {
+    free(p);
+    return;
+  } else if (cls == LARGE) {
+    uint8_t* base = static_cast<uint8_t*>(p) - LARGE_HEADER_SIZE;
+    size_t n;
+    memcpy(&n, base, sizeof(n));
+    munmap(base, n);
+    return;
+  }
+  Arena& arena = *arenas[node];
+  std::lock_guard<std::mutex> lock(arena.mutex);
+  arena.free[cls].push_back(p);
+}
+
+int current() {
+  return currentNode;
+}
+
+NodeScope::NodeScope(int node)
+  : _prev(currentNode) {
+  currentNode = node;
+}
+
+NodeScope::~NodeScope() {
+  currentNode = _prev;
+}
+
+}
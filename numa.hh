@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// NUMA placement ([numa] enable). Each stream belongs to a node, by its
+// publisher's id: the payloads it parses are allocated from that node's
+// arena, and its subscribers are written from egress loops pinned to
+// that node, so a packet is read where it sits. Worker processes are
+// each bound to a node too. Off (or without sysfs) everything stays
+// where the kernel puts it.
+namespace numa {
+
+// "0-3,8" -> {0, 1, 2, 3, 8}
+std::vector<int> parseList(const std::string& list);
+
+// Reads the topology, false if it cannot.
+bool init();
+
+bool enabled();
+
+size_t nodes();
+
+const std::vector<int>& cpus(size_t node);
+
+// The node this whole process was bound to (a worker, see
+// WorkerHub::launch), -1 if none.
+int home();
+
+// The node of the stream named by `key`, -1 when disabled.
+int streamNode(uint64_t key);
+
+// Binds the calling thread (and what it allocates from then on) to
+// `node`. Inherited across fork and exec.
+bool bindThread(int node);
+
+// Memory for a payload of `size` bytes, from `node`'s arena when there
+// is one (`cls` >= 0): a class up to 256 KB, a mapping of its own on the
+// node past that. malloc'd otherwise.
+void* alloc(int node, size_t size, int& cls);
+void release(void* p, int node, int cls);
+
+// The node payloads created on this thread are allocated on, -1 for
+// none.
+int current();
+
+// Sets current() for as long as it lives.
+class NodeScope {
+public:
+  explicit NodeScope(int node);
+  ~NodeScope();
+
+  NodeScope(const NodeScope&) = delete;
+  NodeScope& operator=(const NodeScope&) = delete;
+
+private:
+  int _prev;
+};
+
+}
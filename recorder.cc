@@ -0,0 +1,305 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "recorder.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctime>
+
+#define SIZE_OF_TAG_HEADER 11
+
+RecordWriter& RecordWriter::instance(size_t blocks) {
+  static RecordWriter writer(blocks);
+  return writer;
+}
+
+RecordWriter::RecordWriter(size_t blocks)
+  : _capacity(blocks) {
+  _thread = std::thread([this] {
+    run();
+  });
+}
+
+RecordWriter::~RecordWriter() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cond.notify_one();
+  _thread.join();
+}
+
+bool RecordWriter::push(Job& job) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (job.data) {
+      if (_blocks >= _capacity) {
+        return false;
+      }
+      ++_blocks;
+    }
+    _jobs.push_back(job);
+  }
+  _cond.notify_one();
+  return true;
+}
+
+void RecordWriter::run() {
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cond.wait(lock, [this] {
+        return _stop || !_jobs.empty();
+      });
+      if (_jobs.empty()) {
+        return;
+      }
+      job = std::move(_jobs.front());
+      _jobs.pop_front();
+      if (job.data) {
+        --_blocks;
+      }
+    }
+    process(job);
+  }
+}
+
+void RecordWriter::process(Job& job) {
+  if (!job.open.empty()) {
+    File file;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    file.fd = ::open(job.open.c_str(), flags | O_DIRECT, 0644);
+    file.direct = file.fd >= 0;
+    if (file.fd < 0 && errno == EINVAL) {
+      file.fd = ::open(job.open.c_str(), flags, 0644);
+    }
+    if (file.fd < 0) {
+      cerr << "Cannot record to " << job.open << ": "
+           << strerror(errno) << endl;
+    }
+    _open[job.file] = file;
+  }
+
+  auto it = _open.find(job.file);
+  if (it == std::end(_open)) {
+    free(job.data);
+    return;
+  }
+  auto& file = it->second;
+
+  if (job.data && file.fd >= 0) {
+    // O_DIRECT wants whole blocks, the tail gets truncated on close;
+    // zeroed, so a file the truncate failed on ends in padding only
+    size_t size = job.size;
+    if (file.direct) {
+      size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+      memset(job.data + job.size, 0, size - job.size);
+    }
+    size_t off = 0;
+    bool failed = false;
+    while (off < size) {
+      ssize_t n = pwrite(file.fd, job.data + off, size - off,
+                         file.size + off);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        cerr << "Recording write failed: " << strerror(errno) << endl;
+        close(file.fd);
+        file.fd = -1;
+        failed = true;
+        break;
+      }
+      off += n;
+    }
+    if (!failed) {
+      file.size += job.size;
+    }
+  }
+  free(job.data);
+
+  if (job.close) {
+    if (file.fd >= 0) {
+      if (file.direct && ftruncate(file.fd, file.size) != 0) {
+        cerr << "Cannot truncate recording to " << file.size << " bytes: "
+             << strerror(errno) << endl;
+      }
+      close(file.fd);
+    }
+    _open.erase(it);
+  }
+}
+
+Recorder::~Recorder() {
+  if (_file) {
+    closeFile();
+  }
+  reportDropped();
+  free(_block);
+  for (auto pkt : {&_videoDCR, &_audioDCR, &_metaData}) {
+    if (pkt->payload) {
+      pkt->payload->release();
+    }
+  }
+}
+
+void Recorder::onPacket(const FlvPacket& pkt) {
+  switch (pkt.type) {
+    case VIDEO_DCR:
+    case AUDIO_DCR:
+    case METADATA: {
+      // kept to start the next file with
+      auto& keep = pkt.type == VIDEO_DCR ? _videoDCR :
+        pkt.type == AUDIO_DCR ? _audioDCR : _metaData;
+      if (keep.payload) {
+        keep.payload->release();
+      }
+      keep = pkt;
+      keep.payload->acquire();
+      if (_file) {
+        writeTag(pkt, std::max<int64_t>(pkt.dts - _fileStart, 0));
+      }
+      return;
+    }
+    case VIDEO:
+      _hasVideo = true;
+      break;
+    case AUDIO:
+    case SCRIPT:
+      break;
+    default:
+      return;
+  }
+
+  bool boundary = pkt.type == VIDEO ? pkt.key != 0 :
+    pkt.type == AUDIO && !_hasVideo;
+  if (_file && boundary && pkt.dts - _fileStart >= _rollover) {
+    closeFile();
+  }
+  if (!_file) {
+    if (!boundary) {
+      return;
+    }
+    openFile(pkt.dts);
+  }
+  writeTag(pkt, pkt.dts - _fileStart);
+}
+
+void Recorder::openFile(int64_t dts) {
+  char stamp[32];
+  time_t now = time(nullptr);
+  struct tm tm;
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+
+  RecordWriter::Job job;
+  job.file = _file = _writer.newFile();
+  // files cut within the same second get numbered
+  std::string name = _prefix + "-" + stamp;
+  if (name == _lastName) {
+    job.open = name + "-" + std::to_string(++_sameName) + ".flv";
+  } else {
+    job.open = name + ".flv";
+    _lastName = name;
+    _sameName = 0;
+  }
+  _writer.push(job);
+  _fileStart = dts;
+
+  uint8_t flags = (_audioDCR.payload ? 0x04 : 0) | (_hasVideo ? 0x01 : 0);
+  const uint8_t hdr[] = {
+    0x46, 0x4c, 0x56, 0x01, flags,
+    0x00, 0x00, 0x00, 0x09,
+    0x00, 0x00, 0x00, 0x00
+  };
+  put(hdr, sizeof(hdr));
+  for (auto pkt : {&_metaData, &_videoDCR, &_audioDCR}) {
+    if (pkt->payload) {
+      writeTag(*pkt, 0);
+    }
+  }
+}
+
+void Recorder::closeFile() {
+  submit(true);
+  _file = 0;
+  reportDropped();
+}
+
+void Recorder::reportDropped() {
+  if (_droppedBytes > _reportedBytes) {
+    cout << "Recording " << _prefix << " has dropped "
+         << _droppedBytes << " bytes in total" << endl;
+    _reportedBytes = _droppedBytes;
+  }
+}
+
+void Recorder::writeTag(const FlvPacket& pkt, int64_t dts) {
+  uint8_t type = pkt.type == VIDEO || pkt.type == VIDEO_DCR ?
+    FlvParser::TAG_VIDEO : pkt.type == AUDIO || pkt.type == AUDIO_DCR ?
+      FlvParser::TAG_AUDIO : FlvParser::TAG_SCRIPT;
+  uint32_t size = pkt.payload->size();
+  uint32_t ts = dts;
+  const uint8_t htag[SIZE_OF_TAG_HEADER] = {
+    type,
+    uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size),
+    uint8_t(ts >> 16), uint8_t(ts >> 8), uint8_t(ts), uint8_t(ts >> 24),
+    0x00, 0x00, 0x00
+  };
+  put(htag, sizeof(htag));
+  put(pkt.payload->constBytes(), size);
+  uint32_t prev = size + SIZE_OF_TAG_HEADER;
+  const uint8_t tail[] = {
+    uint8_t(prev >> 24), uint8_t(prev >> 16), uint8_t(prev >> 8), uint8_t(prev)
+  };
+  put(tail, sizeof(tail));
+}
+
+void Recorder::put(const uint8_t* p, size_t size) {
+  while (_file && size > 0) {
+    if (!_block &&
+        posix_memalign((void**)&_block,
+                       RecordWriter::ALIGNMENT,
+                       RecordWriter::BLOCK_SIZE) != 0) {
+      _block = nullptr;
+      return;
+    }
+    size_t n = std::min(size, RecordWriter::BLOCK_SIZE - _used);
+    memcpy(_block + _used, p, n);
+    _used += n;
+    p += n;
+    size -= n;
+    if (_used == RecordWriter::BLOCK_SIZE) {
+      submit(false);
+    }
+  }
+}
+
+bool Recorder::submit(bool close) {
+  RecordWriter::Job job;
+  job.file = _file;
+  job.data = _used > 0 ? _block : nullptr;
+  job.size = _used;
+  job.close = close;
+  if (_writer.push(job)) {
+    if (job.data) {
+      _block = nullptr;
+    }
+    _used = 0;
+    return true;
+  }
+
+  // the writer is behind: lose this block and end the file here, the
+  // next one starts at a keyframe again
+  cout << "Recording " << _prefix << " dropped "
+       << _used << " bytes, writer queue full" << endl;
+  _droppedBytes += _used;
+  _used = 0;
+  job.data = nullptr;
+  job.size = 0;
+  job.close = true;
+  _writer.push(job);
+  _file = 0;
+  return false;
+}
@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// The one thread all recordings are written from, so a slow disk only
+// ever stalls it. Data is written with O_DIRECT from block aligned
+// buffers where the filesystem allows it.
+class RecordWriter {
+public:
+  enum : size_t {
+    ALIGNMENT  = 4096,
+    BLOCK_SIZE = 1 << 20
+  };
+
+  struct Job {
+    uint64_t    file;
+    std::string open;              // start writing to this path first
+    uint8_t*    data {nullptr};    // BLOCK_SIZE aligned buffer, or none
+    size_t      size {0};
+    bool        close {false};     // truncate to the bytes written
+  };
+
+  // Created on first use with room for `blocks` queued data blocks.
+  static RecordWriter& instance(size_t blocks);
+
+  ~RecordWriter();
+
+  // Queues `job`, false (and `job` untouched) if it carries data and
+  // the queue is full. Opening and closing files is never refused.
+  bool push(Job& job);
+
+  uint64_t newFile() {
+    return ++_files;
+  }
+
+private:
+  struct File {
+    int      fd {-1};
+    uint64_t size {0};
+    bool     direct {false};
+  };
+
+  explicit RecordWriter(size_t blocks);
+  void run();
+  void process(Job& job);
+
+  const size_t _capacity;
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::deque<Job> _jobs;
+  size_t _blocks {0};
+  bool _stop {false};
+  std::atomic<uint64_t> _files {0};
+  std::unordered_map<uint64_t, File> _open;
+  std::thread _thread;
+};
+
+// Archives one stream as a series of flv files, cut at the first
+// keyframe after every `rollover` ms of stream time. Tags are packed
+// into blocks here and handed to the RecordWriter whole; a block the
+// writer has no room for is dropped and ends the file, the next one
+// starts at the following keyframe.
+class Recorder : public FlvPacketSink {
+public:
+  Recorder(const std::string& prefix, int64_t rollover, size_t blocks)
+    : _writer(RecordWriter::instance(blocks))
+    , _prefix(prefix)
+    , _rollover(rollover) {
+  }
+
+  ~Recorder();
+
+  void onPacket(const FlvPacket& pkt) override;
+
+  // bytes lost to a full writer queue, logged on rollover
+  uint64_t droppedBytes() const {
+    return _droppedBytes;
+  }
+
+private:
+  void openFile(int64_t dts);
+  void closeFile();
+  // Logs the bytes dropped so far, if any since the last time: on
+  // every rollover and when the stream ends.
+  void reportDropped();
+  void writeTag(const FlvPacket& pkt, int64_t dts);
+  void put(const uint8_t* p, size_t size);
+  // Hands the current block to the writer, ending the file if asked
+  // to or if the block had to be dropped.
+  bool submit(bool close);
+
+  RecordWriter& _writer;
+  const std::string _prefix;
+  const int64_t _rollover;
+
+  FlvPacket _videoDCR;
+  FlvPacket _audioDCR;
+  FlvPacket _metaData;
+  bool _hasVideo {false};
+
+  uint64_t _file {0};
+  std::string _lastName;
+  int _sameName {0};
+  int64_t _fileStart {-1};
+  uint8_t* _block {nullptr};
+  size_t _used {0};
+  uint64_t _droppedBytes {0};
+  uint64_t _reportedBytes {0};
+};
@@ -0,0 +1,161 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "relay.hh"
+#include <sys/time.h>
+
+namespace relay {
+
+static int64_t wallClockMs() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void put(std::vector<uint8_t>& out, uint64_t v, int bytes) {
+  for (int i = bytes - 1; i >= 0; --i) {
+    out.push_back(v >> (8 * i));
+  }
+}
+
+static uint64_t get(const uint8_t*& p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; ++i) {
+    v = (v << 8) | *p++;
+  }
+  return v;
+}
+
+void encode(const FlvPacketList& pkts, std::vector<uint8_t>& out) {
+  if (pkts.empty()) {
+    return;
+  }
+  size_t start = out.size();
+  put(out, 0, 4);
+  put(out, pkts.size(), 4);
+  put(out, wallClockMs(), 8);
+  for (auto& pkt : pkts) {
+    put(out, pkt.type, 1);
+    put(out, pkt.key, 1);
+    put(out, pkt.id, 8);
+    put(out, pkt.dts, 8);
+    put(out, pkt.payload->size(), 4);
+    out.insert(std::end(out),
+               pkt.payload->constBytes(),
+               pkt.payload->constBytes() + pkt.payload->size());
+  }
+  uint32_t length = out.size() - start - 4;
+  for (int i = 0; i < 4; ++i) {
+    out[start + i] = length >> (8 * (3 - i));
+  }
+}
+
+int Reader::parse(const char* data, size_t size) {
+  _buf.insert(std::end(_buf), data, data + size);
+  size_t pos = 0;
+  while (_buf.size() - pos >= 4) {
+    const uint8_t* p = _buf.data() + pos;
+    uint32_t length = get(p, 4);
+    if (length < BATCH_HEADER_SIZE - 4 || length > MAX_BATCH_SIZE) {
+      return -1;
+    }
+    if (_buf.size() - pos - 4 < length) {
+      break;
+    }
+    if (parseBatch(p, length) < 0) {
+      return -1;
+    }
+    pos += 4 + length;
+  }
+  _buf.erase(_buf.begin(), _buf.begin() + pos);
+  return 0;
+}
+
+int Reader::parseBatch(const uint8_t* p, size_t size) {
+  const uint8_t* end = p + size;
+  uint32_t count = get(p, 4);
+  p += 8;
+
+  // the first media after a reconnect to the same origin: if its ids
+  // went backwards, the stream was published anew there and everything
+  // starts over
+  if (_reconnected) {
+    int64_t maxId = -1;
+    const uint8_t* q = p;
+    for (uint32_t i = 0;
+         i < count && (size_t)(end - q) >= RECORD_HEADER_SIZE;
+         ++i) {
+      packet_t type = (packet_t)get(q, 1);
+      q += 1;
+      int64_t id = get(q, 8);
+      q += 8;
+      uint32_t len = get(q, 4);
+      if ((size_t)(end - q) < len) {
+        break;
+      }
+      q += len;
+      if (type != VIDEO_DCR && type != AUDIO_DCR && type != METADATA) {
+        maxId = std::max(maxId, id);
+      }
+    }
+    if (maxId >= 0) {
+      _reconnected = false;
+      if (_lastId >= 0 && maxId >= _lastId) {
+        _rebase = false;
+      } else {
+        _lastId = -1;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    if ((size_t)(end - p) < RECORD_HEADER_SIZE) {
+      return -1;
+    }
+    FlvPacket pkt;
+    pkt.type = (packet_t)get(p, 1);
+    pkt.key = get(p, 1);
+    int64_t id = get(p, 8);
+    int64_t dts = get(p, 8);
+    uint32_t len = get(p, 4);
+    if ((size_t)(end - p) < len || pkt.type == NONE || pkt.type > METADATA) {
+      return -1;
+    }
+    const uint8_t* payload = p;
+    p += len;
+
+    // a resync on the origin repeats its DCRs, and the media after
+    // them never goes backwards
+    bool media = pkt.type != VIDEO_DCR &&
+                 pkt.type != AUDIO_DCR &&
+                 pkt.type != METADATA;
+    if (media) {
+      if (id <= _lastId) {
+        continue;
+      }
+      _lastId = id;
+    }
+
+    // configs take effect where the stream is now, the dts the origin
+    // first saw them at may be long gone. The cache, not this reader,
+    // knows where the stream is: the previous connection may have
+    // been plain flv
+    int64_t last = _cache.lastDts();
+    if (!media) {
+      pkt.dts = std::max<int64_t>(last, 0);
+    } else {
+      if (_rebase) {
+        _tsOffset = last >= 0 ? last + 1 - dts : 0;
+        _rebase = false;
+      }
+      pkt.dts = dts + _tsOffset;
+    }
+    pkt.payload = byte_t::create(const_cast<uint8_t*>(payload), len);
+    _cache.append(pkt);
+  }
+  return p == end ? 0 : -1;
+}
+
+}
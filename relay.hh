@@ -0,0 +1,74 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+
+// The body an origin sends a pulling edge that asked for it with
+// "Accept: application/x-flv-relay": packets as they sit in the cache,
+// already classified, so the edge appends them without parsing FLV.
+//
+//   batch  := length:32 count:32 sent_ms:64 record*count
+//   record := type:8 key:8 id:64 dts:64 size:32 payload
+//
+// Big endian; length counts the bytes after itself, sent_ms is the
+// origin's wall clock when the batch left (for diagnosing relay lag,
+// ignored by the reader).
+namespace relay {
+
+constexpr char MIME[] = "application/x-flv-relay";
+
+enum : size_t {
+  BATCH_HEADER_SIZE  = 4 + 4 + 8,
+  RECORD_HEADER_SIZE = 1 + 1 + 8 + 8 + 4,
+  // a batch longer than this is taken for garbage
+  MAX_BATCH_SIZE     = 64 << 20
+};
+
+void encode(const FlvPacketList& pkts, std::vector<uint8_t>& out);
+
+// Feeds batches into a cache. Like FlvParser, reset() before reading a
+// new connection rebases its timestamps after the ones already cached,
+// unless it is to the same origin and that one's ids carry on: then
+// the GOP it replays is skipped, and its timeline kept.
+class Reader {
+public:
+  explicit Reader(FlvPacketCache& cache)
+    : _cache(cache) {
+  }
+
+  // <0 on a malformed stream.
+  int parse(const char* data, size_t size);
+
+  int parse(const std::vector<char>& buf) {
+    return parse(buf.data(), buf.size());
+  }
+
+  // `origin` is the one the new connection goes to.
+  void reset(const std::string& origin) {
+    _buf.clear();
+    if (origin != _origin) {
+      _lastId = -1;
+      _origin = origin;
+    }
+    _rebase = true;
+    _reconnected = true;
+  }
+
+private:
+  int parseBatch(const uint8_t* p, size_t size);
+
+  FlvPacketCache& _cache;
+  std::vector<uint8_t> _buf;
+  std::string _origin;
+  int64_t _lastId {-1};
+  int64_t _tsOffset {0};
+  bool _rebase {false};
+  // no media read yet since reset()
+  bool _reconnected {false};
+};
+
+}
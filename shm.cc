@@ -0,0 +1,246 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "shm.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+// [size:32][type:8][key:8][reserved:16][dts:64], then the payload,
+// padded to a multiple of the header size
+const uint32_t WRAP_MARKER = 0xffffffff;
+
+size_t recordSize(size_t payload) {
+  size_t n = ShmRing::RECORD_HEADER_SIZE + payload;
+  return (n + ShmRing::RECORD_HEADER_SIZE - 1) &
+    ~(size_t)(ShmRing::RECORD_HEADER_SIZE - 1);
+}
+
+ShmConfigSlot* slotAt(uint8_t* base, size_t slot) {
+  return reinterpret_cast<ShmConfigSlot*>(
+    base + ShmRing::HEADER_SIZE + slot * ShmRing::SLOT_SIZE);
+}
+
+const ShmConfigSlot* slotAt(const uint8_t* base, size_t slot) {
+  return reinterpret_cast<const ShmConfigSlot*>(
+    base + ShmRing::HEADER_SIZE + slot * ShmRing::SLOT_SIZE);
+}
+
+const size_t SLOT_DATA_SIZE =
+  ShmRing::SLOT_SIZE - offsetof(ShmConfigSlot, data);
+
+}
+
+ShmRing::~ShmRing() {
+  if (_header) {
+    _header->closed.store(1, std::memory_order_release);
+  }
+  if (_base) {
+    munmap(_base, _size);
+  }
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+bool ShmRing::create(const std::string& name, size_t capacity) {
+  capacity &= ~(size_t)(RECORD_HEADER_SIZE - 1);
+  _fd = memfd_create(name.c_str(), MFD_CLOEXEC);
+  if (_fd < 0) {
+    return false;
+  }
+  size_t size = HEADER_SIZE + CONFIG_SIZE + capacity;
+  if (ftruncate(_fd, size) != 0) {
+    return false;
+  }
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, _fd, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  _base = static_cast<uint8_t*>(p);
+  _size = size;
+  _capacity = capacity;
+
+  // a fresh memfd reads as zeros: empty slots, nothing written
+  _header = new (_base) ShmRingHeader;
+  _header->magic = ShmRingHeader::MAGIC;
+  _header->version = ShmRingHeader::VERSION;
+  _header->capacity = capacity;
+  _header->head.store(0, std::memory_order_relaxed);
+  _header->lastKey.store(ShmRingHeader::NO_KEY, std::memory_order_relaxed);
+  _header->closed.store(0, std::memory_order_release);
+  return true;
+}
+
+void ShmRing::onPacket(const FlvPacket& pkt) {
+  if (!_base) {
+    return;
+  }
+  size_t size = pkt.payload->size();
+
+  if (pkt.type == VIDEO_DCR ||
+      pkt.type == AUDIO_DCR ||
+      pkt.type == METADATA) {
+    auto slot = slotAt(_base, pkt.type == VIDEO_DCR ?
+                                SLOT_VIDEO_DCR : pkt.type == AUDIO_DCR ?
+                                  SLOT_AUDIO_DCR : SLOT_METADATA);
+    if (size <= SLOT_DATA_SIZE) {
+      uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+      slot->seq.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      slot->size = size;
+      memcpy(slot->data, pkt.payload->constBytes(), size);
+      slot->seq.store(seq + 2, std::memory_order_release);
+    }
+  }
+
+  // with the padding of a wrap, what is written past the published head
+  // then stays under half a ring, a reader within half a ring of the
+  // head never reads over it
+  size_t n = recordSize(size);
+  if (n > _capacity / 4) {
+    return;
+  }
+
+  // records never straddle the end of the ring
+  uint8_t* records = _base + HEADER_SIZE + CONFIG_SIZE;
+  size_t off = _head % _capacity;
+  if (off + n > _capacity) {
+    memcpy(records + off, &WRAP_MARKER, sizeof(WRAP_MARKER));
+    _head += _capacity - off;
+    off = 0;
+  }
+
+  uint8_t* p = records + off;
+  uint32_t size32 = size;
+  memcpy(p, &size32, sizeof(size32));
+  p[4] = pkt.type;
+  p[5] = pkt.key;
+  p[6] = p[7] = 0;
+  memcpy(p + 8, &pkt.dts, sizeof(pkt.dts));
+  memcpy(p + RECORD_HEADER_SIZE, pkt.payload->constBytes(), size);
+
+  uint64_t pos = _head;
+  _head += n;
+  _header->head.store(_head, std::memory_order_release);
+  if (pkt.type == VIDEO && pkt.key) {
+    _header->lastKey.store(pos, std::memory_order_release);
+  }
+}
+
+ShmReader::~ShmReader() {
+  if (_base) {
+    munmap(const_cast<uint8_t*>(_base), _size);
+  }
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+bool ShmReader::attach(int fd) {
+  _fd = fd;
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size <= ShmRing::HEADER_SIZE + ShmRing::CONFIG_SIZE) {
+    return false;
+  }
+  void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  _base = static_cast<const uint8_t*>(p);
+  _size = st.st_size;
+  _header = reinterpret_cast<const ShmRingHeader*>(_base);
+  _capacity = _header->capacity;
+  return _header->magic == ShmRingHeader::MAGIC &&
+         _header->version == ShmRingHeader::VERSION &&
+         _capacity == _size - ShmRing::HEADER_SIZE - ShmRing::CONFIG_SIZE;
+}
+
+bool ShmReader::config(ShmRing::Slot slot, FlvPacket& out) const {
+  auto s = slotAt(_base, slot);
+  std::vector<uint8_t> data;
+  for (;;) {
+    uint32_t seq = s->seq.load(std::memory_order_acquire);
+    if (seq == 0) {
+      return false;
+    } else if (seq & 1) {
+      continue;
+    }
+    uint32_t size = std::min<size_t>(s->size, SLOT_DATA_SIZE);
+    data.assign(s->data, s->data + size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s->seq.load(std::memory_order_relaxed) == seq) {
+      break;
+    }
+  }
+  out.type = slot == ShmRing::SLOT_VIDEO_DCR ?
+               VIDEO_DCR : slot == ShmRing::SLOT_AUDIO_DCR ?
+                 AUDIO_DCR : METADATA;
+  out.key = 0;
+  out.dts = 0;
+  out.payload = byte_t::create(data.data(), data.size());
+  return true;
+}
+
+uint64_t ShmReader::start() const {
+  uint64_t key = _header->lastKey.load(std::memory_order_acquire);
+  uint64_t head = _header->head.load(std::memory_order_acquire);
+  if (key == ShmRingHeader::NO_KEY || head - key > _capacity / 2) {
+    return head;
+  }
+  return key;
+}
+
+FlvPacketCache::ErrorCode ShmReader::read(uint64_t& pos,
+                                          FlvPacket& out) const {
+  const uint8_t* records =
+    _base + ShmRing::HEADER_SIZE + ShmRing::CONFIG_SIZE;
+  for (;;) {
+    uint64_t head = _header->head.load(std::memory_order_acquire);
+    if (pos >= head) {
+      return FlvPacketCache::AGAIN;
+    } else if (head - pos > _capacity / 2) {
+      return FlvPacketCache::ERROR;
+    }
+
+    size_t off = pos % _capacity;
+    uint32_t size;
+    memcpy(&size, records + off, sizeof(size));
+    if (size == WRAP_MARKER) {
+      pos += _capacity - off;
+      continue;
+    }
+    size_t n = recordSize(size);
+    if (n > _capacity / 4 || off + n > _capacity) {
+      return FlvPacketCache::ERROR;
+    }
+
+    const uint8_t* p = records + off;
+    FlvPacket pkt;
+    pkt.type = (packet_t)p[4];
+    pkt.key = p[5];
+    memcpy(&pkt.dts, p + 8, sizeof(pkt.dts));
+    pkt.payload = byte_t::create(const_cast<uint8_t*>(p) +
+                                   ShmRing::RECORD_HEADER_SIZE,
+                                 size);
+
+    // the writer only ever writes past the head, less than half a ring
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_header->head.load(std::memory_order_relaxed) - pos >
+          _capacity / 2) {
+      pkt.payload->release();
+      return FlvPacketCache::ERROR;
+    }
+    pkt.id = pos;
+    pos += n;
+    out = pkt;
+    return FlvPacketCache::OK;
+  }
+}
@@ -0,0 +1,116 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include <atomic>
+
+// One stream's packets in a memfd, written by the ingesting process and
+// read by the worker processes serving its subscribers. Everything in
+// the mapping is addressed by offset, it sits at a different address
+// in every process:
+//
+//   [header: 4096][configs: 3 x 64K][records: capacity]
+//
+// Records are laid out as in DvrRing, a quarter of the ring at most.
+// `head` is the logical end of the last complete record and is only
+// ever stored after the record, so a reader sees whole records; one
+// that falls more than half the ring behind may be reading over the
+// writer and starts again at `lastKey`.
+// The configs (video DCR, audio DCR, metadata) are kept apart from the
+// ring behind a sequence lock, a late reader always finds them.
+struct ShmRingHeader {
+  enum : uint32_t { MAGIC = 0x464c5652, VERSION = 1 };
+  enum : uint64_t { NO_KEY = ~0ULL };
+
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> lastKey;
+  std::atomic<uint32_t> closed;
+};
+
+struct ShmConfigSlot {
+  std::atomic<uint32_t> seq;   // odd while being written
+  uint32_t size;
+  uint8_t  data[1];
+};
+
+class ShmRing : public FlvPacketSink {
+public:
+  enum : size_t {
+    HEADER_SIZE        = 4096,
+    SLOT_SIZE          = 64 << 10,
+    SLOTS              = 3,
+    CONFIG_SIZE        = SLOT_SIZE * SLOTS,
+    RECORD_HEADER_SIZE = 16
+  };
+
+  enum Slot : size_t {
+    SLOT_VIDEO_DCR,
+    SLOT_AUDIO_DCR,
+    SLOT_METADATA
+  };
+
+  ShmRing() = default;
+  ~ShmRing();
+
+  ShmRing(const ShmRing&) = delete;
+  ShmRing& operator=(const ShmRing&) = delete;
+
+  bool create(const std::string& name, size_t capacity);
+
+  void onPacket(const FlvPacket& pkt) override;
+
+  // the memfd, for handing to the workers
+  int fd() const {
+    return _fd;
+  }
+
+private:
+  int _fd {-1};
+  uint8_t* _base {nullptr};
+  size_t _size {0};
+  ShmRingHeader* _header {nullptr};
+  size_t _capacity {0};
+  uint64_t _head {0};
+};
+
+// The reading end, in a worker. Packets come out as copies, the ring
+// moves on under them.
+class ShmReader {
+public:
+  ShmReader() = default;
+  ~ShmReader();
+
+  ShmReader(const ShmReader&) = delete;
+  ShmReader& operator=(const ShmReader&) = delete;
+
+  // Maps `fd`, which it then owns.
+  bool attach(int fd);
+
+  // The current video DCR, audio DCR or metadata, false if none.
+  bool config(ShmRing::Slot slot, FlvPacket& out) const;
+
+  // Copies the record at `pos` out and moves `pos` past it. AGAIN at
+  // the head, ERROR when the writer has lapped `pos`.
+  FlvPacketCache::ErrorCode read(uint64_t& pos, FlvPacket& out) const;
+
+  // Where a new reader starts: the newest keyframe, or the head.
+  uint64_t start() const;
+
+  bool closed() const {
+    return _header->closed.load(std::memory_order_acquire) != 0;
+  }
+
+private:
+  int _fd {-1};
+  const uint8_t* _base {nullptr};
+  size_t _size {0};
+  const ShmRingHeader* _header {nullptr};
+  size_t _capacity {0};
+};
@@ -0,0 +1,182 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+// The node arenas byte_t payloads come from (numa.cc): contents, where
+// the pages sit, recycling, release from another thread, what is left
+// of a slab, payloads past the classes, and the malloc fallbacks.
+
+#include "../utils.hh"
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                             \
+  do {                                                          \
+    if (!(cond)) {                                              \
+      printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+// a byte_t's own header comes with its payload
+const size_t HEADER = 16;
+const size_t MAX_CLASS_SIZE = 256 << 10;
+
+size_t sizeOf(size_t i) {
+  // from a byte to past the largest class (256 KB), the edges included
+  static const size_t edges[] = {1, 255, 256, 257, 320, 321, 4096, 65536,
+                                 MAX_CLASS_SIZE - HEADER,
+                                 MAX_CLASS_SIZE - HEADER + 1,
+                                 1 << 20, (1 << 20) + 1};
+  const size_t n = sizeof(edges) / sizeof(edges[0]);
+  return i < n ? edges[i] : 1 + (i * 7919) % (300 << 10);
+}
+
+// the node the page at `p` is on, -1 if it cannot tell
+int pageNode(const void* p) {
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, nullptr, 0, p,
+              MPOL_F_NODE | MPOL_F_ADDR) != 0) {
+    return -1;
+  }
+  return node;
+}
+
+std::vector<byte_t*> fill(size_t count) {
+  std::vector<byte_t*> bytes;
+  for (size_t i = 0; i < count; i++) {
+    std::vector<uint8_t> data(sizeOf(i), (uint8_t)i);
+    bytes.push_back(byte_t::create(data.data(), data.size()));
+  }
+  return bytes;
+}
+
+void verify(const std::vector<byte_t*>& bytes) {
+  for (size_t i = 0; i < bytes.size(); i++) {
+    size_t n = sizeOf(i);
+    CHECK(bytes[i]->size() == n);
+    const uint8_t* p = bytes[i]->constBytes();
+    CHECK(p[0] == (uint8_t)i && p[n / 2] == (uint8_t)i &&
+          p[n - 1] == (uint8_t)i);
+  }
+}
+
+// A slab too short for the next payload: its tail is handed out for
+// smaller ones. Run first, on an arena nothing came from yet.
+void testTail(int node) {
+  // 200 KB payloads take 224 KB each, 9 to a slab, 32 KB left
+  const size_t big = 224 << 10, tail = 32 << 10;
+  std::vector<void*> slab;
+  std::vector<int> classes;
+  for (int i = 0; i < 10; i++) {
+    int cls;
+    slab.push_back(numa::alloc(node, 200 << 10, cls));
+    classes.push_back(cls);
+    CHECK(cls >= 0);
+  }
+  int cls;
+  void* p = numa::alloc(node, tail, cls);
+  CHECK(cls >= 0);
+  CHECK(p == (uint8_t*)slab[0] + 9 * big);
+  numa::release(p, node, cls);
+  for (size_t i = 0; i < slab.size(); i++) {
+    numa::release(slab[i], node, classes[i]);
+  }
+}
+
+// Past the classes, on the node still, and given back when released.
+void testLarge(int node) {
+  int cls;
+  uint8_t* p = (uint8_t*)numa::alloc(node, 3 << 20, cls);
+  CHECK(p && cls >= 0);
+  memset(p, 1, 3 << 20);
+  CHECK(pageNode(p) == node && pageNode(p + (3 << 20) - 1) == node);
+  numa::release(p, node, cls);
+  unsigned char vec;
+  CHECK(mincore((void*)((uintptr_t)p & ~(uintptr_t)4095), 4096, &vec) != 0);
+}
+
+} // namespace
+
+int main() {
+  if (!numa::init()) {
+    printf("no NUMA topology in sysfs, skipped\n");
+    return 0;
+  }
+  const int node = numa::nodes() - 1;
+  const size_t count = 5000;
+  testTail(node);
+  testLarge(node);
+
+  // outside a NodeScope payloads are malloc'd
+  CHECK(numa::current() == -1);
+  {
+    byte_t* b = byte_t::create(100);
+    CHECK(b->size() == 100);
+    b->release();
+  }
+
+  std::vector<byte_t*> bytes;
+  {
+    numa::NodeScope scope(node);
+    CHECK(numa::current() == node);
+    bytes = fill(count);
+  }
+  CHECK(numa::current() == -1);
+  verify(bytes);
+  for (size_t i = 0; i < count; i++) {
+    CHECK(pageNode(bytes[i]->constBytes()) == node);
+  }
+
+  // what is released is handed out again, from another thread too
+  std::set<const uint8_t*> first;
+  for (auto b : bytes) {
+    first.insert(b->constBytes());
+  }
+  std::thread([&] {
+    for (auto b : bytes) {
+      b->release();
+    }
+  }).join();
+  {
+    numa::NodeScope scope(node);
+    bytes = fill(count);
+  }
+  verify(bytes);
+  size_t classed = 0, reused = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (sizeOf(i) + HEADER <= MAX_CLASS_SIZE) {
+      classed++;
+      reused += first.count(bytes[i]->constBytes());
+    }
+  }
+  CHECK(reused > classed * 9 / 10);
+
+  // a reference kept keeps the payload
+  bytes[0]->acquire();
+  bytes[0]->release();
+  verify(bytes);
+  for (auto b : bytes) {
+    b->release();
+  }
+
+  // a node past the arenas falls back to malloc
+  {
+    numa::NodeScope scope(numa::nodes());
+    byte_t* b = byte_t::create(1000);
+    CHECK(b->size() == 1000);
+    b->release();
+  }
+
+  printf("arena: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,261 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+// Fanout ([publish] fanout) against socket pairs standing in for the
+// viewers: when a viewer starts, the timeline they share, the 8 MB
+// drop, a full socket (EAGAIN), and viewers that leave.
+
+#include "../fanout.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                             \
+  do {                                                          \
+    if (!(cond)) {                                              \
+      printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+struct Tag {
+  uint8_t type;
+  uint32_t dts;
+  size_t size;
+};
+
+// What a viewer has been sent so far, as the player would see it.
+struct Peer {
+  int fd;
+  std::vector<uint8_t> bytes;
+
+  // false once the other side is closed
+  bool read() {
+    char buf[65536];
+    for (;;) {
+      ssize_t n = ::read(fd, buf, sizeof(buf));
+      if (n > 0) {
+        bytes.insert(std::end(bytes), buf, buf + n);
+      } else {
+        return n < 0;
+      }
+    }
+  }
+
+  std::string head() const {
+    std::string s(std::begin(bytes), std::end(bytes));
+    return s.substr(0, s.find("\r\n\r\n"));
+  }
+
+  std::vector<Tag> tags() const {
+    std::vector<Tag> tags;
+    std::string s(std::begin(bytes), std::end(bytes));
+    size_t p = s.find("\r\n\r\n");
+    if (p == std::string::npos) {
+      return tags;
+    }
+    // the FLV header and the first previous tag size
+    p += 4 + 13;
+    const uint8_t* b = bytes.data();
+    while (p + 11 <= bytes.size()) {
+      size_t size = b[p + 1] << 16 | b[p + 2] << 8 | b[p + 3];
+      uint32_t dts = b[p + 4] << 16 | b[p + 5] << 8 | b[p + 6] |
+                     b[p + 7] << 24;
+      if (p + 15 + size > bytes.size()) {
+        break;
+      }
+      const uint8_t* t = b + p + 11 + size;
+      uint32_t prev = t[0] << 24 | t[1] << 16 | t[2] << 8 | t[3];
+      CHECK(prev == size + 11);
+      tags.push_back({b[p], dts, size});
+      p += 15 + size;
+    }
+    return tags;
+  }
+};
+
+// A viewer: the fanout's end (owned by it once added) and the player's.
+int viewer(Peer& peer, int sndbuf = 0) {
+  int sv[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  fcntl(sv[1], F_SETFL, O_NONBLOCK);
+  if (sndbuf > 0) {
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  }
+  peer.fd = sv[1];
+  return sv[0];
+}
+
+class Stream {
+public:
+  Stream()
+    : cache(1024) {
+  }
+
+  void put(packet_t type, int key, size_t size, int64_t dts) {
+    FlvPacket pkt;
+    pkt.type = type;
+    pkt.key = key;
+    pkt.dts = dts;
+    std::vector<uint8_t> data(size, (uint8_t)type);
+    pkt.payload = byte_t::create(data.data(), data.size());
+    cache.append(pkt);
+  }
+
+  void configs() {
+    put(VIDEO_DCR, 0, 30, 0);
+    put(AUDIO_DCR, 0, 4, 0);
+  }
+
+  FlvPacketCache cache;
+};
+
+void testStart() {
+  Stream stream;
+  Fanout fanout;
+  Peer a, b;
+
+  // nothing to start with yet: no answer either
+  CHECK(fanout.add(viewer(a), stream.cache) == 0);
+  CHECK(fanout.size() == 1);
+  CHECK(a.read() && a.bytes.empty());
+
+  stream.configs();
+  stream.put(VIDEO, 1, 5000, 100000);
+  stream.put(AUDIO, 0, 200, 100040);
+  CHECK(fanout.tick(stream.cache) == 0);
+  a.read();
+  CHECK(a.head() == "HTTP/1.1 200 OK\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    "Pragma: no-cache\r\n"
+                    "Content-Type: video/x-flv");
+  auto tags = a.tags();
+  CHECK(tags.size() == 4);
+  if (tags.size() == 4) {
+    CHECK(tags[0].type == FlvParser::TAG_VIDEO && tags[0].size == 30);
+    CHECK(tags[1].type == FlvParser::TAG_AUDIO && tags[1].size == 4);
+    // the timeline starts at the first viewer's keyframe
+    CHECK(tags[2].dts == 0 && tags[2].size == 5000);
+    CHECK(tags[3].dts == 40);
+  }
+
+  // a later viewer is on the same timeline, not at zero of its own
+  stream.put(VIDEO, 1, 6000, 100080);
+  CHECK(fanout.add(viewer(b), stream.cache) == 0);
+  stream.put(VIDEO, 0, 900, 100120);
+  CHECK(fanout.tick(stream.cache) == 0);
+  a.read();
+  b.read();
+  auto at = a.tags();
+  auto bt = b.tags();
+  CHECK(at.size() == 6);
+  CHECK(bt.size() >= 4 && bt.size() <= at.size());
+  if (bt.size() >= 4 && bt.size() <= at.size()) {
+    CHECK(bt[0].size == 30 && bt[1].size == 4);
+    // the media b got is what a got last, timestamps included
+    size_t skip = at.size() - bt.size();
+    for (size_t i = 2; i < bt.size(); i++) {
+      CHECK(bt[i].dts == at[i + skip].dts);
+      CHECK(bt[i].size == at[i + skip].size);
+    }
+    CHECK(bt.back().dts == 120);
+  }
+
+  // a viewer that left is dropped on the next write, its fd closed
+  close(b.fd);
+  stream.put(AUDIO, 0, 200, 100160);
+  CHECK(fanout.tick(stream.cache) == 1);
+  CHECK(fanout.size() == 1);
+  close(a.fd);
+}
+
+void testFullSocket() {
+  Stream stream;
+  Fanout fanout;
+  Peer a;
+
+  stream.configs();
+  stream.put(VIDEO, 1, 1000, 0);
+  CHECK(fanout.add(viewer(a, 16 << 10), stream.cache) == 0);
+
+  // more than the socket takes, not read: EAGAIN, queued, kept
+  int64_t dts = 0;
+  size_t sent = 0;
+  for (int i = 0; i < 10; i++) {
+    dts += 40;
+    stream.put(VIDEO, 0, 100 << 10, dts);
+    sent += 100 << 10;
+    CHECK(fanout.tick(stream.cache) == 0);
+  }
+  CHECK(fanout.size() == 1);
+
+  // read as it goes out, it all arrives in order
+  for (int i = 0; i < 200; i++) {
+    a.read();
+    fanout.tick(stream.cache);
+  }
+  auto tags = a.tags();
+  CHECK(tags.size() == 13);
+  size_t got = 0;
+  for (size_t i = 3; i < tags.size(); i++) {
+    CHECK(tags[i].dts == 40 * (i - 2));
+    got += tags[i].size;
+  }
+  CHECK(got == sent);
+  close(a.fd);
+}
+
+void testDrop() {
+  Stream stream;
+  Fanout fanout;
+  Peer slow, fast;
+
+  stream.configs();
+  stream.put(VIDEO, 1, 1000, 0);
+  CHECK(fanout.add(viewer(slow, 16 << 10), stream.cache) == 0);
+  CHECK(fanout.add(viewer(fast), stream.cache) == 0);
+
+  // up to 8 MB behind is kept, past that dropped; the fast viewer
+  // takes everything in between, with ticks sending nothing new
+  int64_t dts = 0;
+  size_t dropped = 0;
+  int ticks = 0;
+  while (dropped == 0 && ticks < 20) {
+    dts += 40;
+    stream.put(VIDEO, 0, 1 << 20, dts);
+    dropped += fanout.tick(stream.cache);
+    ticks++;
+    size_t before;
+    do {
+      before = fast.bytes.size();
+      fast.read();
+      dropped += fanout.tick(stream.cache);
+    } while (fast.bytes.size() != before);
+  }
+  CHECK(dropped == 1);
+  CHECK(ticks >= 8 && ticks <= 9);
+  CHECK(fanout.size() == 1);
+  // the other one goes on
+  CHECK(fast.tags().size() == 3 + (size_t)ticks);
+  // and the slow one sees its connection closed
+  CHECK(!slow.read());
+  close(slow.fd);
+  close(fast.fd);
+}
+
+} // namespace
+
+int main() {
+  testStart();
+  testFullSocket();
+  testDrop();
+  printf("fanout: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
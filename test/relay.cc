@@ -0,0 +1,247 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+// The relay codec (relay.hh): batches through encode() and a Reader,
+// split anywhere, malformed ones, and what a Reader does across
+// reconnects, to the same origin or to a republished stream.
+
+#include "../relay.hh"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                             \
+  do {                                                          \
+    if (!(cond)) {                                              \
+      printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+struct Seen {
+  packet_t type;
+  int key;
+  int64_t dts;
+  std::vector<uint8_t> payload;
+};
+
+// Everything the reader appends, configs included.
+class Collector : public FlvPacketSink {
+public:
+  void onPacket(const FlvPacket& pkt) override {
+    const uint8_t* p = pkt.payload->constBytes();
+    seen.push_back({pkt.type, pkt.key, pkt.dts,
+                    std::vector<uint8_t>(p, p + pkt.payload->size())});
+  }
+
+  std::vector<Seen> seen;
+};
+
+FlvPacket packet(packet_t type, int64_t id, int64_t dts,
+                 size_t size, int key = 0) {
+  FlvPacket pkt;
+  pkt.type = type;
+  pkt.key = key;
+  pkt.id = id;
+  pkt.dts = dts;
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (uint8_t)(id * 31 + i);
+  }
+  pkt.payload = byte_t::create(data.data(), data.size());
+  return pkt;
+}
+
+// A GOP as an origin sends it: configs, then media ids `first`.. on,
+// 40 ms apart from `dts`.
+FlvPacketList gop(int64_t first, int count, int64_t dts) {
+  FlvPacketList pkts;
+  pkts.push_back(packet(VIDEO_DCR, first, dts, 30));
+  pkts.push_back(packet(AUDIO_DCR, first, dts, 4));
+  for (int i = 0; i < count; i++) {
+    pkts.push_back(packet(i % 2 ? AUDIO : VIDEO, first + i, dts + 40 * i,
+                          100 + i, i == 0));
+  }
+  return pkts;
+}
+
+std::vector<uint8_t> encode(FlvPacketList& pkts) {
+  std::vector<uint8_t> out;
+  relay::encode(pkts, out);
+  for (auto& pkt : pkts) {
+    pkt.payload->release();
+  }
+  return out;
+}
+
+void testRoundTrip() {
+  FlvPacketCache cache(1024);
+  Collector collector;
+  cache.addSink(&collector);
+  relay::Reader reader(cache);
+
+  FlvPacketList pkts;
+  pkts.push_back(packet(METADATA, 0, 0, 50));
+  pkts.push_back(packet(VIDEO_DCR, 0, 0, 30));
+  pkts.push_back(packet(VIDEO, 1, 1000, 5000, 1));
+  pkts.push_back(packet(AUDIO, 2, 1010, 200));
+  pkts.push_back(packet(SCRIPT, 3, 1020, 0));
+  FlvPacketList more;
+  more.push_back(packet(VIDEO, 4, 1040, 900));
+  std::vector<Seen> sent;
+  for (auto list : {&pkts, &more}) {
+    for (auto& pkt : *list) {
+      const uint8_t* p = pkt.payload->constBytes();
+      sent.push_back({pkt.type, pkt.key, pkt.dts,
+                      std::vector<uint8_t>(p, p + pkt.payload->size())});
+    }
+  }
+  auto bytes = encode(pkts);
+  auto second = encode(more);
+  bytes.insert(std::end(bytes), std::begin(second), std::end(second));
+
+  // a byte per read: every batch is cut everywhere once
+  for (auto b : bytes) {
+    CHECK(reader.parse((const char*)&b, 1) == 0);
+  }
+  CHECK(collector.seen.size() == sent.size());
+  for (size_t i = 0; i < sent.size() && i < collector.seen.size(); i++) {
+    const auto& got = collector.seen[i];
+    CHECK(got.type == sent[i].type);
+    CHECK(got.key == sent[i].key);
+    CHECK(got.payload == sent[i].payload);
+    // without a reset() the origin's timeline is kept
+    CHECK(got.dts == sent[i].dts);
+  }
+}
+
+void testGarbage() {
+  FlvPacketCache cache(1024);
+  {
+    relay::Reader reader(cache);
+    const char huge[] = {'\xff', '\xff', '\xff', '\xff'};
+    CHECK(reader.parse(huge, sizeof(huge)) < 0);
+  }
+  {
+    // shorter than a batch header
+    relay::Reader reader(cache);
+    const char tiny[] = {0, 0, 0, 3, 0, 0, 0};
+    CHECK(reader.parse(tiny, sizeof(tiny)) < 0);
+  }
+  {
+    // a record running past the end of its batch
+    FlvPacketList pkts;
+    pkts.push_back(packet(VIDEO, 1, 0, 100, 1));
+    auto bytes = encode(pkts);
+    bytes[3] -= 10;
+    bytes.resize(bytes.size() - 10);
+    relay::Reader reader(cache);
+    CHECK(reader.parse((const char*)bytes.data(), bytes.size()) < 0);
+  }
+  {
+    // a packet type there is none of
+    FlvPacketList pkts;
+    pkts.push_back(packet(VIDEO, 1, 0, 100, 1));
+    auto bytes = encode(pkts);
+    bytes[relay::BATCH_HEADER_SIZE] = 0x7f;
+    relay::Reader reader(cache);
+    CHECK(reader.parse((const char*)bytes.data(), bytes.size()) < 0);
+  }
+}
+
+// media only, by dts
+std::vector<int64_t> media(const Collector& collector, size_t from = 0) {
+  std::vector<int64_t> dts;
+  for (size_t i = from; i < collector.seen.size(); i++) {
+    auto type = collector.seen[i].type;
+    if (type == VIDEO || type == AUDIO) {
+      dts.push_back(collector.seen[i].dts);
+    }
+  }
+  return dts;
+}
+
+void testSameOrigin() {
+  FlvPacketCache cache(1024);
+  Collector collector;
+  cache.addSink(&collector);
+  relay::Reader reader(cache);
+
+  reader.reset("a");
+  auto first = gop(10, 6, 5000);
+  auto bytes = encode(first);
+  CHECK(reader.parse((const char*)bytes.data(), bytes.size()) == 0);
+  auto before = media(collector);
+  CHECK(before.size() == 6);
+
+  // the origin resends its GOP from id 12 on, then goes on to 19
+  reader.reset("a");
+  auto replay = gop(12, 8, 5000 + 40 * 2);
+  bytes = encode(replay);
+  size_t mark = collector.seen.size();
+  CHECK(reader.parse((const char*)bytes.data(), bytes.size()) == 0);
+  auto after = media(collector, mark);
+  // 12 to 15 were there already, 16 to 19 follow on the same timeline
+  CHECK(after.size() == 4);
+  if (!before.empty() && after.size() == 4) {
+    for (size_t i = 0; i < after.size(); i++) {
+      CHECK(after[i] == before.back() + 40 * (int64_t)(i + 1));
+    }
+  }
+}
+
+void testRepublished() {
+  FlvPacketCache cache(1024);
+  Collector collector;
+  cache.addSink(&collector);
+  relay::Reader reader(cache);
+
+  reader.reset("a");
+  auto first = gop(500, 4, 90000);
+  auto bytes = encode(first);
+  CHECK(reader.parse((const char*)bytes.data(), bytes.size()) == 0);
+  int64_t lastDts = cache.lastDts();
+
+  // published anew there: ids and timestamps start over
+  reader.reset("a");
+  auto again = gop(0, 4, 0);
+  bytes = encode(again);
+  size_t mark = collector.seen.size();
+  CHECK(reader.parse((const char*)bytes.data(), bytes.size()) == 0);
+  auto after = media(collector, mark);
+  CHECK(after.size() == 4);
+  if (after.size() == 4) {
+    CHECK(after[0] == lastDts + 1);
+    CHECK(after[3] == lastDts + 1 + 120);
+  }
+  // the configs it resent take effect where the stream is
+  CHECK(collector.seen[mark].type == VIDEO_DCR);
+  CHECK(collector.seen[mark].dts == lastDts);
+
+  // and another origin is a new stream for the reader too
+  lastDts = cache.lastDts();
+  reader.reset("b");
+  auto other = gop(10000, 2, 7);
+  bytes = encode(other);
+  mark = collector.seen.size();
+  CHECK(reader.parse((const char*)bytes.data(), bytes.size()) == 0);
+  after = media(collector, mark);
+  CHECK(after.size() == 2);
+  if (after.size() == 2) {
+    CHECK(after[0] == lastDts + 1);
+  }
+}
+
+} // namespace
+
+int main() {
+  testRoundTrip();
+  testGarbage();
+  testSameOrigin();
+  testRepublished();
+  printf("relay: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+// The shared memory ring (shm.hh) with its writer and a reader in one
+// process: records across the wrap, oversized ones, a reader lapped by
+// the writer, and configs rewritten under a reader, also from another
+// thread while it reads.
+
+#include "../shm.hh"
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                             \
+  do {                                                          \
+    if (!(cond)) {                                              \
+      printf("%s:%d: %s\n", __FILE__, __LINE__, #cond);         \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+const size_t CAPACITY = 64 << 10;
+
+// payload bytes follow from the dts, a reader can tell a torn one
+FlvPacket packet(packet_t type, int64_t dts, size_t size, int key = 0) {
+  FlvPacket pkt;
+  pkt.type = type;
+  pkt.key = key;
+  pkt.dts = dts;
+  std::vector<uint8_t> data(size);
+  for (size_t i = 0; i < size; i++) {
+    data[i] = (uint8_t)(dts + i);
+  }
+  pkt.payload = byte_t::create(data.data(), data.size());
+  return pkt;
+}
+
+void write(ShmRing& ring, packet_t type, int64_t dts,
+           size_t size, int key = 0) {
+  auto pkt = packet(type, dts, size, key);
+  ring.onPacket(pkt);
+  pkt.payload->release();
+}
+
+bool intact(const FlvPacket& pkt) {
+  const uint8_t* p = pkt.payload->constBytes();
+  for (size_t i = 0; i < pkt.payload->size(); i++) {
+    if (p[i] != (uint8_t)(pkt.dts + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool open(ShmRing& ring, ShmReader& reader) {
+  return ring.create("test", CAPACITY) && reader.attach(dup(ring.fd()));
+}
+
+void testWrap() {
+  ShmRing ring;
+  ShmReader reader;
+  CHECK(open(ring, reader));
+  uint64_t pos = reader.start();
+  FlvPacket pkt;
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::AGAIN);
+
+  // sizes that do not divide the ring: wrap markers now and then,
+  // read as they come so nothing is lapped
+  int64_t next = 0;
+  int wraps = 0;
+  for (int64_t dts = 0; dts < 200; dts++) {
+    write(ring, dts % 3 ? AUDIO : VIDEO, dts, 1000 + (dts * 577) % 6000,
+          dts % 3 == 0);
+    for (;;) {
+      uint64_t before = pos;
+      auto err = reader.read(pos, pkt);
+      if (err == FlvPacketCache::AGAIN) {
+        break;
+      }
+      CHECK(err == FlvPacketCache::OK);
+      if (err != FlvPacketCache::OK) {
+        return;
+      }
+      wraps += pos / CAPACITY != before / CAPACITY;
+      CHECK(pkt.dts == next);
+      CHECK(pkt.payload->size() == 1000 + (size_t)(next * 577) % 6000);
+      CHECK(pkt.type == (next % 3 ? AUDIO : VIDEO));
+      CHECK(pkt.key == (next % 3 == 0));
+      CHECK(intact(pkt));
+      pkt.payload->release();
+      next++;
+    }
+  }
+  CHECK(next == 200);
+  CHECK(wraps > 5);
+}
+
+void testOversized() {
+  ShmRing ring;
+  ShmReader reader;
+  CHECK(open(ring, reader));
+  uint64_t pos = reader.start();
+
+  // more than a quarter of the ring is not written, the rest goes on
+  write(ring, VIDEO, 1, 100, 1);
+  write(ring, VIDEO, 2, CAPACITY / 4, 0);
+  write(ring, VIDEO, 3, CAPACITY, 0);
+  write(ring, AUDIO, 4, 100);
+
+  FlvPacket pkt;
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::OK && pkt.dts == 1);
+  pkt.payload->release();
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::OK && pkt.dts == 4);
+  CHECK(intact(pkt));
+  pkt.payload->release();
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::AGAIN);
+
+  // an oversized config is still no record, and no slot either
+  write(ring, VIDEO_DCR, 0, ShmRing::SLOT_SIZE);
+  CHECK(!reader.config(ShmRing::SLOT_VIDEO_DCR, pkt));
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::AGAIN);
+}
+
+void testLapped() {
+  ShmRing ring;
+  ShmReader reader;
+  CHECK(open(ring, reader));
+
+  write(ring, VIDEO, 0, 4000, 1);
+  uint64_t pos = reader.start();
+  FlvPacket pkt;
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::OK && pkt.dts == 0);
+  pkt.payload->release();
+
+  // more than a ring goes by, then a keyframe
+  int64_t dts = 1;
+  size_t written = 0;
+  while (written <= CAPACITY) {
+    write(ring, VIDEO, dts, 4000, dts % 10 == 0);
+    written += 4000;
+    dts++;
+  }
+  int64_t key = dts;
+  write(ring, VIDEO, dts++, 4000, 1);
+  write(ring, AUDIO, dts++, 4000);
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::ERROR);
+
+  // starting over: at the newest keyframe, in one piece
+  pos = reader.start();
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::OK);
+  CHECK(pkt.key == 1 && pkt.dts == key);
+  CHECK(intact(pkt));
+  pkt.payload->release();
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::OK && pkt.dts == key + 1);
+  pkt.payload->release();
+
+  // a keyframe more than half a ring back is not one to start at
+  for (int i = 0; i < 12; i++, dts++) {
+    write(ring, AUDIO, dts, 4000);
+  }
+  pos = reader.start();
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::AGAIN);
+}
+
+void testConfigs() {
+  ShmRing ring;
+  ShmReader reader;
+  CHECK(open(ring, reader));
+
+  FlvPacket pkt;
+  CHECK(!reader.config(ShmRing::SLOT_AUDIO_DCR, pkt));
+  write(ring, AUDIO_DCR, 7, 4);
+  write(ring, METADATA, 9, 300);
+  CHECK(reader.config(ShmRing::SLOT_AUDIO_DCR, pkt));
+  CHECK(pkt.type == AUDIO_DCR && pkt.payload->size() == 4);
+  pkt.payload->release();
+
+  // rewritten between two reads: the newest comes out
+  write(ring, METADATA, 10, 500);
+  CHECK(reader.config(ShmRing::SLOT_METADATA, pkt));
+  CHECK(pkt.type == METADATA && pkt.payload->size() == 500);
+  pkt.dts = 10;
+  CHECK(intact(pkt));
+  pkt.payload->release();
+
+  // and while reading: never a mix of two versions
+  std::atomic<bool> stop {false};
+  std::thread writer([&] {
+    for (int64_t v = 0; !stop; v++) {
+      write(ring, VIDEO_DCR, v, 1 + (v * 131) % 30000);
+    }
+  });
+  size_t torn = 0;
+  for (int i = 0; i < 20000; i++) {
+    if (!reader.config(ShmRing::SLOT_VIDEO_DCR, pkt)) {
+      continue;
+    }
+    // the dts is not kept, the first byte tells the version
+    const uint8_t* p = pkt.payload->constBytes();
+    size_t size = pkt.payload->size();
+    for (size_t k = 1; k < size; k++) {
+      if ((uint8_t)(p[k] - p[0]) != (uint8_t)k) {
+        torn++;
+        break;
+      }
+    }
+    pkt.payload->release();
+  }
+  stop = true;
+  writer.join();
+  CHECK(torn == 0);
+}
+
+void testConcurrent() {
+  ShmRing ring;
+  ShmReader reader;
+  CHECK(open(ring, reader));
+
+  // a reader racing the writer gets whole records in order, or ERROR
+  // and then starts over; never a torn one
+  std::atomic<bool> done {false};
+  std::thread writer([&] {
+    for (int64_t dts = 0; dts < 200000; dts++) {
+      write(ring, VIDEO, dts, 200 + (dts * 37) % 3000, dts % 25 == 0);
+    }
+    done = true;
+  });
+  uint64_t pos = reader.start();
+  int64_t last = -1;
+  size_t read = 0, restarts = 0, torn = 0, backwards = 0;
+  for (;;) {
+    // done before the read: nothing is written after an AGAIN then
+    bool finished = done;
+    FlvPacket pkt;
+    auto err = reader.read(pos, pkt);
+    if (err == FlvPacketCache::AGAIN) {
+      if (finished) {
+        break;
+      }
+      continue;
+    } else if (err == FlvPacketCache::ERROR) {
+      pos = reader.start();
+      restarts++;
+      continue;
+    }
+    torn += !intact(pkt);
+    backwards += pkt.dts <= last;
+    last = pkt.dts;
+    read++;
+    pkt.payload->release();
+  }
+  writer.join();
+  CHECK(torn == 0);
+  CHECK(backwards <= restarts);
+  CHECK(read > 0 && restarts > 0);
+
+  // however often it started over, it ends at the head
+  write(ring, VIDEO, 200000, 100, 1);
+  FlvPacket pkt;
+  CHECK(reader.read(pos, pkt) == FlvPacketCache::OK && pkt.dts == 200000);
+  pkt.payload->release();
+  printf("shm: %zu read, %zu restarts\n", read, restarts);
+}
+
+} // namespace
+
+int main() {
+  testWrap();
+  testOversized();
+  testLapped();
+  testConfigs();
+  testConcurrent();
+  printf("shm: %s\n", failures ? "FAILED" : "ok");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "tls.hh"
+#include "workers.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// a client that stalls the handshake longer is dropped
+static const int HANDSHAKE_TIMEOUT_S = 5;
+
+static void printErrors(const char* what) {
+  char buf[256];
+  unsigned long err = ERR_get_error();
+  if (!err) {
+    cout << what << endl;
+  }
+  for (; err; err = ERR_get_error()) {
+    ERR_error_string_n(err, buf, sizeof(buf));
+    cout << what << ": " << buf << endl;
+  }
+}
+
+TlsServer::~TlsServer() {
+  if (_ctx) {
+    SSL_CTX_free(_ctx);
+  }
+}
+
+bool TlsServer::init(const std::string& cert, const std::string& key) {
+  _ctx = SSL_CTX_new(TLS_server_method());
+  if (!_ctx) {
+    printErrors("SSL_CTX_new");
+    return false;
+  }
+  SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+  // TLS 1.3 receive offload came with OpenSSL 3.2, before that a 1.3
+  // session could not be handed over whole
+  if (OpenSSL_version_num() < 0x30200000L) {
+    cout << OpenSSL_version(OPENSSL_VERSION)
+         << ": no kTLS receive for TLS 1.3, serving TLS 1.2 only" << endl;
+    SSL_CTX_set_max_proto_version(_ctx, TLS1_2_VERSION);
+  }
+  // only what the kernel can take over: AES-GCM, and no session
+  // tickets to be written after the handshake
+  SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+  SSL_CTX_set_num_tickets(_ctx, 0);
+  if (SSL_CTX_set_cipher_list(_ctx, "ECDHE+AESGCM") != 1 ||
+      SSL_CTX_set_ciphersuites(_ctx, "TLS_AES_128_GCM_SHA256:"
+                                     "TLS_AES_256_GCM_SHA384") != 1) {
+    printErrors("tls ciphers");
+    return false;
+  }
+  if (SSL_CTX_use_certificate_chain_file(_ctx, cert.c_str()) != 1 ||
+      SSL_CTX_use_PrivateKey_file(_ctx, key.c_str(),
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(_ctx) != 1) {
+    printErrors("tls certificate");
+    return false;
+  }
+  return true;
+}
+
+bool TlsServer::handshake(int fd) const {
+  struct timeval tv = {HANDSHAKE_TIMEOUT_S, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  // the socket BIO does not own the fd, freeing the session leaves it
+  // and the keys installed in the kernel alone
+  SSL* ssl = SSL_new(_ctx);
+  bool ok = ssl && SSL_set_fd(ssl, fd) == 1;
+  if (ok && SSL_accept(ssl) != 1) {
+    printErrors("tls handshake");
+    ok = false;
+  }
+  if (ok && (!BIO_get_ktls_send(SSL_get_wbio(ssl)) ||
+             !BIO_get_ktls_recv(SSL_get_rbio(ssl)))) {
+    cout << "kTLS not available (is the tls module loaded?)" << endl;
+    ok = false;
+  }
+  if (ssl) {
+    SSL_free(ssl);
+  }
+  if (!ok) {
+    close(fd);
+    return false;
+  }
+
+  tv = {0, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+bool TlsServer::admit(size_t max) {
+  size_t pending = _pending.load();
+  do {
+    if (pending >= max) {
+      return false;
+    }
+  } while (!_pending.compare_exchange_weak(pending, pending + 1));
+  return true;
+}
+
+void TlsServer::done() {
+  _pending--;
+}
+
+static void TlsHandshake(event_based_actor* self,
+                         int fd,
+                         std::shared_ptr<TlsServer> server,
+                         const actor& master) {
+  if (server->handshake(fd)) {
+    self->send(master, tls_conn_atom::value, fd);
+  }
+  server->done();
+}
+
+void TlsAcceptor(event_based_actor* self,
+                 uint16_t port,
+                 size_t max_handshakes,
+                 std::shared_ptr<TlsServer> server,
+                 const actor& master) {
+  int lfd = listenReusePort(port);
+  if (lfd < 0) {
+    cerr << "cannot listen on " << port << " for tls" << endl;
+    return;
+  }
+  fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) & ~O_NONBLOCK);
+  cout << "https on " << port << endl;
+  for (;;) {
+    int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("tls accept");
+      }
+      continue;
+    }
+    // a thread each, and a client can hold one for the whole timeout
+    // without sending a byte: past the limit, new ones are turned away
+    if (!server->admit(std::max<size_t>(max_handshakes, 1))) {
+      close(fd);
+      continue;
+    }
+    self->spawn<detached>(TlsHandshake, fd, server, master);
+  }
+}
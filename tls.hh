@@ -0,0 +1,48 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include <atomic>
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+// master <- handshake: a TLS connection ready for plain reads and
+// writes, the kernel does the crypto
+using tls_conn_atom = atom_constant<atom("tls_conn")>;
+
+// HTTPS on the [tls] port. Handshakes are done with OpenSSL, after
+// which the session keys are installed in the kernel (kTLS, TLS_TX and
+// TLS_RX) and the socket goes to the master like any accepted one:
+// egress stays plain writes, encrypted in the kernel.
+class TlsServer {
+public:
+  ~TlsServer();
+
+  bool init(const std::string& cert, const std::string& key);
+
+  // Runs the handshake on the accepted `fd` and switches it to kTLS,
+  // false (`fd` closed) if either fails.
+  bool handshake(int fd) const;
+
+  // Counts a handshake in, false if `max` are running already; done()
+  // counts it out.
+  bool admit(size_t max);
+  void done();
+
+private:
+  SSL_CTX* _ctx {nullptr};
+  std::atomic<size_t> _pending {0};
+};
+
+// Accepts on `port` for `master`, handshaking each connection on its
+// own detached actor, at most `max_handshakes` at once. Blocks, so runs
+// detached itself.
+void TlsAcceptor(event_based_actor* self,
+                 uint16_t port,
+                 size_t max_handshakes,
+                 std::shared_ptr<TlsServer> server,
+                 const actor& master);
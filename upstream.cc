@@ -0,0 +1,274 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "upstream.hh"
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// weight of a new sample in the smoothed latencies
+static const double EWMA_ALPHA = 0.3;
+static const int PROBE_TIMEOUT_MS = 2000;
+
+bool Upstream::fromUrl(const std::string& url, Upstream& out) {
+  http::UrlParser parser(url);
+  if (parser.parse() != 0 || parser.getHost().empty()) {
+    return false;
+  }
+  out.host = parser.getHost();
+  out.port = parser.getPort().empty() ? 80 : std::stoi(parser.getPort());
+  return true;
+}
+
+bool UpstreamPool::parse(const std::string& urls) {
+  _origins.clear();
+  _stats.clear();
+  size_t pos = 0;
+  while (pos <= urls.size()) {
+    auto comma = urls.find(',', pos);
+    if (comma == std::string::npos) {
+      comma = urls.size();
+    }
+    auto first = urls.find_first_not_of(" \t", pos);
+    auto last = urls.find_last_not_of(" \t", comma - 1);
+    pos = comma + 1;
+    if (first >= comma || last == std::string::npos || last < first) {
+      continue;
+    }
+
+    Upstream origin;
+    if (!Upstream::fromUrl(urls.substr(first, last - first + 1), origin)) {
+      cout << "Upstream url parse failed: "
+           << urls.substr(first, last - first + 1) << endl;
+      _origins.clear();
+      _stats.clear();
+      return false;
+    }
+    _origins.push_back(origin);
+    _stats.emplace_back();
+  }
+
+  // the points only depend on the origin names, every edge configured
+  // with the same origins builds the same ring
+  _ring.clear();
+  for (size_t i = 0; i < _origins.size(); i++) {
+    for (size_t v = 0; v < VNODES; v++) {
+      _ring.emplace_back(hash(_origins[i].name() + "#" + std::to_string(v)),
+                         i);
+    }
+  }
+  std::sort(_ring.begin(), _ring.end());
+  return true;
+}
+
+// FNV-1a, finished with the splitmix64 mixer so that similar keys
+// ("/live/a", "/live/b") land far apart on the ring.
+uint64_t UpstreamPool::hash(const std::string& key) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : key) {
+    h = (h ^ c) * 0x100000001b3ULL;
+  }
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+size_t UpstreamPool::find(const std::string& name) const {
+  for (size_t i = 0; i < _origins.size(); i++) {
+    if (_origins[i].name() == name) {
+      return i;
+    }
+  }
+  return _origins.size();
+}
+
+void UpstreamPool::acquire(const std::string& name) {
+  auto i = find(name);
+  if (i < _origins.size()) {
+    _stats[i].load++;
+  }
+}
+
+void UpstreamPool::release(const std::string& name) {
+  auto i = find(name);
+  if (i < _origins.size() && _stats[i].load > 0) {
+    _stats[i].load--;
+  }
+}
+
+std::vector<Upstream> UpstreamPool::hashed(const std::string& path) const {
+  std::vector<Upstream> out;
+  if (_ring.empty()) {
+    return out;
+  }
+
+  // the bound counts the stream being placed, so that an idle pool
+  // still takes it on its owner
+  size_t total = 1;
+  for (auto& st : _stats) {
+    total += st.load;
+  }
+  size_t bound = (total * _boundPercent + 100 * _origins.size() - 1) /
+                 (100 * _origins.size());
+
+  std::vector<size_t> order;
+  std::vector<bool> seen(_origins.size(), false);
+  auto it = std::lower_bound(_ring.begin(), _ring.end(),
+                             std::make_pair(hash(path), (size_t)0));
+  for (size_t n = 0; n < _ring.size() && order.size() < _origins.size();
+       n++, it++) {
+    if (it == _ring.end()) {
+      it = _ring.begin();
+    }
+    if (!seen[it->second]) {
+      seen[it->second] = true;
+      order.push_back(it->second);
+    }
+  }
+
+  std::stable_partition(order.begin(), order.end(), [&](size_t i) {
+    return _stats[i].healthy && _stats[i].load < bound;
+  });
+  std::stable_partition(order.begin(), order.end(), [&](size_t i) {
+    return _stats[i].healthy;
+  });
+  for (auto i : order) {
+    out.push_back(_origins[i]);
+  }
+  return out;
+}
+
+std::vector<Upstream> UpstreamPool::ranked() const {
+  std::vector<size_t> order(_origins.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  // an origin not measured yet ranks with the fastest, so it gets
+  // measured by real traffic as well
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    auto& sa = _stats[a];
+    auto& sb = _stats[b];
+    if (sa.healthy != sb.healthy) {
+      return sa.healthy;
+    }
+    double la = sa.measured ? sa.connectMs + sa.ttfbMs : 0;
+    double lb = sb.measured ? sb.connectMs + sb.ttfbMs : 0;
+    return la < lb;
+  });
+
+  std::vector<Upstream> out;
+  for (auto i : order) {
+    out.push_back(_origins[i]);
+  }
+  return out;
+}
+
+void UpstreamPool::report(const std::string& name, bool ok,
+                          int64_t connectMs, int64_t ttfbMs) {
+  auto i = find(name);
+  if (i == _origins.size()) {
+    return;
+  }
+  auto& st = _stats[i];
+  if (st.healthy != ok) {
+    cout << "Upstream " << name
+         << (ok ? " is back" : " is down") << endl;
+  }
+  st.healthy = ok;
+  if (!ok) {
+    return;
+  }
+  if (connectMs >= 0) {
+    st.connectMs = st.measured
+      ? st.connectMs + EWMA_ALPHA * (connectMs - st.connectMs)
+      : connectMs;
+  }
+  if (ttfbMs >= 0) {
+    st.ttfbMs = st.measured
+      ? st.ttfbMs + EWMA_ALPHA * (ttfbMs - st.ttfbMs)
+      : ttfbMs;
+  }
+  st.measured = st.measured || (connectMs >= 0 && ttfbMs >= 0);
+}
+
+static int64_t elapsedMs(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - since).count();
+}
+
+static bool waitFor(int fd, short events) {
+  struct pollfd pfd = {fd, events, 0};
+  return poll(&pfd, 1, PROBE_TIMEOUT_MS) == 1 && (pfd.revents & events);
+}
+
+void UpstreamProbe(event_based_actor* self,
+                   const Upstream& origin,
+                   const actor& master) {
+  int64_t connectMs = -1;
+  int64_t ttfbMs = -1;
+  auto start = std::chrono::steady_clock::now();
+
+  struct addrinfo hints;
+  struct addrinfo* res = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  auto port = std::to_string(origin.port);
+  int fd = -1;
+  if (getaddrinfo(origin.host.c_str(), port.c_str(), &hints, &res) == 0) {
+    fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, 0);
+  }
+  BOOST_SCOPE_EXIT(&fd, &res) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (res) {
+      freeaddrinfo(res);
+    }
+  } BOOST_SCOPE_EXIT_END
+
+  if (fd >= 0 &&
+      (connect(fd, res->ai_addr, res->ai_addrlen) == 0 ||
+       (errno == EINPROGRESS && waitFor(fd, POLLOUT)))) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err == 0) {
+      connectMs = elapsedMs(start);
+    }
+  }
+
+  // healthy if it answers with a 2xx or 3xx status line
+  bool healthy = false;
+  if (connectMs >= 0) {
+    auto req = "HEAD / HTTP/1.1\r\nHost: " + origin.host +
+               "\r\nConnection: close\r\n\r\n";
+    auto sent = std::chrono::steady_clock::now();
+    std::string line;
+    bool ok = send(fd, req.data(), req.size(), MSG_NOSIGNAL) ==
+              (ssize_t)req.size();
+    while (ok && line.find("\r\n") == std::string::npos &&
+           line.size() < 256) {
+      char buf[256];
+      ssize_t n = waitFor(fd, POLLIN) ? recv(fd, buf, sizeof(buf), 0) : -1;
+      ok = n > 0;
+      if (ok) {
+        if (ttfbMs < 0) {
+          ttfbMs = elapsedMs(sent);
+        }
+        line.append(buf, n);
+      }
+    }
+    int status = 0;
+    healthy = ok &&
+              sscanf(line.c_str(), "HTTP/%*d.%*d %d", &status) == 1 &&
+              status >= 200 && status < 400;
+  }
+
+  self->send(master, up_report_atom::value, origin.name(),
+             healthy, connectMs, ttfbMs);
+}
@@ -0,0 +1,97 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+
+using up_check_atom  = atom_constant<atom("up_check")>;
+using up_report_atom = atom_constant<atom("up_report")>;
+
+struct Upstream {
+  std::string host;
+  uint16_t port {80};
+
+  std::string name() const {
+    return host + ":" + std::to_string(port);
+  }
+
+  // "http://host[:port][/...]"
+  static bool fromUrl(const std::string& url, Upstream& out);
+};
+
+// The origins streams are pulled from, with what we last measured of
+// each: whether it answers at all, and smoothed connect and time to
+// first byte latencies.
+class UpstreamPool {
+public:
+  // "http://a:80, http://b:8080", false on an unparsable entry.
+  bool parse(const std::string& urls);
+
+  bool empty() const {
+    return _origins.empty();
+  }
+
+  const std::vector<Upstream>& origins() const {
+    return _origins;
+  }
+
+  // Maps streams onto the origins with a consistent hash ring instead
+  // of by latency. An origin takes no new stream while it already
+  // pulls more than `boundPercent` % of the average.
+  void setHashing(bool hashing, uint32_t boundPercent) {
+    _hashing = hashing;
+    _boundPercent = std::max<uint32_t>(boundPercent, 100);
+  }
+
+  // The origins to try for `path`, best first.
+  std::vector<Upstream> route(const std::string& path) const {
+    return _hashing ? hashed(path) : ranked();
+  }
+
+  // Healthy origins fastest first, then the unhealthy ones as a last
+  // resort, each group in configuration order on ties.
+  std::vector<Upstream> ranked() const;
+
+  // Healthy origins in ring order from the owner of `path`, the ones
+  // at their load bound after those, the unhealthy ones last.
+  std::vector<Upstream> hashed(const std::string& path) const;
+
+  // Streams being pulled from an origin, for the load bound.
+  void acquire(const std::string& name);
+  void release(const std::string& name);
+
+  // A probe or a pull came back. Latencies < 0 were not measured.
+  void report(const std::string& name, bool ok,
+              int64_t connectMs, int64_t ttfbMs);
+
+private:
+  struct Stats {
+    bool   healthy {true};
+    double connectMs {0};
+    double ttfbMs {0};
+    bool   measured {false};
+    size_t load {0};
+  };
+
+  enum : size_t { VNODES = 160 };
+
+  static uint64_t hash(const std::string& key);
+  size_t find(const std::string& name) const;
+
+  std::vector<Upstream> _origins;
+  std::vector<Stats> _stats;
+  // (point, origin) sorted by point, VNODES points per origin
+  std::vector<std::pair<uint64_t, size_t>> _ring;
+  bool _hashing {false};
+  uint32_t _boundPercent {125};
+};
+
+// Connects to `origin`, sends a HEAD request and waits for the first
+// byte of the answer, then reports to `master` and exits. Runs
+// detached, the connect and the read block.
+void UpstreamProbe(event_based_actor* self,
+                   const Upstream& origin,
+                   const actor& master);
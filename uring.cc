@@ -0,0 +1,358 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "uring.hh"
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// batches a home loop has to be behind by before another one helps out
+static const size_t STEAL_MIN_LOAD = 64;
+
+struct UringEgress::Send {
+  std::shared_ptr<EgressSocket> sock;
+  std::unique_ptr<EgressBatch> batch;
+  actor owner;
+  int64_t sent {0};
+  // waiting for the socket to take more, after an EAGAIN
+  bool polling {false};
+  struct msghdr msg;
+};
+
+EgressSocket::~EgressSocket() {
+  close(_fd);
+}
+
+void EgressBatch::copy(const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  // runs of headers end up in a single iovec
+  if (!_pieces.empty() &&
+      !_pieces.back().data &&
+      _pieces.back().offset + _pieces.back().size == _scratch.size()) {
+    _pieces.back().size += size;
+  } else {
+    _pieces.push_back({nullptr, _scratch.size(), size});
+  }
+  auto p = static_cast<const uint8_t*>(data);
+  _scratch.insert(std::end(_scratch), p, p + size);
+}
+
+void EgressBatch::ref(const void* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  _pieces.push_back({static_cast<const uint8_t*>(data), 0, size});
+}
+
+void EgressBatch::seal() {
+  _iov.clear();
+  for (const auto& piece : _pieces) {
+    const uint8_t* p = piece.data ? piece.data :
+                                    _scratch.data() + piece.offset;
+    _iov.push_back({const_cast<uint8_t*>(p), piece.size});
+  }
+  _first = 0;
+}
+
+bool EgressBatch::consume(size_t n) {
+  while (n > 0 && _first < _iov.size()) {
+    auto& iov = _iov[_first];
+    if (n >= iov.iov_len) {
+      n -= iov.iov_len;
+      _first++;
+    } else {
+      iov.iov_base = static_cast<uint8_t*>(iov.iov_base) + n;
+      iov.iov_len -= n;
+      n = 0;
+    }
+  }
+  return _first < _iov.size();
+}
+
+std::vector<std::unique_ptr<UringEgress>> UringEgress::_loops;
+std::vector<std::vector<UringEgress*>> UringEgress::_groups;
+
+bool UringEgress::init(size_t count, unsigned entries) {
+  // a process bound to one node has all its loops there
+  size_t groups = numa::enabled() && numa::home() < 0 ? numa::nodes() : 1;
+  count = std::max(count, groups);
+  std::vector<std::unique_ptr<UringEgress>> loops;
+  std::vector<std::vector<UringEgress*>> grouped(groups);
+  for (size_t i = 0; i < count; i++) {
+    std::unique_ptr<UringEgress> loop(new UringEgress);
+    if (!loop->setup(entries)) {
+      return false;
+    }
+    grouped[i % groups].push_back(loop.get());
+    loops.push_back(std::move(loop));
+  }
+  _loops = std::move(loops);
+  _groups = std::move(grouped);
+  return true;
+}
+
+UringEgress& UringEgress::pick(uint64_t key) {
+  auto& group = _groups[_groups.size() > 1 ? numa::streamNode(key) : 0];
+  UringEgress& home = *group[(key / _groups.size()) % group.size()];
+  size_t load = home.load();
+  if (load < STEAL_MIN_LOAD) {
+    return home;
+  }
+  // helped out by the stream's node only
+  UringEgress* idlest = &home;
+  for (auto loop : group) {
+    if (loop->load() < idlest->load()) {
+      idlest = loop;
+    }
+  }
+  // batches of a subscriber are sent one at a time, moving them to
+  // another loop keeps them in order
+  return load > 2 * idlest->load() ? *idlest : home;
+}
+
+bool UringEgress::setup(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring < 0) {
+    perror("io_uring_setup");
+    return false;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) {
+    sq_size = cq_size = std::max(sq_size, cq_size);
+  }
+  void* sq = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+  void* cq = single ? sq :
+    mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+  void* sqes = mmap(nullptr, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring, IORING_OFF_SQES);
+  _wake = eventfd(0, EFD_CLOEXEC);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+      _wake < 0) {
+    perror("io_uring rings");
+    close(ring);
+    return false;
+  }
+
+  auto sqp = static_cast<uint8_t*>(sq);
+  auto cqp = static_cast<uint8_t*>(cq);
+  _sqHead  = reinterpret_cast<unsigned*>(sqp + params.sq_off.head);
+  _sqTail  = reinterpret_cast<unsigned*>(sqp + params.sq_off.tail);
+  _sqMask  = reinterpret_cast<unsigned*>(sqp + params.sq_off.ring_mask);
+  _sqArray = reinterpret_cast<unsigned*>(sqp + params.sq_off.array);
+  _sqes    = static_cast<struct io_uring_sqe*>(sqes);
+  _cqHead  = reinterpret_cast<unsigned*>(cqp + params.cq_off.head);
+  _cqTail  = reinterpret_cast<unsigned*>(cqp + params.cq_off.tail);
+  _cqMask  = reinterpret_cast<unsigned*>(cqp + params.cq_off.ring_mask);
+  _cqes    = reinterpret_cast<struct io_uring_cqe*>(cqp + params.cq_off.cqes);
+  _entries = params.sq_entries;
+  _ring = ring;
+  return true;
+}
+
+void UringEgress::send(std::shared_ptr<EgressSocket> sock,
+                       std::unique_ptr<EgressBatch> batch,
+                       const actor& owner) {
+  batch->seal();
+  Send* s = new Send;
+  s->sock = std::move(sock);
+  s->batch = std::move(batch);
+  s->owner = owner;
+
+  _load.fetch_add(1, std::memory_order_relaxed);
+  bool wake;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queue.push_back(s);
+    wake = _sleeping;
+    _sleeping = false;
+  }
+  if (wake) {
+    uint64_t one = 1;
+    _syscalls.fetch_add(1, std::memory_order_relaxed);
+    if (write(_wake, &one, sizeof(one)) < 0) {
+      perror("egress wake");
+    }
+  }
+}
+
+int UringEgress::enter(unsigned wait) {
+  _syscalls.fetch_add(1, std::memory_order_relaxed);
+  int n = syscall(__NR_io_uring_enter, _ring, _toSubmit, wait,
+                  wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  if (n < 0) {
+    return -errno;
+  }
+  _toSubmit -= std::min<unsigned>(n, _toSubmit);
+  return n;
+}
+
+struct io_uring_sqe* UringEgress::nextSqe() {
+  unsigned tail = *_sqTail;
+  // full: hand what is there to the kernel first
+  if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _entries) {
+    enter(0);
+    if (tail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _entries) {
+      return nullptr;
+    }
+  }
+  unsigned index = tail & *_sqMask;
+  struct io_uring_sqe* sqe = &_sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  _sqArray[index] = index;
+  __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+  _toSubmit++;
+  return sqe;
+}
+
+void UringEgress::prepSend(Send* s) {
+  auto& iov = s->batch->_iov;
+  size_t first = s->batch->_first;
+  memset(&s->msg, 0, sizeof(s->msg));
+  s->msg.msg_iov = iov.data() + first;
+  s->msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+
+  struct io_uring_sqe* sqe = nextSqe();
+  if (!sqe) {
+    _backlog.push_back(s);
+    return;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = s->sock->fd();
+  sqe->addr = (uint64_t)&s->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t)s;
+}
+
+void UringEgress::prepPoll(Send* s) {
+  struct io_uring_sqe* sqe = nextSqe();
+  if (!sqe) {
+    s->polling = false;
+    _backlog.push_back(s);
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = s->sock->fd();
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = (uint64_t)s;
+}
+
+bool UringEgress::prepWake() {
+  struct io_uring_sqe* sqe = nextSqe();
+  if (!sqe) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = _wake;
+  sqe->addr = (uint64_t)&_wakeBuf;
+  sqe->len = sizeof(_wakeBuf);
+  sqe->user_data = 0;
+  return true;
+}
+
+void UringEgress::run(event_based_actor* self) {
+  auto finish = [=](Send* s, int64_t result) {
+    self->send(s->owner, egress_done_atom::value, result);
+    delete s;
+    _load.fetch_sub(1, std::memory_order_relaxed);
+  };
+
+  bool armed = false;
+  std::vector<Send*> queued;
+  for (;;) {
+    // what did not fit in the ring last time goes first
+    queued.swap(_backlog);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      queued.insert(std::end(queued), std::begin(_queue), std::end(_queue));
+      _queue.clear();
+      _sleeping = true;
+    }
+    if (!armed) {
+      armed = prepWake();
+    }
+    for (Send* s : queued) {
+      prepSend(s);
+    }
+    queued.clear();
+
+    int n = enter(_backlog.empty() ? 1 : 0);
+    if (n < 0 && n != -EINTR && n != -EBUSY) {
+      printf("io_uring_enter: %s\n", strerror(-n));
+    }
+
+    unsigned head = *_cqHead;
+    unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe* cqe = &_cqes[head & *_cqMask];
+      int res = cqe->res;
+      if (cqe->user_data == 0) {
+        armed = false;
+        continue;
+      }
+
+      Send* s = (Send*)cqe->user_data;
+      if (s->polling) {
+        s->polling = false;
+        if (res < 0) {
+          finish(s, res);
+        } else {
+          prepSend(s);
+        }
+      } else if (res == -EAGAIN) {
+        // the sockets are the middleman's, non-blocking
+        s->polling = true;
+        prepPoll(s);
+      } else if (res < 0) {
+        finish(s, res);
+      } else {
+        s->sent += res;
+        if (s->batch->consume(res)) {
+          prepSend(s);
+        } else {
+          finish(s, s->sent);
+        }
+      }
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+  }
+}
+
+void UringLoop(event_based_actor* self, size_t index, int cpu) {
+  // the thread is this actor's for good, it can be pinned
+  int node = UringEgress::node(index);
+  if (node >= 0) {
+    if (!numa::bindThread(node)) {
+      printf("egress loop %zu not bound to node %d\n", index, node);
+    }
+  } else if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      printf("egress loop %zu on cpu %d: %s\n", index, cpu, strerror(err));
+    }
+  }
+  UringEgress::at(index).run(self);
+}
@@ -0,0 +1,182 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include "numa.hh"
+#include <atomic>
+#include <mutex>
+#include <sys/uio.h>
+
+// Subscriber egress over io_uring ([egress] backend = "uring"). The
+// middleman writes every subscriber socket on its own, a write() or so
+// per tag once the scribe buffer is flushed. Here each subscriber hands
+// a whole batch over as one sendmsg, and all the batches queued while
+// the ring was busy go to the kernel in a single io_uring_enter, however
+// many sockets they are for. There are [egress] loops of these, each on
+// its own thread (and core, with [egress] cpus) with its own ring. A
+// stream has a home loop its subscribers all go through, so its packets
+// are read on one core (on the stream's node, see numa.hh); another
+// loop of that node only takes batches over while the home one has a
+// backlog.
+
+// subscriber <- egress: bytes sent, or -errno
+using egress_done_atom = atom_constant<atom("egress_ok")>;
+
+// What one subscriber sends at a time, in order. Headers are copied in,
+// payloads referenced: they have to stay until egress_done_atom.
+class EgressBatch {
+public:
+  void copy(const void* data, size_t size);
+  void ref(const void* data, size_t size);
+
+  bool empty() const {
+    return _pieces.empty();
+  }
+
+private:
+  friend class UringEgress;
+
+  // `data` is null for a piece copied to `_scratch` at `offset`
+  struct Piece {
+    const uint8_t* data;
+    size_t offset;
+    size_t size;
+  };
+
+  // Builds `_iov`, once nothing is added any more.
+  void seal();
+  // Drops the first `n` bytes, false once all is sent.
+  bool consume(size_t n);
+
+  std::vector<uint8_t> _scratch;
+  std::vector<Piece> _pieces;
+  std::vector<struct iovec> _iov;
+  size_t _first {0};
+};
+
+// A subscriber's socket as the egress writes it: a dup of the scribe's,
+// closed once neither the subscriber nor a send in flight holds it, so
+// its number is never reused under a queued send.
+class EgressSocket {
+public:
+  explicit EgressSocket(int fd)
+    : _fd(fd) {
+  }
+
+  ~EgressSocket();
+
+  EgressSocket(const EgressSocket&) = delete;
+  EgressSocket& operator=(const EgressSocket&) = delete;
+
+  int fd() const {
+    return _fd;
+  }
+
+private:
+  const int _fd;
+};
+
+class UringEgress {
+public:
+  // Sets up `count` loops (at least one per NUMA node), each with a
+  // ring of `entries` submissions, false if the kernel has no io_uring
+  // (or it is disabled).
+  static bool init(size_t count, unsigned entries);
+
+  static bool active() {
+    return !_loops.empty();
+  }
+
+  static size_t count() {
+    return _loops.size();
+  }
+
+  // The loop a batch of the stream named by `key` goes through: the
+  // stream's home loop, unless it is clearly behind the others.
+  static UringEgress& pick(uint64_t key);
+
+  static UringEgress& at(size_t index) {
+    return *_loops[index];
+  }
+
+  // The NUMA node loop `index` serves, -1 without NUMA placement.
+  static int node(size_t index) {
+    if (!numa::enabled()) {
+      return -1;
+    }
+    return numa::home() >= 0 ? numa::home() : index % _groups.size();
+  }
+
+  // Queues `batch` for `sock`, `owner` gets egress_done_atom when it is
+  // all sent or the socket failed.
+  void send(std::shared_ptr<EgressSocket> sock,
+            std::unique_ptr<EgressBatch> batch,
+            const actor& owner);
+
+  // Submits and reaps, forever.
+  void run(event_based_actor* self);
+
+  // batches queued or in flight
+  size_t load() const {
+    return _load.load(std::memory_order_relaxed);
+  }
+
+  // io_uring_enter calls and wakeups so far, see bench/egress.cc
+  uint64_t syscalls() const {
+    return _syscalls.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Send;
+
+  UringEgress() = default;
+
+  bool setup(unsigned entries);
+
+  static std::vector<std::unique_ptr<UringEgress>> _loops;
+  // the loops of each node, all in one without NUMA placement
+  static std::vector<std::vector<UringEgress*>> _groups;
+
+  struct io_uring_sqe* nextSqe();
+  void prepSend(Send* s);
+  void prepPoll(Send* s);
+  bool prepWake();
+  int enter(unsigned wait);
+
+  int _ring {-1};
+  unsigned _entries {0};
+  unsigned _toSubmit {0};
+
+  // the mmapped rings
+  unsigned* _sqHead {nullptr};
+  unsigned* _sqTail {nullptr};
+  unsigned* _sqMask {nullptr};
+  unsigned* _sqArray {nullptr};
+  struct io_uring_sqe* _sqes {nullptr};
+  unsigned* _cqHead {nullptr};
+  unsigned* _cqTail {nullptr};
+  unsigned* _cqMask {nullptr};
+  struct io_uring_cqe* _cqes {nullptr};
+
+  // batches from the subscribers, and the eventfd that wakes the loop
+  // when it sleeps in io_uring_enter with nothing else to do
+  std::mutex _mutex;
+  std::vector<Send*> _queue;
+  bool _sleeping {false};
+  int _wake {-1};
+  uint64_t _wakeBuf {0};
+
+  // sends that found the submission ring full, for the next round
+  std::vector<Send*> _backlog;
+
+  std::atomic<size_t> _load {0};
+  std::atomic<uint64_t> _syscalls {0};
+};
+
+// Runs the egress loop `index`, bound to its NUMA node, or else on
+// `cpu` unless it is negative. Blocks, so runs detached.
+void UringLoop(event_based_actor* self, size_t index, int cpu);
@@ -4,6 +4,8 @@
  */
 
 #include "utils.hh"
+#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 const uint8_t* byte_t::constBytes() const {
   return reinterpret_cast<uint8_t*>(
@@ -32,17 +34,124 @@ void byte_t::release() {
       reinterpret_cast<uint8_t*>(
         const_cast<byte_t*>(this)) - OFFSET_OF(byte_impl_t, data)));
   if (--byte->refcount == 0) {
-    free(byte);
+    numa::release(byte, byte->node, byte->cls);
   }
 }
 
 byte_t* byte_t::create(uint8_t* p,
                        size_t size) {
-  byte_impl_t* byte = new(size) byte_impl_t(p, size);
+  int node = numa::current();
+  int cls;
+  byte_impl_t* byte = new(size, node, cls) byte_impl_t(p, size);
+  byte->node = node;
+  byte->cls = cls;
   return byte->data;
 }
 
 byte_t* byte_t::create(size_t size) {
-  byte_impl_t* byte = new(size) byte_impl_t(size);
+  int node = numa::current();
+  int cls;
+  byte_impl_t* byte = new(size, node, cls) byte_impl_t(size);
+  byte->node = node;
+  byte->cls = cls;
   return byte->data;
 }
+
+namespace http {
+namespace ws {
+
+static bool hasToken(const std::string& value, const std::string& token) {
+  detail::equal eq;
+  size_t pos = 0;
+  while (pos < value.size()) {
+    size_t end = value.find(',', pos);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    size_t b = value.find_first_not_of(" \t", pos);
+    size_t e = value.find_last_not_of(" \t", end - 1);
+    if (b != std::string::npos && b < end && e >= b &&
+        e - b + 1 == token.size() &&
+        eq(value.substr(b, e - b + 1), token)) {
+      return true;
+    }
+    pos = end + 1;
+  }
+  return false;
+}
+
+bool isUpgrade(const Request& req) {
+  return req.getMethod() == HTTP_GET &&
+         req.hasField("Upgrade") &&
+         req.hasField("Connection") &&
+         hasToken(req.getField("Upgrade"), "websocket") &&
+         hasToken(req.getField("Connection"), "upgrade");
+}
+
+std::string handshake(const Request& req) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  if (!req.hasField("Sec-WebSocket-Key")) {
+    return std::string();
+  }
+  std::string key = req.getField("Sec-WebSocket-Key") + guid;
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(key.data()), key.size(), digest);
+  char accept[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+  EVP_EncodeBlock(reinterpret_cast<uint8_t*>(accept),
+                  digest,
+                  SHA_DIGEST_LENGTH);
+
+  std::string res = "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: ";
+  res += accept;
+  res += "\r\n\r\n";
+  return res;
+}
+
+bool parseFrame(std::vector<char>& buf, Frame& out) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf.data());
+  if (buf.size() < 2) {
+    return false;
+  }
+  size_t hdr = 2;
+  uint64_t size = p[1] & 0x7f;
+  if (size == 126) {
+    hdr = 4;
+  } else if (size == 127) {
+    hdr = 10;
+  }
+  bool masked = p[1] & 0x80;
+  if (masked) {
+    hdr += 4;
+  }
+  if (buf.size() < hdr) {
+    return false;
+  }
+  if (size >= 126) {
+    size_t n = size == 126 ? 2 : 8;
+    size = 0;
+    for (size_t i = 0; i < n; ++i) {
+      size = (size << 8) | p[2 + i];
+    }
+  }
+  if (buf.size() - hdr < size) {
+    return false;
+  }
+
+  out.fin = p[0] & 0x80;
+  out.op = static_cast<Opcode>(p[0] & 0x0f);
+  out.payload.assign(buf.begin() + hdr, buf.begin() + hdr + size);
+  if (masked) {
+    const uint8_t* mask = p + hdr - 4;
+    for (size_t i = 0; i < size; ++i) {
+      out.payload[i] ^= mask[i % 4];
+    }
+  }
+  buf.erase(buf.begin(), buf.begin() + hdr + size);
+  return true;
+}
+
+}
+}
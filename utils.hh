@@ -8,6 +8,7 @@
 #include "caf/all.hpp"
 #include "caf/io/all.hpp"
 #include "http-parser/http_parser.h"
+#include "numa.hh"
 #include <boost/functional/hash.hpp>
 #include <boost/scope_exit.hpp>
 #include <vector>
@@ -58,7 +59,8 @@ namespace detail {
   struct equal {
     bool operator()(const std::string& left,
                     const std::string& right) const {
-      return std::equal(left.begin(), left.end(), right.begin(),
+      return left.size() == right.size() &&
+             std::equal(left.begin(), left.end(), right.begin(),
                         [](char l, char r) {
           return tolower(l) == tolower(r);
         });
@@ -138,6 +140,29 @@ private:
   std::string _userinfo;
 };
 
+using Params =
+  std::unordered_map<std::string, std::string>;
+
+// "a=1&b=2" -> {a: 1, b: 2}, no percent-decoding.
+inline Params parseQuery(const std::string& query) {
+  Params res;
+  size_t pos = 0;
+  while (pos < query.size()) {
+    size_t end = query.find('&', pos);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    size_t eq = query.find('=', pos);
+    if (eq == std::string::npos || eq > end) {
+      res[query.substr(pos, end - pos)] = "";
+    } else {
+      res[query.substr(pos, eq - pos)] = query.substr(eq + 1, end - eq - 1);
+    }
+    pos = end + 1;
+  }
+  return res;
+}
+
 class Request {
 public:
   using Method = http_method;
@@ -197,6 +222,10 @@ public:
     return _headers.at(key);
   }
 
+  bool hasField(const std::string& key) const {
+    return _headers.find(key) != std::end(_headers);
+  }
+
 protected:
   static int on_message_begin(http_parser* p) {
     Request* self = static_cast<Request*>(p->data);
@@ -357,6 +386,10 @@ public:
     return _headers.at(key);
   }
 
+  bool hasField(const std::string& key) const {
+    return _headers.find(key) != std::end(_headers);
+  }
+
 protected:
   static int on_message_begin(http_parser* p) {
     Response* self = static_cast<Response*>(p->data);
@@ -449,6 +482,55 @@ private:
   } _status {NONE};
 };
 
+namespace ws {
+  enum Opcode : uint8_t {
+    OP_CONT   = 0x0,
+    OP_TEXT   = 0x1,
+    OP_BINARY = 0x2,
+    OP_CLOSE  = 0x8,
+    OP_PING   = 0x9,
+    OP_PONG   = 0xa
+  };
+
+  enum : size_t { MAX_HEADER_SIZE = 10 };
+
+  // Whether `req` asks to be upgraded to a websocket (RFC 6455 4.2.1).
+  bool isUpgrade(const Request& req);
+
+  // The 101 response for `req`, empty if its key is missing.
+  std::string handshake(const Request& req);
+
+  // Writes the header of an unmasked, final server frame carrying
+  // `size` bytes to `out`, returns its length.
+  inline size_t frameHeader(uint8_t* out, Opcode op, uint64_t size) {
+    out[0] = 0x80 | op;
+    if (size < 126) {
+      out[1] = size;
+      return 2;
+    } else if (size <= 0xffff) {
+      out[1] = 126;
+      out[2] = size >> 8;
+      out[3] = size;
+      return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; ++i) {
+      out[2 + i] = size >> (56 - 8 * i);
+    }
+    return 10;
+  }
+
+  struct Frame {
+    Opcode op;
+    bool fin;
+    std::vector<char> payload;
+  };
+
+  // Pops the first complete client frame off `buf`, unmasked. False if
+  // it has not fully arrived yet.
+  bool parseFrame(std::vector<char>& buf, Frame& out);
+}
+
 }
 
 
@@ -470,6 +552,9 @@ class byte_impl_t {
   friend class byte_t;
 private:
   int refcount;
+  // where the memory came from, see numa::alloc
+  int16_t node {-1};
+  int16_t cls {-1};
   size_t capacity;
   byte_t data[0];
 
@@ -490,8 +575,8 @@ private:
   byte_impl_t(const byte_impl_t&) = delete;
   byte_impl_t(byte_impl_t&&) = delete;
 
-  void* operator new(size_t size, size_t n) {
-    void* res = malloc(size + n);
+  void* operator new(size_t size, size_t n, int node, int& cls) {
+    void* res = numa::alloc(node, size + n, cls);
     if (!res) {
       throw std::bad_alloc();
     }
@@ -601,7 +686,8 @@ enum packet_t : uint8_t {
   AUDIO,
   VIDEO_DCR,
   AUDIO_DCR,
-  SCRIPT
+  SCRIPT,
+  METADATA
 };
 
 struct FlvPacket {
@@ -612,6 +698,18 @@ struct FlvPacket {
   byte_t*  payload {nullptr};
 };
 
+using FlvPacketList = std::list<FlvPacket>;
+
+// A stage fed by FlvPacketCache::append() (segmenters, recorders...).
+class FlvPacketSink {
+public:
+  virtual ~FlvPacketSink() = default;
+
+  // Called for every appended packet, DCRs and metadata included. The
+  // payload is borrowed, acquire() it to keep it.
+  virtual void onPacket(const FlvPacket& pkt) = 0;
+};
+
 class FlvPacketCache {
 public:
   enum ErrorCode : int8_t {
@@ -626,7 +724,9 @@ public:
     SKIP_B,
     SKIP_B_WITH_AUDIO,
     I_ONLY,
-    I_ONLY_WITH_AUDIO
+    I_ONLY_WITH_AUDIO,
+    AUDIO_ONLY,
+    VIDEO_ONLY
   };
 
   static constexpr ssize_t INVALID = -1;
@@ -648,25 +748,41 @@ public:
     if (_audioDCR.payload) {
       _audioDCR.payload->release();
     }
+    if (_metaData.payload) {
+      _metaData.payload->release();
+    }
   }
 
   ssize_t append(FlvPacket& pkt) {
     ssize_t id = _curId;
     pkt.id = _curId;
 
-    if (pkt.type == VIDEO_DCR) {
-      printf("video dcr\n");
-      if (_videoDCR.payload) {
-        _videoDCR.payload->release();
+    BOOST_SCOPE_EXIT(&pkt, this_) {
+      for (auto sink : this_->_sinks) {
+        sink->onPacket(pkt);
       }
-      _videoDCR = pkt;
-      return id;
-    } else if (pkt.type == AUDIO_DCR) {
-      printf("audio dcr\n");
-      if (_audioDCR.payload) {
-        _audioDCR.payload->release();
+    } BOOST_SCOPE_EXIT_END
+
+    if (pkt.type == VIDEO_DCR || pkt.type == AUDIO_DCR) {
+      auto& dcr = pkt.type == VIDEO_DCR ? _videoDCR : _audioDCR;
+      printf(pkt.type == VIDEO_DCR ? "video dcr\n" : "audio dcr\n");
+      // a config changing mid-stream (an encoder restart, a new
+      // upstream) has to reach the readers already past the start
+      bool inline_ = _curId > 0 && !samePayload(dcr, pkt);
+      if (dcr.payload) {
+        dcr.payload->release();
       }
-      _audioDCR = pkt;
+      dcr = pkt;
+      if (!inline_) {
+        return id;
+      }
+      pkt.payload->acquire();
+    } else if (pkt.type == METADATA) {
+      printf("metadata\n");
+      if (_metaData.payload) {
+        _metaData.payload->release();
+      }
+      _metaData = pkt;
       return id;
     }
 
@@ -680,22 +796,51 @@ public:
       _bottom ++;
     }
 
+    if (pkt.type == VIDEO) {
+      _hasVideo = true;
+    }
     if (pkt.type == VIDEO && pkt.key) {
       _keyIds.push_back(id);
-      if (_keyIds.front() < _bottom) {
-        _keyIds.pop_front();
+    }
+
+    if (pkt.type != VIDEO && pkt.type != VIDEO_DCR) {
+      _audioIds.push_back(id);
+    }
+    if (pkt.type != AUDIO && pkt.type != AUDIO_DCR) {
+      _videoIds.push_back(id);
+    }
+    for (auto idx : {&_keyIds, &_audioIds, &_videoIds}) {
+      if (!idx->empty() && idx->front() < _bottom) {
+        idx->pop_front();
       }
     }
     return id;
   }
 
-  std::list<FlvPacket> getDCR() const {
+  // Sinks see every packet appended from then on, until removed. Not
+  // owned.
+  void addSink(FlvPacketSink* sink) {
+    _sinks.push_back(sink);
+  }
+
+  void removeSink(FlvPacketSink* sink) {
+    _sinks.erase(std::remove(_sinks.begin(), _sinks.end(), sink),
+                 _sinks.end());
+  }
+
+  // onMetaData first, then the decoder configs, as a player expects them
+  // right after the flv header.
+  std::list<FlvPacket> getDCR(Mode mode = Mode::NORMAL) const {
     std::list<FlvPacket> res;
-    if (_videoDCR.payload) {
+    if (_metaData.payload) {
+      _metaData.payload->acquire();
+      res.push_back(_metaData);
+    }
+    if (_videoDCR.payload && mode != Mode::AUDIO_ONLY) {
       _videoDCR.payload->acquire();
       res.push_back(_videoDCR);
     }
-    if (_audioDCR.payload) {
+    if (_audioDCR.payload && mode != Mode::VIDEO_ONLY) {
       _audioDCR.payload->acquire();
       res.push_back(_audioDCR);
     }
@@ -738,17 +883,117 @@ public:
         out = _packets[next - _bottom];
         return ErrorCode::OK;
       }
+      case Mode::AUDIO_ONLY:
+      case Mode::VIDEO_ONLY: {
+        const auto& ids = mode == Mode::AUDIO_ONLY ? _audioIds : _videoIds;
+        ErrorCode res = ErrorCode::OK;
+        if (id + 1 < _bottom) {
+          id = _keyIds.empty() ? _bottom - 1 : _keyIds.back() - 1;
+          res = ErrorCode::SKIP;
+        }
+        auto it = std::upper_bound(ids.begin(), ids.end(), id);
+        if (it == std::end(ids)) {
+          return ErrorCode::AGAIN;
+        }
+        out = _packets[*it - _bottom];
+        return res;
+      }
     default:
       return ErrorCode::ERROR;
     }
     return ErrorCode::OK;
   }
 
+  // Appends everything after `id` that `mode` selects to `out`. The
+  // filtered modes walk their own index, so an audio-only reader never
+  // touches the video packets.
+  void getAll(ssize_t id,
+              FlvPacketList& out,
+              Mode mode = Mode::NORMAL) const {
+    FlvPacket pkt;
+    ErrorCode err = getNext(id, pkt, mode);
+    if (!(err == ErrorCode::OK || err == ErrorCode::SKIP)) {
+      return;
+    }
+    out.push_back(pkt);
+
+    if (mode == Mode::AUDIO_ONLY || mode == Mode::VIDEO_ONLY) {
+      const auto& ids = mode == Mode::AUDIO_ONLY ? _audioIds : _videoIds;
+      auto it = std::upper_bound(ids.begin(), ids.end(), pkt.id);
+      for (; it != std::end(ids); ++it) {
+        const FlvPacket& next = _packets[*it - _bottom];
+        next.payload->acquire();
+        out.push_back(next);
+      }
+    } else {
+      for (ssize_t next = pkt.id + 1; next < _curId; ++next) {
+        const FlvPacket& p = _packets[next - _bottom];
+        p.payload->acquire();
+        out.push_back(p);
+      }
+    }
+  }
+
+  int64_t lastDts() const {
+    return _packets.empty() ? -1 : _packets.back().dts;
+  }
+
+  // Whether reading on after `id` is still gapless.
+  bool resumable(ssize_t id) const {
+    return id >= _bottom - 1 && id < _curId;
+  }
+
+  // Id of the last keyframe at or before `dts`, or of the oldest one if
+  // `dts` is older than the cache. A binary search over the keyframe
+  // index; streams without video search the packets themselves. INVALID
+  // while a video stream has no keyframe cached.
+  ssize_t seek(int64_t dts) const {
+    auto before = [this](int64_t dts, ssize_t id) {
+      return dts < _packets[id - _bottom].dts;
+    };
+    if (!_keyIds.empty()) {
+      auto it = std::upper_bound(_keyIds.begin(), _keyIds.end(),
+                                 dts, before);
+      return it == _keyIds.begin() ? *it : *std::prev(it);
+    } else if (!_hasVideo && !_videoDCR.payload && !_packets.empty()) {
+      auto it = std::upper_bound(_packets.begin(), _packets.end(), dts,
+                                 [](int64_t dts, const FlvPacket& pkt) {
+                                   return dts < pkt.dts;
+                                 });
+      return it == _packets.begin() ? _bottom :
+        std::prev(it) - _packets.begin() + _bottom;
+    }
+    return INVALID;
+  }
+
+  // Like getAll(), from the position seek() finds for `dts` on.
+  void getSince(int64_t dts,
+                FlvPacketList& out,
+                Mode mode = Mode::NORMAL) const {
+    ssize_t id = seek(dts);
+    if (id != INVALID) {
+      getAll(id - 1, out, mode);
+    }
+  }
+
 private:
+  static bool samePayload(const FlvPacket& a, const FlvPacket& b) {
+    return a.payload && b.payload &&
+           a.payload->size() == b.payload->size() &&
+           memcmp(a.payload->constBytes(),
+                  b.payload->constBytes(),
+                  a.payload->size()) == 0;
+  }
+
   std::deque<FlvPacket> _packets;
   std::deque<ssize_t> _keyIds;
+  std::deque<ssize_t> _audioIds;
+  std::deque<ssize_t> _videoIds;
   FlvPacket _videoDCR;
   FlvPacket _audioDCR;
+  FlvPacket _metaData;
+  bool _hasVideo {false};
+  std::vector<FlvPacketSink*> _sinks;
   const size_t _maxSize;
   ssize_t _curId {0};
   ssize_t _bottom {0};
@@ -783,7 +1028,8 @@ public:
     CODECID_VP6     = 0x04,
     CODECID_VP6A    = 0x05,
     CODECID_SCREEN2 = 0x06,
-    CODECID_H264    = 0x07
+    CODECID_H264    = 0x07,
+    CODECID_HEVC    = 0x0c
   };
 
   enum AVCPacketType : uint8_t {
@@ -792,6 +1038,22 @@ public:
     END_OF_SEQUENCE = 0x02,
   };
 
+  // enhanced flv: [IsExHeader:1][FrameType:3][PacketType:4][FourCC:32]
+  enum ExVideoPacketType : uint8_t {
+    EX_SEQUENCE_START         = 0x00,
+    EX_CODED_FRAMES           = 0x01,
+    EX_SEQUENCE_END           = 0x02,
+    EX_CODED_FRAMES_X         = 0x03,
+    EX_METADATA               = 0x04,
+    EX_MPEG2TS_SEQUENCE_START = 0x05
+  };
+
+  enum FourCC : uint32_t {
+    FOURCC_AV1  = 0x61763031, // 'av01'
+    FOURCC_VP9  = 0x76703039, // 'vp09'
+    FOURCC_HEVC = 0x68766331  // 'hvc1'
+  };
+
   enum : uint8_t { KEY_FRAME = 0x01 };
 
   FlvParser(FlvPacketCache& cache)
@@ -801,10 +1063,37 @@ public:
       _remain.reserve(FLV_HEADER_SIZE);
   }
 
+  ~FlvParser() {
+    if (_status == TAG_DATA && _packet.payload) {
+      _packet.payload->release();
+    }
+  }
+
   int parse(const std::vector<char>& data) {
     return parse(&data[0], data.size());
   }
 
+  // The stream goes on from a new connection: expect a fresh flv header,
+  // drop the tag cut short, and shift the new timestamps to continue
+  // right after the last one seen.
+  void reset() {
+    if (_status == TAG_DATA && _packet.payload) {
+      // a tag is only appended once the next bytes come in, a complete
+      // one is not lost with the connection
+      if (_cursize == _tagsize) {
+        appendTag();
+      } else {
+        _packet.payload->release();
+      }
+    }
+    _packet.payload = nullptr;
+    _remain.clear();
+    _remain.reserve(FLV_HEADER_SIZE);
+    _skipSize = 0;
+    _status = HEADER;
+    _rebase = _lastDts >= 0;
+  }
+
   int parse(const char* data, size_t size) {
     const char* cur = data;
     const char* end = data + size;
@@ -896,8 +1185,15 @@ public:
           _packet.type =
             type == TAG_AUDIO ?
               AUDIO : type == TAG_VIDEO ?
-                VIDEO : _packet.type;
-          _packet.dts = dts;
+                VIDEO : type == TAG_SCRIPT ?
+                  SCRIPT : NONE;
+          if (_rebase) {
+            _tsOffset = _lastDts + 1 - dts;
+            _rebase = false;
+          }
+          _packet.key = 0;
+          _packet.dts = dts + _tsOffset;
+          _lastDts = std::max(_lastDts, _packet.dts);
           _packet.payload = byte_t::create(size);
 
           _status = TAG_DATA;
@@ -907,33 +1203,7 @@ public:
           ssize_t more = (ssize_t)_tagsize - _cursize;
           assert(more >= 0);
           if (more == 0) {
-            if (_packet.type == AUDIO) {
-              Bitstream bs((uint8_t*)_packet.payload, 2);
-                           bs.skip(8);
-              uint8_t pt = bs.read(8);
-              if (pt == SEQUENCE_HEADER) {
-                _packet.type = AUDIO_DCR;
-              }
-              //printf("audio frame(%lu) siz(%zu) type(%d)\n",
-              //  _packet.dts, _packet.payload->size(), pt);
-              _cache.append(_packet);
-            } else if (_packet.type == VIDEO) {
-              Bitstream bs((uint8_t*)_packet.payload, 6);
-              int type = bs.read(4);
-              int id   = bs.read(4);
-              int pt   = bs.read(8);
-              int cts  = bs.read(24);
-
-              _packet.key = (type == KEY_FRAME);
-              if (pt == SEQUENCE_HEADER) {
-                _packet.type = VIDEO_DCR;
-              }
-              //printf("video frame(%lu) size(%zu) id(%d) type(%d) pt(%d)\n",
-              //  _packet.dts, _packet.payload->size(), id, type, pt);
-              _cache.append(_packet);
-            } else {
-              _packet.payload->release();
-            }
+            appendTag();
             _status = PREV_TAG_SIZE;
             break;
           } else if (more >= end - cur) {
@@ -952,7 +1222,147 @@ public:
     return 0;
   }
 
+  // Codec of a video sequence header, legacy or enhanced:
+  // CODECID_H264, CODECID_HEVC, or 0 for anything else. The decoder
+  // configuration record follows at offset 5 in both layouts.
+  static uint8_t videoCodec(const uint8_t* p, size_t size) {
+    if (size < 5) {
+      return 0;
+    }
+    if (p[0] & 0x80) {
+      uint32_t fourcc = (p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+      return fourcc == FOURCC_HEVC ? CODECID_HEVC : 0;
+    }
+    uint8_t id = p[0] & 0x0f;
+    return id == CODECID_H264 || id == CODECID_HEVC ? id : 0;
+  }
+
+  // Where the NALUs of a coded video frame start, and its composition
+  // time offset; false if the payload is no coded frame.
+  static bool videoFrame(const uint8_t* p, size_t size,
+                         size_t& hdr, int32_t& cts) {
+    if (size < 5) {
+      return false;
+    }
+    if (p[0] & 0x80) {
+      int pt = p[0] & 0x0f;
+      if (pt == EX_CODED_FRAMES && size >= 8) {
+        cts = readCts(p + 5);
+        hdr = 8;
+        return true;
+      }
+      // no composition time in that one
+      cts = 0;
+      hdr = 5;
+      return pt == EX_CODED_FRAMES_X;
+    }
+    if (p[1] != NALU) {
+      return false;
+    }
+    cts = readCts(p + 2);
+    hdr = 5;
+    return true;
+  }
+
 private:
+  // The tag whose data is all in, to the cache.
+  void appendTag() {
+    if (_packet.type == AUDIO) {
+      Bitstream bs((uint8_t*)_packet.payload, 2);
+                   bs.skip(8);
+      uint8_t pt = bs.read(8);
+      if (pt == SEQUENCE_HEADER) {
+        _packet.type = AUDIO_DCR;
+      }
+      //printf("audio frame(%lu) siz(%zu) type(%d)\n",
+      //  _packet.dts, _packet.payload->size(), pt);
+      _cache.append(_packet);
+    } else if (_packet.type == VIDEO) {
+      parseVideoTag();
+      //printf("video frame(%lu) size(%zu) key(%d) type(%d)\n",
+      //  _packet.dts, _packet.payload->size(), _packet.key, _packet.type);
+      _cache.append(_packet);
+    } else if (_packet.type == SCRIPT) {
+      parseScriptTag();
+      _cache.append(_packet);
+    } else {
+      _packet.payload->release();
+    }
+  }
+
+  // SI24
+  static int32_t readCts(const uint8_t* p) {
+    int32_t cts = (p[0] << 16) | (p[1] << 8) | p[2];
+    if (cts & 0x800000) {
+      cts -= 0x1000000;
+    }
+    return cts;
+  }
+
+  void parseVideoTag() {
+    const size_t size = _packet.payload->size();
+    _packet.key = 0;
+    if (size < 1) {
+      return;
+    }
+
+    Bitstream bs(_packet.payload->constBytes(), size);
+    int ex   = bs.read(1);
+    int type = bs.read(3);
+    _packet.key = (type == KEY_FRAME);
+
+    if (ex) {
+      if (size < 5) {
+        return;
+      }
+      int pt = bs.read(4);
+               bs.skip(32);
+      if (pt == EX_SEQUENCE_START ||
+          pt == EX_MPEG2TS_SEQUENCE_START) {
+        _packet.type = VIDEO_DCR;
+      }
+    } else {
+      int id = bs.read(4);
+      if ((id == CODECID_H264 || id == CODECID_HEVC) && size >= 2) {
+        int pt = bs.read(8);
+        if (pt == SEQUENCE_HEADER) {
+          _packet.type = VIDEO_DCR;
+        }
+      }
+    }
+  }
+
+  // AMF0 string: [0x02][length:16][chars]
+  static bool isAmfString(const uint8_t* p, size_t size,
+                          const char* str, size_t len) {
+    return size >= 3 + len && p[0] == 0x02 &&
+           (size_t)((p[1] << 8) | p[2]) == len &&
+           memcmp(p + 3, str, len) == 0;
+  }
+
+  void parseScriptTag() {
+    static const char setDataFrame[] = "@setDataFrame";
+    static const char onMetaData[] = "onMetaData";
+    const size_t skip = 3 + sizeof(setDataFrame) - 1;
+
+    const uint8_t* p = _packet.payload->constBytes();
+    size_t size = _packet.payload->size();
+    if (isAmfString(p, size, setDataFrame, sizeof(setDataFrame) - 1)) {
+      // players only understand the bare onMetaData form
+      if (!isAmfString(p + skip, size - skip,
+                       onMetaData, sizeof(onMetaData) - 1)) {
+        return;
+      }
+      byte_t* stripped = byte_t::create(const_cast<uint8_t*>(p) + skip,
+                                        size - skip);
+      _packet.payload->release();
+      _packet.payload = stripped;
+      _packet.type = METADATA;
+    } else if (isAmfString(p, size, onMetaData, sizeof(onMetaData) - 1)) {
+      _packet.type = METADATA;
+    }
+  }
+
   FlvPacketCache& _cache;
   Status _status;
   std::vector<uint8_t> _remain;
@@ -960,6 +1370,8 @@ private:
   size_t _tagsize;
   size_t _cursize;
   FlvPacket _packet;
+  int64_t _lastDts {-1};
+  int64_t _tsOffset {0};
+  bool _rebase {false};
 };
 
-using FlvPacketList = std::list<FlvPacket>;
@@ -0,0 +1,165 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "vod.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+std::mutex VodFile::_mutex;
+std::list<std::string> VodFile::_lru;
+std::unordered_map<std::string, VodFile::Cached> VodFile::_cache;
+
+bool VodIndex::build(const uint8_t* p, size_t size) {
+  if (size < FlvParser::FLV_HEADER_SIZE + FlvParser::FLV_PREV_TAG_SIZE ||
+      memcmp(p, "FLV", 3) != 0) {
+    return false;
+  }
+  flags = p[4];
+  uint32_t offset = (p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+  dataStart = offset + FlvParser::FLV_PREV_TAG_SIZE;
+
+  bool hasVideo = false;
+  bool media = false;
+  bool videoDCR = false;
+  bool audioDCR = false;
+  int64_t lastAudioKey = -1;
+  uint64_t pos = dataStart;
+  while (pos + FlvParser::FLV_TAG_HEADER_SIZE <= size) {
+    const uint8_t* tag = p + pos;
+    uint8_t type = tag[0] & 0x1f;
+    uint32_t dataSize = (tag[1] << 16) | (tag[2] << 8) | tag[3];
+    int64_t dts = (tag[4] << 16) | (tag[5] << 8) | tag[6] | (tag[7] << 24);
+    uint64_t end = pos + FlvParser::FLV_TAG_HEADER_SIZE + dataSize +
+                   FlvParser::FLV_PREV_TAG_SIZE;
+    if (end > size) {
+      break;
+    }
+    const uint8_t* data = tag + FlvParser::FLV_TAG_HEADER_SIZE;
+
+    if (type == FlvParser::TAG_VIDEO && dataSize >= 2) {
+      hasVideo = true;
+      // enhanced flv keeps the packet type where the codec id was
+      bool ex = data[0] & 0x80;
+      uint8_t frame = (data[0] >> 4) & 0x07;
+      uint8_t low = data[0] & 0x0f;
+      bool config = ex ?
+        low == FlvParser::EX_SEQUENCE_START ||
+        low == FlvParser::EX_MPEG2TS_SEQUENCE_START :
+        (low == FlvParser::CODECID_H264 ||
+         low == FlvParser::CODECID_HEVC) &&
+        data[1] == FlvParser::SEQUENCE_HEADER;
+      if (config) {
+        if (!videoDCR) {
+          headers.emplace_back(pos, end);
+          videoDCR = true;
+        }
+      } else if (frame == FlvParser::KEY_FRAME) {
+        keys.push_back(KeyFrame {dts, pos});
+        media = true;
+      }
+    } else if (type == FlvParser::TAG_AUDIO && dataSize >= 2) {
+      bool aac = (data[0] >> 4) == 10;
+      if (aac && data[1] == FlvParser::SEQUENCE_HEADER) {
+        if (!audioDCR) {
+          headers.emplace_back(pos, end);
+          audioDCR = true;
+        }
+      } else if (!hasVideo &&
+                 (lastAudioKey < 0 || dts - lastAudioKey >= 1000)) {
+        keys.push_back(KeyFrame {dts, pos});
+        lastAudioKey = dts;
+        media = true;
+      }
+    } else if (type == FlvParser::TAG_SCRIPT && !media) {
+      headers.emplace_back(pos, end);
+    }
+    pos = end;
+  }
+
+  // a video stream whose first frames came before any keyframe
+  if (hasVideo) {
+    keys.erase(std::remove_if(keys.begin(), keys.end(),
+                              [&](const KeyFrame& k) {
+                                const uint8_t* tag = p + k.offset;
+                                return (tag[0] & 0x1f) != FlvParser::TAG_VIDEO;
+                              }),
+               keys.end());
+  }
+  return true;
+}
+
+uint64_t VodIndex::seek(int64_t dts) const {
+  auto it = std::upper_bound(keys.begin(), keys.end(), dts,
+                             [](int64_t dts, const KeyFrame& k) {
+                               return dts < k.dts;
+                             });
+  if (it == keys.begin()) {
+    return dataStart;
+  }
+  return std::prev(it)->offset;
+}
+
+VodFile::~VodFile() {
+  if (_base) {
+    munmap(_base, _size);
+  }
+}
+
+std::unique_ptr<VodFile> VodFile::open(const std::string& path,
+                                       size_t cached) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+  std::unique_ptr<VodFile> file(new VodFile);
+  file->_base = static_cast<uint8_t*>(p);
+  file->_size = st.st_size;
+
+  std::string version = std::to_string(st.st_size) + ":" +
+                        std::to_string(st.st_mtime);
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _cache.find(path);
+    if (it != std::end(_cache) && it->second.version == version) {
+      _lru.splice(_lru.begin(), _lru, it->second.lru);
+      file->_index = it->second.index;
+      return file;
+    }
+  }
+
+  std::shared_ptr<VodIndex> index(new VodIndex);
+  if (!index->build(file->_base, file->_size)) {
+    return nullptr;
+  }
+  file->_index = index;
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto it = _cache.find(path);
+  if (it != std::end(_cache)) {
+    _lru.erase(it->second.lru);
+    _cache.erase(it);
+  }
+  _lru.push_front(path);
+  _cache[path] = Cached {version, index, _lru.begin()};
+  // viewers of an evicted file keep its index until they are done
+  while (_cache.size() > std::max<size_t>(cached, 1)) {
+    _cache.erase(_lru.back());
+    _lru.pop_back();
+  }
+  return file;
+}
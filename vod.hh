@@ -0,0 +1,74 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include <list>
+#include <mutex>
+
+// Where the tags of an flv file are, found by scanning their headers
+// once. Serving from a timestamp needs the keyframes, and the tags a
+// player must see first (onMetaData and the decoder configs).
+struct VodIndex {
+  struct KeyFrame {
+    int64_t  dts;
+    uint64_t offset;
+  };
+
+  uint8_t flags {0x05};
+  uint64_t dataStart {0};
+  std::vector<KeyFrame> keys;
+  // [begin, end) of every header tag, its previous-tag-size included
+  std::vector<std::pair<uint64_t, uint64_t>> headers;
+
+  bool build(const uint8_t* p, size_t size);
+
+  // Offset of the last keyframe at or before `dts`.
+  uint64_t seek(int64_t dts) const;
+};
+
+// A read-only mapping of one flv file with its index. Indexes are
+// cached by path, size and mtime, so only the first viewer of a file
+// pays for the scan; the `cached` most recently opened files keep
+// theirs. The scan reads the whole file: open() blocks, and is not for
+// the middleman's thread (see VodReader).
+class VodFile {
+public:
+  ~VodFile();
+
+  static std::unique_ptr<VodFile> open(const std::string& path,
+                                       size_t cached);
+
+  const uint8_t* data() const {
+    return _base;
+  }
+
+  size_t size() const {
+    return _size;
+  }
+
+  const VodIndex& index() const {
+    return *_index;
+  }
+
+private:
+  VodFile() = default;
+
+  uint8_t* _base {nullptr};
+  size_t _size {0};
+  std::shared_ptr<const VodIndex> _index;
+
+  struct Cached {
+    std::string version;
+    std::shared_ptr<const VodIndex> index;
+    std::list<std::string>::iterator lru;
+  };
+
+  static std::mutex _mutex;
+  // paths, most recently opened first
+  static std::list<std::string> _lru;
+  static std::unordered_map<std::string, Cached> _cache;
+};
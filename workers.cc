@@ -0,0 +1,309 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#include "workers.hh"
+#include "HttpPublish.hh"
+#include "HttpSubscribe.hh"
+#include "HttpHls.hh"
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// how often a worker looks for new packets in a ring, and how much it
+// copies out at a time
+static const auto SHM_POLL_INTERVAL = std::chrono::milliseconds(20);
+static const size_t SHM_POLL_BYTES = 4 << 20;
+
+WorkerHub& WorkerHub::instance() {
+  static WorkerHub hub;
+  return hub;
+}
+
+bool WorkerHub::launch(size_t count) {
+  // the workers are this very command line, plus their control socket
+  std::ifstream in("/proc/self/cmdline", std::ios::binary);
+  std::vector<std::string> args;
+  std::string arg;
+  while (std::getline(in, arg, '\0')) {
+    args.push_back(arg);
+  }
+  if (args.empty()) {
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+      perror("socketpair");
+      return false;
+    }
+    // everything the child needs is built before the fork, it only
+    // execs
+    auto child_args = args;
+    child_args.push_back("--workers.control-fd=" + std::to_string(sv[1]));
+    std::vector<char*> argv;
+    for (auto& a : child_args) {
+      argv.push_back(const_cast<char*>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      close(sv[0]);
+      close(sv[1]);
+      return false;
+    } else if (pid == 0) {
+      // each on a node in turn, threads and memory, for good
+      if (numa::enabled()) {
+        numa::bindThread(i % numa::nodes());
+      }
+      fcntl(sv[1], F_SETFD, 0);
+      execv("/proc/self/exe", argv.data());
+      _exit(127);
+    }
+    close(sv[1]);
+    cout << "worker " << pid << " started" << endl;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _workers.push_back(Worker {pid, sv[0]});
+  }
+  return true;
+}
+
+void WorkerHub::remove(pid_t pid) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto it = std::begin(_workers); it != std::end(_workers); ++it) {
+    if (it->pid == pid) {
+      close(it->control);
+      _workers.erase(it);
+      return;
+    }
+  }
+}
+
+void WorkerReaper(event_based_actor* self) {
+  for (;;) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0 && errno == EINTR) {
+      continue;
+    } else if (pid < 0) {
+      // ECHILD: none left
+      return;
+    }
+    if (WIFSIGNALED(status)) {
+      cout << "worker " << pid << " killed by signal "
+           << WTERMSIG(status) << endl;
+    } else {
+      cout << "worker " << pid << " exited with "
+           << WEXITSTATUS(status) << endl;
+    }
+    WorkerHub::instance().remove(pid);
+  }
+}
+
+void WorkerHub::announce(const std::string& path, int fd) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto& worker : _workers) {
+    struct iovec iov = {const_cast<char*>(path.data()), path.size()};
+    char buf[CMSG_SPACE(sizeof(int))];
+    memset(buf, 0, sizeof(buf));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(worker.control, &msg, MSG_NOSIGNAL) < 0) {
+      perror("announce to worker");
+    }
+  }
+}
+
+int listenReusePort(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  int on = 1;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+      bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void WorkerControl(event_based_actor* self, int fd, const actor& master) {
+  for (;;) {
+    char path[4096];
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {path, sizeof(path)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      cout << "ingest process gone, worker exits" << endl;
+      _exit(0);
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int ring;
+    memcpy(&ring, CMSG_DATA(cmsg), sizeof(int));
+    self->send(master, shm_stream_atom::value, std::string(path, n), ring);
+  }
+}
+
+// Copies what the ring has past our position into the cache. A reader
+// lapped by the writer skips to its newest keyframe.
+static void shmDrain(ShmPubActor* self) {
+  auto& state = self->state;
+  size_t bytes = 0;
+  while (bytes < SHM_POLL_BYTES) {
+    FlvPacket pkt;
+    auto err = state.reader.read(state.pos, pkt);
+    if (err == FlvPacketCache::ERROR) {
+      printf("shm reader(%p) lapped\n", self);
+      state.pos = state.reader.start();
+      continue;
+    } else if (err != FlvPacketCache::OK) {
+      break;
+    }
+    bytes += pkt.payload->size();
+    state.cache.append(pkt);
+  }
+  if (bytes > 0) {
+    hlsWake(self, false);
+  }
+}
+
+behavior ShmPublish(ShmPubActor* self, int fd, const std::string& path) {
+  auto& state = self->state;
+  if (!state.reader.attach(fd)) {
+    cout << "Cannot map the ring of " << path << endl;
+    self->quit();
+    return {};
+  }
+  state.node = numa::streamNode(self->id());
+  numa::NodeScope scope(state.node);
+  // the configs first, then from the newest keyframe on
+  for (auto slot : {ShmRing::SLOT_VIDEO_DCR,
+                    ShmRing::SLOT_AUDIO_DCR,
+                    ShmRing::SLOT_METADATA}) {
+    FlvPacket pkt;
+    if (state.reader.config(slot, pkt)) {
+      state.cache.append(pkt);
+    }
+  }
+  state.pos = state.reader.start();
+  self->set_down_handler([=](const down_msg& msg) {
+    self->state.nsubs--;
+  });
+  self->send(self, shm_poll_atom::value);
+
+  return {
+    [=](shm_poll_atom) {
+      numa::NodeScope scope(self->state.node);
+      bool closed = self->state.reader.closed();
+      shmDrain(self);
+      if (closed) {
+        cout << "stream " << path << " ended" << endl;
+        self->quit();
+        return;
+      }
+      self->delayed_send(self, SHM_POLL_INTERVAL, shm_poll_atom::value);
+    },
+
+    [=](register_atom, const actor& subscriber) {
+      self->state.nsubs++;
+      self->monitor(subscriber);
+      self->link_to(subscriber);
+    },
+
+    [=](fanout_add_atom, int fd) {
+      fanoutAdd(self, fd);
+    },
+
+    [=](fanout_tick_atom) {
+      fanoutTick(self);
+    },
+
+    [=](resync_atom, const actor_addr& subscriber,
+        FlvPacketCache::Mode mode, SubFormat format,
+        int64_t delay, int64_t resume) {
+      FlvPacketList* pkts = resyncPackets(self, format, mode, delay, resume);
+      if (!pkts) {
+        self->send(actor_cast<actor>(subscriber), eagain_atom::value);
+        return;
+      }
+      self->send(actor_cast<actor>(subscriber),
+                 read_resp_atom::value,
+                 (int64_t)pkts,
+                 true);
+    },
+
+    [=](read_some_atom, int64_t old, int64_t last,
+        const actor_addr& subscriber,
+        FlvPacketCache::Mode mode, SubFormat format) {
+      FlvPacketList* pkts = (FlvPacketList*)old;
+      for (auto& pkt : *pkts) {
+        pkt.payload->release();
+      }
+      delete pkts;
+
+      pkts = new FlvPacketList;
+      sourceCache(self, format).getAll(last, *pkts, mode);
+      self->send(actor_cast<actor>(subscriber),
+                 read_resp_atom::value,
+                 (int64_t)pkts,
+                 false);
+    },
+
+    // the DVR ring stays with the ingesting process
+    [=](dvr_seek_atom, const actor_addr& subscriber, int64_t) {
+      self->send(actor_cast<actor>(subscriber), dvr_none_atom::value);
+    },
+
+    [=](hls_get_atom, const std::string& file, int64_t msn, int64_t part,
+        const actor_addr& requester) {
+      hlsGet(self, file, msn, part, requester);
+    },
+
+    [=](hls_check_atom) {
+      hlsWake(self, true);
+    },
+
+    [=](reclaim_atom, int64_t old) {
+      FlvPacketList* pkts = (FlvPacketList*)old;
+      for (auto& pkt : *pkts) {
+        pkt.payload->release();
+      }
+      delete pkts;
+    }
+  };
+}
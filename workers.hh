@@ -0,0 +1,85 @@
+/**
+ * Copyright (C) 2017 Maolin Liu <liu.matthews@gmail.com>.
+ * All Rights Reserved.
+ */
+
+#pragma once
+
+#include "utils.hh"
+#include "shm.hh"
+#include "hls.hh"
+#include "fmp4.hh"
+#include "dvr.hh"
+#include "fanout.hh"
+#include <mutex>
+
+// Multi-process mode ([workers] count > 0): the process started by hand
+// ingests, and also starts `count` copies of itself as workers. The
+// workers share the [workers] port through SO_REUSEPORT and serve the
+// pushed streams from the ShmRings the ingesting process writes, so a
+// stream is parsed once however many processes send it out.
+
+// master -> itself (in a worker): the ring of a stream pushed to the
+// ingesting process, as a memfd now owned by the worker
+using shm_stream_atom = atom_constant<atom("shm_stream")>;
+using shm_poll_atom   = atom_constant<atom("shm_poll")>;
+
+// The ingesting side: one control socket per worker, rings are handed
+// out over them (SCM_RIGHTS).
+class WorkerHub {
+public:
+  static WorkerHub& instance();
+
+  // Re-executes this program `count` times as workers.
+  bool launch(size_t count);
+
+  bool active() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return !_workers.empty();
+  }
+
+  void announce(const std::string& path, int fd);
+
+  // Forgets the worker `pid`, which has exited.
+  void remove(pid_t pid);
+
+private:
+  struct Worker {
+    pid_t pid;
+    int control;
+  };
+
+  WorkerHub() = default;
+
+  std::mutex _mutex;
+  std::vector<Worker> _workers;
+};
+
+// Reaps the workers as they exit and takes them off the hub. Blocks, so
+// runs detached; ends with the last worker.
+void WorkerReaper(event_based_actor* self);
+
+// The listening socket all the workers share.
+int listenReusePort(uint16_t port);
+
+// In a worker: reads announcements off the control socket and passes
+// them to `master`. Blocks, so runs detached; exits the process when
+// the ingesting one goes away.
+void WorkerControl(event_based_actor* self, int fd, const actor& master);
+
+// A stream's publisher in a worker, answering its subscribers like
+// HttpPublish does, out of a cache filled from the ring.
+struct ShmPubState {
+  ShmReader reader;
+  uint64_t pos {0};
+  FlvPacketCache cache {256};
+  HlsContext hls;
+  std::unique_ptr<Fmp4Stream> fmp4;
+  std::unique_ptr<DvrRing> dvr;
+  int nsubs {0};
+  int node {-1};
+  std::unique_ptr<Fanout> fanout;
+};
+
+using ShmPubActor = caf::stateful_actor<ShmPubState, event_based_actor>;
+behavior ShmPublish(ShmPubActor* self, int fd, const std::string& path);